@@ -0,0 +1,615 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   mod_evasive core microbenchmarks
+   Copyright (c) by Jonathan A. Zdziarski
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+/* Replays synthetic or recorded traffic against the hit tables and the lists of
+   the core, without httpd, and reports the time and allocations per operation.
+
+   usage: evasive_bench [-n requests] [-t traffic] [-r access_log] [-b bench]
+                        [-s table size] [-w whitelist entries] [-p patterns]
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "apr_general.h"
+#include "apr_pools.h"
+
+#include "evasive_core.h"
+
+enum { default_requests = 1000000 };
+enum { default_table_size = 3079 };     // DEFAULT_HASH_TBL_SIZE of the module
+enum { default_whitelist = 10000 };
+enum { default_patterns = 100 };
+
+#define REQUEST_INTERVAL    100                     // Microseconds between two requests, 10000 requests per second
+#define HIT_LIST_TTL        apr_time_from_sec(11)   // TTL of the module with its default intervals
+
+/* BEGIN Allocation Counting */
+
+/* glibc lets a program replace malloc; its own allocations are counted as well */
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static size_t allocations;
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+#define ALLOCATIONS_COUNTED 1
+#else
+static size_t allocations;
+#define ALLOCATIONS_COUNTED 0
+#endif
+
+/* END Allocation Counting */
+
+/* BEGIN Traffic */
+
+struct request {
+    apr_sockaddr_t addr;
+    char *uri;
+};
+
+struct traffic {
+    const char *name;
+    struct request *reqs;
+    size_t size;
+};
+
+static apr_uint64_t rng_state = UINT64_C(0x853c49e6748fea9b);
+
+/* xorshift64*, fixed seed so runs are comparable */
+
+static apr_uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * UINT64_C(0x2545f4914f6cdd1d);
+}
+
+static double rng_double(void) {
+    return (double) (rng_next() >> 11) / (double) (UINT64_C(1) << 53);
+}
+
+static void addr_v4(apr_sockaddr_t *addr, apr_uint32_t ip) {
+    memset(addr, 0, sizeof(*addr));
+    addr->family = AF_INET;
+    addr->sa.sin.sin_family = AF_INET;
+    addr->sa.sin.sin_addr.s_addr = htonl(ip);
+}
+
+static void addr_v6(apr_sockaddr_t *addr, const unsigned char *ip) {
+    memset(addr, 0, sizeof(*addr));
+    addr->family = AF_INET6;
+    addr->sa.sin6.sin6_family = AF_INET6;
+    memcpy(addr->sa.sin6.sin6_addr.s6_addr, ip, 16);
+}
+
+static int addr_parse(apr_sockaddr_t *addr, const char *ip) {
+    struct in_addr v4;
+    struct in6_addr v6;
+
+    if (inet_pton(AF_INET, ip, &v4) == 1) {
+        addr_v4(addr, ntohl(v4.s_addr));
+        return 0;
+    }
+    if (inet_pton(AF_INET6, ip, &v6) == 1) {
+        addr_v6(addr, v6.s6_addr);
+        return 0;
+    }
+    return -1;
+}
+
+static char *uri_format(const char *fmt, unsigned long n) {
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), fmt, n);
+    return strdup(buf);
+}
+
+static struct traffic *traffic_alloc(const char *name, size_t size) {
+    struct traffic *tr = calloc(1, sizeof(*tr));
+
+    if (tr == NULL || (tr->reqs = calloc(size, sizeof(*tr->reqs))) == NULL) {
+        fprintf(stderr, "Out of memory for %zu requests\n", size);
+        exit(1);
+    }
+    tr->name = name;
+    tr->size = size;
+    return tr;
+}
+
+/* Many clients of 10.0.0.0/16, each requesting any of few pages */
+
+static struct traffic *traffic_uniform(size_t n) {
+    struct traffic *tr = traffic_alloc("uniform", n);
+
+    for (size_t i = 0; i < n; i++) {
+        addr_v4(&tr->reqs[i].addr, UINT32_C(0x0a000000) | (apr_uint32_t) (rng_next() % 65536));
+        tr->reqs[i].uri = uri_format("/page/%lu.html", (unsigned long) (rng_next() % 1024));
+    }
+    return tr;
+}
+
+/* Few clients browsing a large site, page popularity following Zipf's law */
+
+static struct traffic *traffic_zipf(size_t n) {
+    enum { pages = 100000, clients = 1024 };
+    struct traffic *tr = traffic_alloc("zipf", n);
+    double *cdf = malloc(pages * sizeof(*cdf));
+    double sum = 0;
+
+    if (cdf == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for (size_t k = 0; k < pages; k++)
+        cdf[k] = sum += 1.0 / (double) (k + 1);
+
+    for (size_t i = 0; i < n; i++) {
+        double u = rng_double() * sum;
+        size_t lo = 0, hi = pages - 1;
+
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        addr_v4(&tr->reqs[i].addr, UINT32_C(0xc0a80000) | (apr_uint32_t) (rng_next() % clients));
+        tr->reqs[i].uri = uri_format("/item/%lu", (unsigned long) lo);
+    }
+
+    free(cdf);
+    return tr;
+}
+
+/* A flood from random addresses of one IPv6 /64 on random URIs, every key is new */
+
+static struct traffic *traffic_flood(size_t n) {
+    struct traffic *tr = traffic_alloc("flood", n);
+    unsigned char ip[16] = { 0x20, 0x01, 0x0d, 0xb8 };
+
+    for (size_t i = 0; i < n; i++) {
+        apr_uint64_t host = rng_next();
+
+        memcpy(&ip[8], &host, sizeof(host));
+        addr_v6(&tr->reqs[i].addr, ip);
+        tr->reqs[i].uri = uri_format("/%016lx", (unsigned long) rng_next());
+    }
+    return tr;
+}
+
+/* Requests of an access log in common or combined log format; the query string is dropped like in r->uri */
+
+static struct traffic *traffic_replay(const char *path) {
+    FILE *f = fopen(path, "r");
+    struct traffic *tr;
+    size_t capacity = 1024;
+    char line[8192];
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    tr = traffic_alloc("replay", capacity);
+    tr->size = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *host = line, *uri, *end;
+
+        end = strchr(host, ' ');
+        uri = end ? strchr(end, '"') : NULL;
+        if (uri == NULL)
+            continue;
+        *end = '\0';
+
+        /* "GET /uri HTTP/1.1" */
+        uri = strchr(uri, ' ');
+        if (uri == NULL)
+            continue;
+        uri++;
+        uri[strcspn(uri, " ?\"")] = '\0';
+
+        if (tr->size == capacity) {
+            struct request *reqs = ev_reallocarray(tr->reqs, capacity * 2, sizeof(*reqs));
+
+            if (reqs == NULL) {
+                fprintf(stderr, "Out of memory for %zu requests\n", capacity * 2);
+                exit(1);
+            }
+            tr->reqs = reqs;
+            capacity *= 2;
+        }
+
+        if (addr_parse(&tr->reqs[tr->size].addr, host) != 0)
+            continue;
+        tr->reqs[tr->size].uri = strdup(uri);
+        if (tr->reqs[tr->size].uri == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        tr->size++;
+    }
+    fclose(f);
+
+    if (tr->size == 0) {
+        fprintf(stderr, "%s: no requests found\n", path);
+        exit(1);
+    }
+    return tr;
+}
+
+static void traffic_destroy(struct traffic *tr) {
+    for (size_t i = 0; i < tr->size; i++)
+        free(tr->reqs[i].uri);
+    free(tr->reqs);
+    free(tr);
+}
+
+/* END Traffic */
+
+/* BEGIN Benchmarks */
+
+struct options {
+    size_t requests;
+    size_t table_size;
+    size_t whitelist;
+    size_t patterns;
+};
+
+struct result {
+    size_t ops;
+    apr_uint64_t ns;
+    size_t allocations;
+    apr_uint64_t start;
+    size_t start_allocations;
+};
+
+static volatile size_t sink;    // Keeps results of the measured operations alive
+
+static apr_uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (apr_uint64_t) ts.tv_sec * 1000000000 + (apr_uint64_t) ts.tv_nsec;
+}
+
+static void bench_begin(struct result *res) {
+    res->start_allocations = allocations;
+    res->start = now_ns();
+}
+
+static void bench_end(struct result *res, size_t ops) {
+    res->ns = now_ns() - res->start;
+    res->allocations = allocations - res->start_allocations;
+    res->ops = ops;
+}
+
+static const struct request *request_get(const struct traffic *tr, size_t i) {
+    return &tr->reqs[i % tr->size];
+}
+
+/* One URI and one site hit per request, the way hit_list_hit counts them */
+
+static void bench_ntt(const struct traffic *tr, const struct options *opt, apr_pool_t *pool, struct result *res) {
+    struct ntt *ntt = ntt_create(opt->table_size, pool);
+    apr_time_t t = apr_time_from_sec(1000000000);
+
+    if (ntt == NULL) {
+        fprintf(stderr, "Failed to allocate hashtable\n");
+        exit(1);
+    }
+    ntt_set_ttl(ntt, HIT_LIST_TTL);
+
+    bench_begin(res);
+    for (size_t i = 0; i < opt->requests; i++, t += REQUEST_INTERVAL) {
+        const struct request *req = request_get(tr, i);
+        struct ntt_key keys[2];
+
+        ntt_key_init(&keys[0], &req->addr, NTT_KEY_URI, ntt_hash_uri(req->uri));
+        ntt_key_init(&keys[1], &req->addr, NTT_KEY_SITE, 0);
+        for (size_t k = 0; k < 2; k++) {
+            apr_uint64_t hash_code = ntt_hashcode(&keys[k]);
+            struct ntt_stripe *stripe = ntt_lock(ntt, hash_code);
+            struct ntt_node *n = ntt_find(stripe, &keys[k], hash_code, t);
+
+            if (n == NULL)
+                n = ntt_insert(stripe, &keys[k], hash_code, t);
+            if (n != NULL) {
+                n->timestamp = t;
+                sink += ++n->count;
+            }
+            ntt_unlock(stripe);
+        }
+    }
+    bench_end(res, opt->requests);
+
+    ntt_destroy(ntt);
+}
+
+/* The same hits on the fixed size shared table, without the global mutex */
+
+static void bench_sht(const struct traffic *tr, const struct options *opt, apr_pool_t *pool, struct result *res) {
+    struct sht sht = {
+        .size = ntt_size_get_next(opt->table_size),
+        .ttl = HIT_LIST_TTL,
+    };
+    apr_time_t t = apr_time_from_sec(1000000000);
+
+    sht.slots = apr_pcalloc(pool, sht.size * sizeof(*sht.slots));
+
+    bench_begin(res);
+    for (size_t i = 0; i < opt->requests; i++, t += REQUEST_INTERVAL) {
+        const struct request *req = request_get(tr, i);
+        struct ntt_key keys[2];
+
+        ntt_key_init(&keys[0], &req->addr, NTT_KEY_URI, ntt_hash_uri(req->uri));
+        ntt_key_init(&keys[1], &req->addr, NTT_KEY_SITE, 0);
+        for (size_t k = 0; k < 2; k++) {
+            apr_uint64_t hash_code = ntt_hashcode(&keys[k]);
+            struct ntt_node *n = sht_find(&sht, &keys[k], hash_code);
+
+            if (n == NULL)
+                n = sht_insert(&sht, &keys[k], hash_code, t);
+            n->timestamp = t;
+            sink += ++n->count;
+        }
+    }
+    bench_end(res, opt->requests);
+}
+
+/* The same hits counted in the fixed memory of a sketch, as with DOSSketchSize, at one counter per table slot */
+
+static void bench_sketch(const struct traffic *tr, const struct options *opt, apr_pool_t *pool, struct result *res) {
+    struct sketch *sk = sketch_create(opt->table_size, 1024, apr_time_from_sec(1), apr_time_from_sec(1), pool);
+    apr_time_t t = apr_time_from_sec(1000000000);
+
+    if (sk == NULL) {
+        fprintf(stderr, "Failed to allocate sketch\n");
+        exit(1);
+    }
+
+    bench_begin(res);
+    for (size_t i = 0; i < opt->requests; i++, t += REQUEST_INTERVAL) {
+        const struct request *req = request_get(tr, i);
+        struct ntt_key keys[2];
+
+        ntt_key_init(&keys[0], &req->addr, NTT_KEY_URI, ntt_hash_uri(req->uri));
+        ntt_key_init(&keys[1], &req->addr, NTT_KEY_SITE, 0);
+        for (size_t k = 0; k < 2; k++)
+            sink += sketch_hit(sk, &keys[k], t, 50);
+    }
+    bench_end(res, opt->requests);
+
+    sketch_destroy(sk);
+}
+
+/* Random prefixes of 172.16.0.0/12 and fd00::/8 which the traffic rarely hits, plus a few wildcards */
+
+static void bench_whitelist(const struct traffic *tr, const struct options *opt, __attribute__((unused)) apr_pool_t *pool,
+                            struct result *res) {
+    struct ip_whitelist wl = { .trie = { .nodes = NULL }, .wildcards = { .data = NULL } };
+    char ip[64];
+
+    for (size_t i = 0; i < opt->whitelist; i++) {
+        apr_uint64_t r = rng_next();
+
+        if (i % 4 == 3) {
+            snprintf(ip, sizeof(ip), "fd%02x:%x:%x::/%u", (unsigned) (r & 0xff), (unsigned) ((r >> 8) & 0xffff),
+                     (unsigned) ((r >> 24) & 0xffff), 32 + (unsigned) ((r >> 40) % 33));
+        } else {
+            apr_uint32_t v4 = UINT32_C(0xac100000) | (apr_uint32_t) ((r >> 8) & 0xfffff);
+
+            snprintf(ip, sizeof(ip), "%u.%u.%u.%u/%u", v4 >> 24, (v4 >> 16) & 0xff, (v4 >> 8) & 0xff, v4 & 0xff,
+                     12 + (unsigned) (r % 21));
+        }
+        ip_whitelist_add(&wl, ip);
+    }
+    for (unsigned int i = 0; i < 8; i++) {
+        snprintf(ip, sizeof(ip), "100.*.%u.*", i);
+        ip_whitelist_add(&wl, ip);
+    }
+
+    bench_begin(res);
+    for (size_t i = 0; i < opt->requests; i++)
+        sink += is_whitelisted(&request_get(tr, i)->addr, &wl);
+    bench_end(res, opt->requests);
+
+    ip_whitelist_destroy(&wl);
+}
+
+static void regex_list(struct pcre_vector *vec, size_t patterns) {
+    static const char *const fmts[] = {
+        "^/admin/%lu/",
+        "\\.(php|asp)%lu$",
+        "^/api/v%lu/users/[0-9]+$",
+        "/wp-login%lu",
+    };
+
+    for (size_t i = 0; i < patterns; i++) {
+        char *re = uri_format(fmts[i % 4], (unsigned long) i);
+
+        if (re == NULL || pcre_vector_push(vec, re) != 0) {
+            fprintf(stderr, "Failed to compile URI list\n");
+            exit(1);
+        }
+        free(re);
+    }
+}
+
+static void bench_regex(const struct traffic *tr, const struct options *opt, int combined, struct result *res) {
+    struct pcre_vector vec = { .data = NULL, .size = 0 };
+
+    regex_list(&vec, opt->patterns);
+    if (combined)
+        pcre_vector_combine(&vec);
+
+    /* The first match sets up the matching state of the thread */
+    sink += pcre_vector_match("/", &vec);
+
+    bench_begin(res);
+    for (size_t i = 0; i < opt->requests; i++)
+        sink += pcre_vector_match(request_get(tr, i)->uri, &vec);
+    bench_end(res, opt->requests);
+
+    pcre_vector_destroy(&vec);
+}
+
+static void bench_regex_combined(const struct traffic *tr, const struct options *opt, __attribute__((unused)) apr_pool_t *pool,
+                                 struct result *res) {
+    bench_regex(tr, opt, 1, res);
+}
+
+static void bench_regex_single(const struct traffic *tr, const struct options *opt, __attribute__((unused)) apr_pool_t *pool,
+                               struct result *res) {
+    bench_regex(tr, opt, 0, res);
+}
+
+static const struct bench {
+    const char *name;
+    void (*run)(const struct traffic *tr, const struct options *opt, apr_pool_t *pool, struct result *res);
+} benches[] = {
+    { "ntt", bench_ntt },
+    { "sht", bench_sht },
+    { "sketch", bench_sketch },
+    { "whitelist", bench_whitelist },
+    { "regex", bench_regex_combined },
+    { "regex-each", bench_regex_single },
+};
+
+/* END Benchmarks */
+
+static void print_log(int level, const char *fmt, va_list ap) {
+    if (level <= EVASIVE_LOG_WARNING) {
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-n requests] [-t uniform|zipf|flood] [-r access_log] [-b bench]\n"
+                    "       [-s table size] [-w whitelist entries] [-p patterns]\n", argv0);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    struct options opt = {
+        .requests = default_requests,
+        .table_size = default_table_size,
+        .whitelist = default_whitelist,
+        .patterns = default_patterns,
+    };
+    const char *traffic_name = NULL, *replay = NULL, *bench_name = NULL;
+    struct traffic *traffics[4];
+    size_t num_traffics = 0;
+    apr_pool_t *pool, *bench_pool;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:t:r:b:s:w:p:")) != -1) {
+        switch (c) {
+        case 'n': opt.requests = strtoul(optarg, NULL, 10); break;
+        case 't': traffic_name = optarg; break;
+        case 'r': replay = optarg; break;
+        case 'b': bench_name = optarg; break;
+        case 's': opt.table_size = strtoul(optarg, NULL, 10); break;
+        case 'w': opt.whitelist = strtoul(optarg, NULL, 10); break;
+        case 'p': opt.patterns = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || opt.requests == 0)
+        usage(argv[0]);
+
+    apr_initialize();
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS || apr_pool_create(&bench_pool, pool) != APR_SUCCESS) {
+        fprintf(stderr, "Failed to create memory pool\n");
+        return 1;
+    }
+    evasive_log_hook = print_log;
+    ntt_secret_init();
+    if (pcre_context_init(pool) != APR_SUCCESS)
+        fprintf(stderr, "Failed to create thread key for regex matching\n");
+
+    /* A recorded log only, unless synthetic traffic is asked for as well */
+    if (replay != NULL)
+        traffics[num_traffics++] = traffic_replay(replay);
+    if (traffic_name == NULL ? replay == NULL : strcmp("uniform", traffic_name) == 0)
+        traffics[num_traffics++] = traffic_uniform(opt.requests);
+    if (traffic_name == NULL ? replay == NULL : strcmp("zipf", traffic_name) == 0)
+        traffics[num_traffics++] = traffic_zipf(opt.requests);
+    if (traffic_name == NULL ? replay == NULL : strcmp("flood", traffic_name) == 0)
+        traffics[num_traffics++] = traffic_flood(opt.requests);
+    if (num_traffics == 0)
+        usage(argv[0]);
+
+    printf("%-8s %-11s %10s %10s %14s %11s\n", "traffic", "bench", "ops", "ns/op", "ops/sec",
+           ALLOCATIONS_COUNTED ? "allocs/op" : "allocs/op*");
+    for (size_t i = 0; i < num_traffics; i++) {
+        for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+            struct result res;
+
+            if (bench_name != NULL && strcmp(bench_name, benches[b].name) != 0)
+                continue;
+
+            benches[b].run(traffics[i], &opt, bench_pool, &res);
+            printf("%-8s %-11s %10zu %10.1f %14.0f %11.4f\n", traffics[i]->name, benches[b].name, res.ops,
+                   (double) res.ns / (double) res.ops, (double) res.ops * 1e9 / (double) (res.ns ? res.ns : 1),
+                   (double) res.allocations / (double) res.ops);
+            apr_pool_clear(bench_pool);
+        }
+        traffic_destroy(traffics[i]);
+    }
+    if (!ALLOCATIONS_COUNTED)
+        printf("* allocations are only counted with glibc\n");
+
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}
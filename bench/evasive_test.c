@@ -0,0 +1,694 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   mod_evasive core functional tests
+   Copyright (c) by Jonathan A. Zdziarski
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+/* Checks the hit tables, the rate algorithms, the address tries, URI
+   canonicalization and list files of the core, without httpd.  Exits with 1
+   if any check fails.
+
+   usage: evasive_test [test]
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "apr_general.h"
+#include "apr_pools.h"
+
+#include "evasive_core.h"
+
+#define T0  apr_time_from_sec(1000000000)   // Whole second, so window edges fall on round numbers
+
+static int failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/* BEGIN Helpers */
+
+static void addr_parse(apr_sockaddr_t *addr, const char *ip) {
+    memset(addr, 0, sizeof(*addr));
+    if (inet_pton(AF_INET, ip, &addr->sa.sin.sin_addr) == 1) {
+        addr->family = AF_INET;
+        addr->sa.sin.sin_family = AF_INET;
+    } else if (inet_pton(AF_INET6, ip, &addr->sa.sin6.sin6_addr) == 1) {
+        addr->family = AF_INET6;
+        addr->sa.sin6.sin6_family = AF_INET6;
+    } else {
+        fprintf(stderr, "Invalid test address %s\n", ip);
+        exit(1);
+    }
+}
+
+static int listed(const struct ip_whitelist *wl, const char *ip) {
+    apr_sockaddr_t addr;
+
+    addr_parse(&addr, ip);
+    return is_whitelisted(&addr, wl);
+}
+
+/* A distinct key of a single client for every n */
+
+static void key_make(struct ntt_key *key, apr_uint64_t n) {
+    apr_sockaddr_t addr;
+
+    addr_parse(&addr, "192.0.2.1");
+    ntt_key_init(key, &addr, NTT_KEY_URI, n);
+}
+
+static struct ntt_node *ntt_get(struct ntt *ntt, apr_uint64_t n, apr_time_t t) {
+    struct ntt_key key;
+    apr_uint64_t hash_code;
+    struct ntt_stripe *stripe;
+    struct ntt_node *node;
+
+    key_make(&key, n);
+    hash_code = ntt_hashcode(&key);
+    stripe = ntt_lock(ntt, hash_code);
+    node = ntt_find(stripe, &key, hash_code, t);
+    ntt_unlock(stripe);
+    return node;
+}
+
+static void ntt_put(struct ntt *ntt, apr_uint64_t n, apr_time_t t) {
+    struct ntt_key key;
+    apr_uint64_t hash_code;
+    struct ntt_stripe *stripe;
+    struct ntt_node *node;
+
+    key_make(&key, n);
+    hash_code = ntt_hashcode(&key);
+    stripe = ntt_lock(ntt, hash_code);
+    node = ntt_insert(stripe, &key, hash_code, t);
+    if (node != NULL)
+        node->count = (size_t) n;
+    ntt_unlock(stripe);
+    CHECK(node != NULL);
+}
+
+static size_t ntt_items(const struct ntt *ntt) {
+    size_t items = 0;
+
+    for (size_t i = 0; i < ntt_num_stripes; i++)
+        items += ntt->stripes[i].items + ntt->stripes[i].old_items;
+    return items;
+}
+
+static int hit(struct ntt *ntt, int algorithm, apr_uint64_t n, apr_time_t t, apr_interval_time_t interval,
+        unsigned int threshold) {
+    struct ntt_key key;
+
+    key_make(&key, n);
+    return ntt_hit(ntt, algorithm, &key, t, interval, threshold);
+}
+
+static void file_write(const char *path, const char *data, size_t size) {
+    FILE *f = fopen(path, "wb");
+
+    if (f == NULL || fwrite(data, 1, size, f) != size || fclose(f) != 0) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        exit(1);
+    }
+}
+
+static char *file_read(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    char *data;
+    long n;
+
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (n = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0
+            || (data = malloc((size_t) n + 1)) == NULL || fread(data, 1, (size_t) n, f) != (size_t) n) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+    *size = (size_t) n;
+    return data;
+}
+
+/* Bytes before the first serialized code, and where in a code PCRE2 keeps its size, as list_file_open finds them */
+
+static int stream_layout(apr_uint64_t *overhead, size_t *size_offset) {
+    const pcre2_code *codes[1];
+    pcre2_code *re;
+    uint8_t *bytes;
+    PCRE2_SIZE bytes_size, erroffset;
+    size_t code_size;
+    int rc = -1;
+    int err;
+
+    re = pcre2_compile((PCRE2_SPTR) "x", 1, 0, &err, &erroffset, NULL);
+    if (re == NULL)
+        return -1;
+    codes[0] = re;
+
+    if (pcre2_pattern_info(re, PCRE2_INFO_SIZE, &code_size) == 0
+            && pcre2_serialize_encode(codes, 1, &bytes, &bytes_size, NULL) == 1) {
+        *overhead = bytes_size - code_size;
+        for (size_t offset = 0; rc != 0 && offset + sizeof(size_t) <= code_size; offset += sizeof(size_t)) {
+            size_t v;
+
+            memcpy(&v, bytes + *overhead + offset, sizeof(v));
+            if (v == code_size) {
+                *size_offset = offset;
+                rc = 0;
+            }
+        }
+        pcre2_serialize_free(bytes);
+    }
+    pcre2_code_free(re);
+
+    return rc;
+}
+
+/* Whether a list file made of data is accepted */
+
+static int list_file_accepted(const char *path, const char *data, size_t size) {
+    struct list_file *list;
+
+    file_write(path, data, size);
+    list = list_file_open(path);
+    if (list == NULL)
+        return 0;
+    list_file_close(list);
+    return 1;
+}
+
+/* END Helpers */
+
+/* BEGIN Tests */
+
+/* Keys survive growing, expiring and shrinking stripes, including lookups while nodes are still being moved */
+
+static void test_ntt(apr_pool_t *pool) {
+    enum { keys = 20000, window = 5000 };
+    struct ntt *ntt = ntt_create(ntt_num_stripes * ntt_min_stripe_size, pool);
+    apr_time_t ttl = apr_time_from_sec(1);
+    apr_time_t t;
+    int lost = 0;
+
+    CHECK(ntt != NULL);
+    if (ntt == NULL)
+        return;
+    ntt_set_ttl(ntt, ttl);
+
+    /* Growth: every key stays found, with its own count, while the stripes resize underneath */
+    for (apr_uint64_t n = 1; n <= keys; n++) {
+        ntt_put(ntt, n, T0);
+        if (n % 97 == 0) {
+            for (apr_uint64_t m = 1; m <= n; m += 13) {
+                struct ntt_node *node = ntt_get(ntt, m, T0);
+
+                lost += node == NULL || node->count != m;
+            }
+        }
+    }
+    CHECK(lost == 0);
+    CHECK(ntt_items(ntt) == keys);
+    for (size_t i = 0; i < ntt_num_stripes; i++)
+        CHECK(ntt->stripes[i].size > ntt_min_stripe_size);
+
+    /* Inserting a key again replaces it */
+    ntt_put(ntt, 1, T0);
+    CHECK(ntt_items(ntt) == keys);
+
+    /* Expiry: lookups sweep the expired keys out and the stripes shrink back to their configured size */
+    t = T0 + 2 * ttl;
+    for (apr_uint64_t n = keys + 1; n <= 20 * keys; n++)
+        CHECK(ntt_get(ntt, n, t) == NULL);
+    CHECK(ntt_items(ntt) == 0);
+    for (size_t i = 0; i < ntt_num_stripes; i++)
+        CHECK(ntt->stripes[i].size == ntt->stripes[i].min_size && ntt->stripes[i].old_tbl == NULL);
+
+    /* Churn: a steady stream of new keys, each live for the TTL, removed by the sweep after it */
+    lost = 0;
+    for (apr_uint64_t n = 1; n <= 20 * window; n++) {
+        t += ttl / window;
+        ntt_put(ntt, n, t);
+        if (n % 1000 == 0) {
+            for (apr_uint64_t m = n > window / 2 ? n - window / 2 + 1 : 1; m <= n; m++) {
+                struct ntt_node *node = ntt_get(ntt, m, t);
+
+                lost += node == NULL || node->count != m;
+            }
+        }
+    }
+    CHECK(lost == 0);
+    CHECK(ntt_items(ntt) >= window && ntt_items(ntt) < 4 * window);
+
+    ntt_destroy(ntt);
+}
+
+/* Prefixes of any length, in particular not ending on a trie stride, match exactly their range */
+
+static void test_trie(apr_pool_t *pool) {
+    struct ip_whitelist wl = { .trie = { .nodes = NULL }, .wildcards = { .data = NULL } };
+    (void) pool;
+
+    CHECK(ip_whitelist_add(&wl, "10.0.0.0/8") == 0);
+    CHECK(ip_whitelist_add(&wl, "100.64.0.0/10") == 0);
+    CHECK(ip_whitelist_add(&wl, "192.0.2.77") == 0);
+    CHECK(ip_whitelist_add(&wl, "198.51.100.*") == 0);
+    CHECK(ip_whitelist_add(&wl, "203.*.113.*") == 0);
+    CHECK(ip_whitelist_add(&wl, "2001:db8::/32") == 0);
+    CHECK(ip_whitelist_add(&wl, "2a00:1450:4000::/37") == 0);
+    CHECK(ip_whitelist_add(&wl, "fe80::1") == 0);
+    CHECK(ip_whitelist_add(&wl, "10.0.0.0/33") != 0);
+    CHECK(ip_whitelist_add(&wl, "2001:db8::/129") != 0);
+    CHECK(ip_whitelist_add(&wl, "10.0.0.0/0") != 0);
+    CHECK(ip_whitelist_add(&wl, "not an address") != 0);
+    CHECK(wl.wildcards.size == 1);
+
+    /* IPv4 */
+    CHECK(listed(&wl, "10.0.0.0") && listed(&wl, "10.255.255.255"));
+    CHECK(!listed(&wl, "9.255.255.255") && !listed(&wl, "11.0.0.0"));
+    CHECK(listed(&wl, "100.64.0.0") && listed(&wl, "100.127.255.255"));
+    CHECK(!listed(&wl, "100.63.255.255") && !listed(&wl, "100.128.0.0"));
+    CHECK(listed(&wl, "192.0.2.77") && !listed(&wl, "192.0.2.76") && !listed(&wl, "192.0.2.78"));
+    CHECK(listed(&wl, "198.51.100.0") && listed(&wl, "198.51.100.255") && !listed(&wl, "198.51.101.0"));
+    CHECK(listed(&wl, "203.0.113.9") && listed(&wl, "203.200.113.1") && !listed(&wl, "203.0.114.9"));
+
+    /* IPv6 */
+    CHECK(listed(&wl, "2001:db8::") && listed(&wl, "2001:db8:ffff:ffff:ffff:ffff:ffff:ffff"));
+    CHECK(!listed(&wl, "2001:db7:ffff::1") && !listed(&wl, "2001:db9::"));
+    CHECK(listed(&wl, "2a00:1450:4000::") && listed(&wl, "2a00:1450:47ff:ffff::1"));
+    CHECK(!listed(&wl, "2a00:1450:3fff:ffff::1") && !listed(&wl, "2a00:1450:4800::"));
+    CHECK(listed(&wl, "fe80::1") && !listed(&wl, "fe80::2") && !listed(&wl, "fe80::1:1"));
+
+    /* The families are kept apart */
+    CHECK(!listed(&wl, "::a00:1") && !listed(&wl, "c000:24d::"));
+
+    ip_whitelist_destroy(&wl);
+}
+
+
+/* Hits just within and just past the interval of every rate algorithm */
+
+static void test_rate(apr_pool_t *pool) {
+    struct ntt *ntt = ntt_create(ntt_num_stripes * ntt_min_stripe_size, pool);
+    apr_interval_time_t second = apr_time_from_sec(1);
+    apr_uint64_t key = 0;
+
+    CHECK(ntt != NULL);
+    if (ntt == NULL)
+        return;
+    ntt_set_ttl(ntt, apr_time_from_sec(60));
+
+    /* Fixed, whole seconds: the first hit of a new entry is not counted, threshold more hits are allowed */
+    key++;
+    for (int i = 0; i < 3; i++)
+        CHECK(!hit(ntt, RATE_FIXED, key, T0, second, 2));
+    CHECK(hit(ntt, RATE_FIXED, key, T0 + second - 1, second, 2));
+    key++;
+    for (int i = 0; i < 3; i++)
+        CHECK(!hit(ntt, RATE_FIXED, key, T0 + second - 1, second, 2));
+    CHECK(!hit(ntt, RATE_FIXED, key, T0 + second, second, 2));
+
+    /* Fixed, milliseconds: exact to the microsecond */
+    key++;
+    for (int i = 0; i < 3; i++)
+        CHECK(!hit(ntt, RATE_FIXED, key, T0, apr_time_from_msec(500), 2));
+    CHECK(hit(ntt, RATE_FIXED, key, T0 + apr_time_from_msec(500) - 1, apr_time_from_msec(500), 2));
+    key++;
+    for (int i = 0; i < 3; i++)
+        CHECK(!hit(ntt, RATE_FIXED, key, T0, apr_time_from_msec(500), 2));
+    CHECK(!hit(ntt, RATE_FIXED, key, T0 + apr_time_from_msec(500), apr_time_from_msec(500), 2));
+
+    /* Sliding: threshold hits are allowed within a window */
+    key++;
+    for (int i = 0; i < 10; i++)
+        CHECK(!hit(ntt, RATE_SLIDING, key, T0 + second / 2, second, 10));
+    CHECK(hit(ntt, RATE_SLIDING, key, T0 + second - 1, second, 10));
+
+    /* Sliding: the previous window weighs in full at the start of the next one, and not at all at its end */
+    key++;
+    for (int i = 0; i < 10; i++)
+        hit(ntt, RATE_SLIDING, key, T0 + second / 2, second, 10);
+    CHECK(hit(ntt, RATE_SLIDING, key, T0 + second, second, 10));
+    key++;
+    for (int i = 0; i < 10; i++)
+        hit(ntt, RATE_SLIDING, key, T0 + second / 2, second, 10);
+    CHECK(!hit(ntt, RATE_SLIDING, key, T0 + 2 * second - 1, second, 10));
+    key++;
+    for (int i = 0; i < 10; i++)
+        hit(ntt, RATE_SLIDING, key, T0 + second / 2, second, 10);
+    CHECK(!hit(ntt, RATE_SLIDING, key, T0 + 2 * second, second, 10));
+
+    /* Bucket: a burst of threshold hits, then one more every interval / threshold */
+    key++;
+    for (int i = 0; i < 4; i++)
+        CHECK(!hit(ntt, RATE_BUCKET, key, T0, second, 4));
+    CHECK(hit(ntt, RATE_BUCKET, key, T0, second, 4));
+    CHECK(hit(ntt, RATE_BUCKET, key, T0 + second / 4 - 1, second, 4));
+    CHECK(!hit(ntt, RATE_BUCKET, key, T0 + second / 4, second, 4));
+    CHECK(hit(ntt, RATE_BUCKET, key, T0 + second / 4, second, 4));
+    CHECK(!hit(ntt, RATE_BUCKET, key, T0 + 10 * second, second, 4));
+
+    /* The TTL outlives every interval the algorithm looks at */
+    CHECK(hit_ttl(RATE_FIXED, second, 3 * second, 2 * second) == 4 * second);
+    CHECK(hit_ttl(RATE_SLIDING, second, 3 * second, 2 * second) == 7 * second);
+    CHECK(hit_ttl(RATE_BUCKET, 10 * second, 3 * second, 2 * second) == 11 * second);
+
+    ntt_destroy(ntt);
+}
+
+/* Windows of a count-min sketch: counters a key hit earlier are cleared by its first hit in a later window,
+   whether or not other keys were hit in between */
+
+static void test_sketch(apr_pool_t *pool) {
+    apr_interval_time_t second = apr_time_from_sec(1);
+    struct sketch *sk = sketch_create(64, 16, second, second, pool);
+
+    CHECK(sk != NULL);
+    if (sk == NULL)
+        return;
+
+    for (apr_uint32_t i = 1; i <= 5; i++)
+        CHECK(cms_add(&sk->page, 42, T0 + second - 1) == i);
+    CHECK(cms_add(&sk->page, 42, T0 + second) == 1);
+
+    for (apr_uint64_t key = 0; key < 16; key++)
+        cms_add(&sk->page, key << 32 | key, T0 + 2 * second);
+    CHECK(cms_add(&sk->page, 42, T0 + 3 * second) == 1);
+    CHECK(cms_add(&sk->page, 42, T0 + 3 * second) == 2);
+
+    /* The windows of the two sketches are their own */
+    CHECK(cms_add(&sk->site, 42, T0 + 3 * second) == 1);
+
+    sketch_destroy(sk);
+}
+
+static void test_uri(apr_pool_t *pool) {
+    static const struct {
+        const char *uri;
+        unsigned int flags;
+        const char *canonical;
+    } cases[] = {
+        { "/a//b", URI_MERGE_SLASHES, "/a/b" },
+        { "//", URI_MERGE_SLASHES, "/" },
+        { "/a//b", 0, "/a//b" },
+        { "/a;jsessionid=1/b;v=2", URI_STRIP_PARAMS, "/a/b" },
+        { "/a;", URI_STRIP_PARAMS, "/a" },
+        { "/a;x//b", URI_STRIP_PARAMS | URI_MERGE_SLASHES, "/a/b" },
+        { "/A/b/C", URI_LOWERCASE, "/a/b/c" },
+        { "/a/", URI_TRAILING_SLASH, "/a" },
+        { "/", URI_TRAILING_SLASH, "/" },
+        { "//", URI_MERGE_SLASHES | URI_TRAILING_SLASH, "/" },
+        { "/A//B;x/", URI_MERGE_SLASHES | URI_STRIP_PARAMS | URI_LOWERCASE | URI_TRAILING_SLASH, "/a/b" },
+        { "/a/b", URI_MERGE_SLASHES | URI_STRIP_PARAMS | URI_LOWERCASE | URI_TRAILING_SLASH, "/a/b" },
+        { "", URI_MERGE_SLASHES | URI_TRAILING_SLASH, "" },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const char *canonical = uri_canonicalize(cases[i].uri, cases[i].flags, pool);
+
+        if (strcmp(canonical, cases[i].canonical) != 0) {
+            fprintf(stderr, "uri_canonicalize(\"%s\", %u) is \"%s\", not \"%s\"\n", cases[i].uri, cases[i].flags,
+                    canonical, cases[i].canonical);
+            failures++;
+        }
+
+        /* URIs already canonical are used in place */
+        CHECK((canonical == cases[i].uri) == (strcmp(cases[i].uri, cases[i].canonical) == 0));
+    }
+}
+
+/* A combined list matches what its patterns match one by one */
+
+static void test_regex(apr_pool_t *pool) {
+    static const char *const plain[] = { "^/wp-login\\.php", "^/(?i)admin/", "\\.(?:bak|old)$" };
+    static const char *const numbered[] = { "^/(?<a>a)\\1$", "^/x(?<b>b)\\k<b>$" };
+    static const char *const subroutine[] = { "^/z$", "^/(?<d>[0-9])-(?1)$" };
+    static const char *const leaking[] = { "^/q\\Qx", "^/y$" };
+    struct pcre_vector vec = { .data = NULL, .size = 0 };
+    (void) pool;
+
+    for (size_t i = 0; i < sizeof(plain) / sizeof(plain[0]); i++)
+        CHECK(pcre_vector_push(&vec, plain[i]) == 0);
+    pcre_vector_combine(&vec);
+    CHECK(vec.combined.re != NULL);
+    CHECK(pcre_vector_match("/wp-login.php", &vec) && pcre_vector_match("/ADMIN/x", &vec));
+    CHECK(pcre_vector_match("/index.bak", &vec) && !pcre_vector_match("/wp-loginxphp", &vec));
+    CHECK(!pcre_vector_match("/Admin", &vec) && pcre_vector_find("/a.old", &vec) == 2);
+    pcre_vector_destroy(&vec);
+
+    /* Groups referred to by number would be renumbered in the combined pattern */
+    memset(&vec, 0, sizeof(vec));
+    for (size_t i = 0; i < sizeof(numbered) / sizeof(numbered[0]); i++)
+        CHECK(pcre_vector_push(&vec, numbered[i]) == 0);
+    pcre_vector_combine(&vec);
+    CHECK(pcre_vector_match("/aa", &vec) && pcre_vector_match("/xbb", &vec));
+    CHECK(!pcre_vector_match("/ab", &vec) && !pcre_vector_match("/xba", &vec));
+    pcre_vector_destroy(&vec);
+
+    memset(&vec, 0, sizeof(vec));
+    for (size_t i = 0; i < sizeof(subroutine) / sizeof(subroutine[0]); i++)
+        CHECK(pcre_vector_push(&vec, subroutine[i]) == 0);
+    pcre_vector_combine(&vec);
+    CHECK(pcre_vector_match("/1-2", &vec) && pcre_vector_match("/z", &vec) && !pcre_vector_match("/1-z", &vec));
+    pcre_vector_destroy(&vec);
+
+    /* A pattern must not swallow the ones after it */
+    memset(&vec, 0, sizeof(vec));
+    for (size_t i = 0; i < sizeof(leaking) / sizeof(leaking[0]); i++)
+        CHECK(pcre_vector_push(&vec, leaking[i]) == 0);
+    pcre_vector_combine(&vec);
+    CHECK(pcre_vector_match("/qx", &vec) && pcre_vector_match("/y", &vec) && !pcre_vector_match("/z", &vec));
+    pcre_vector_destroy(&vec);
+}
+
+/* A list file reads back as compiled, and any truncated or damaged file is refused */
+
+static void test_list_file(apr_pool_t *pool) {
+    static const char source_text[] =
+        "# test list\n"
+        "\n"
+        "whitelist 10.0.0.0/8\n"
+        "whitelist 2001:db8::/32\n"
+        "blocklist 198.51.100.0/24\n"
+        "blocklist 2a00:1450:4000::/37\n"
+        "blocklist-uri ^/wp-login\\.php\n"
+        "blocklist-uri ^/xmlrpc \n";
+    const char *dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    char source[256], path[256], copy[256];
+    struct list_file *list;
+    struct list_file_header hdr;
+    apr_uint64_t sizes_at, size;
+    char *data;
+    size_t data_size;
+
+    snprintf(source, sizeof(source), "%s/evasive_test.%ld.txt", dir, (long) getpid());
+    snprintf(path, sizeof(path), "%s/evasive_test.%ld.list", dir, (long) getpid());
+    snprintf(copy, sizeof(copy), "%s/evasive_test.%ld.bad", dir, (long) getpid());
+
+    /* Sources with errors make no file */
+    file_write(source, "blocklist-uri (\n", 16);
+    CHECK(list_file_compile(source, path, pool) != 0);
+    file_write(source, "greylist 10.0.0.1\n", 18);
+    CHECK(list_file_compile(source, path, pool) != 0);
+    file_write(source, "whitelist 10.*.0.*\n", 19);
+    CHECK(list_file_compile(source, path, pool) != 0);
+    CHECK(access(path, F_OK) != 0);
+
+    /* Round trip */
+    file_write(source, source_text, sizeof(source_text) - 1);
+    CHECK(list_file_compile(source, path, pool) == 0);
+    list = list_file_open(path);
+    CHECK(list != NULL);
+    if (list == NULL)
+        goto out;
+    CHECK(listed(&list->whitelist, "10.1.2.3") && listed(&list->whitelist, "2001:db8::1"));
+    CHECK(!listed(&list->whitelist, "198.51.100.1") && !listed(&list->whitelist, "11.0.0.0"));
+    CHECK(listed(&list->blocklist, "198.51.100.255") && listed(&list->blocklist, "2a00:1450:47ff::1"));
+    CHECK(!listed(&list->blocklist, "198.51.101.0") && !listed(&list->blocklist, "2a00:1450:4800::"));
+    CHECK(list->uri_blocklist.size == 2 && list->uri_blocklist.combined.re != NULL);
+    CHECK(strcmp(list->uri_blocklist.data[0].pattern, "^/wp-login\\.php") == 0);
+    CHECK(strcmp(list->uri_blocklist.data[1].pattern, "^/xmlrpc") == 0);
+    CHECK(pcre_vector_match("/wp-login.php", &list->uri_blocklist));
+    CHECK(pcre_vector_find("/xmlrpc.php", &list->uri_blocklist) == 1);
+    CHECK(!pcre_vector_match("/index.html", &list->uri_blocklist));
+    list_file_close(list);
+
+    data = file_read(path, &data_size);
+    memcpy(&hdr, data, sizeof(hdr));
+    CHECK(list_file_accepted(copy, data, data_size));
+
+    /* Every truncation, and trailing garbage */
+    for (size_t n = 0; n < data_size; n++) {
+        if (list_file_accepted(copy, data, n)) {
+            fprintf(stderr, "list file truncated to %zu of %zu bytes is accepted\n", n, data_size);
+            failures++;
+            break;
+        }
+    }
+    data[data_size] = '\0';
+    CHECK(!list_file_accepted(copy, data, data_size + 1));
+
+    /* Another format */
+    data[0] ^= 1;
+    CHECK(!list_file_accepted(copy, data, data_size));
+    data[0] ^= 1;
+
+    /* A trie child out of the trie */
+    {
+        apr_uint32_t child = (apr_uint32_t) hdr.whitelist_nodes, orig;
+        size_t at = sizeof(hdr) + sizeof(child);
+
+        memcpy(&orig, data + at, sizeof(orig));
+        memcpy(data + at, &child, sizeof(child));
+        CHECK(!list_file_accepted(copy, data, data_size));
+        memcpy(data + at, &orig, sizeof(orig));
+    }
+
+    /* Recorded code sizes which do not match the codes */
+    sizes_at = sizeof(hdr) + (hdr.whitelist_nodes + hdr.blocklist_nodes) * sizeof(struct ip_trie_node);
+    memcpy(&size, data + sizes_at, sizeof(size));
+    for (apr_uint64_t wrong = 0; wrong < 3; wrong++) {
+        apr_uint64_t bad = wrong == 0 ? size + 8 : wrong == 1 ? size - 8 : UINT64_C(1) << 40;
+
+        memcpy(data + sizes_at, &bad, sizeof(bad));
+        CHECK(!list_file_accepted(copy, data, data_size));
+    }
+    memcpy(data + sizes_at, &size, sizeof(size));
+
+    /* Codes of another stream, or which state another size than recorded */
+    {
+        size_t at = (size_t) (sizes_at + hdr.code_count * sizeof(size));
+        apr_uint64_t overhead;
+        size_t size_offset, stated, orig;
+
+        data[at] ^= 1;
+        CHECK(!list_file_accepted(copy, data, data_size));
+        data[at] ^= 1;
+
+        CHECK(stream_layout(&overhead, &size_offset) == 0);
+        at += (size_t) overhead + size_offset;
+        memcpy(&orig, data + at, sizeof(orig));
+        CHECK(orig == size);
+        stated = orig + 8;
+        memcpy(data + at, &stated, sizeof(stated));
+        CHECK(!list_file_accepted(copy, data, data_size));
+        stated = (size_t) 1 << 30;
+        memcpy(data + at, &stated, sizeof(stated));
+        CHECK(!list_file_accepted(copy, data, data_size));
+        memcpy(data + at, &orig, sizeof(orig));
+    }
+
+    /* Patterns without their terminator */
+    data[data_size - 1] = 'x';
+    CHECK(!list_file_accepted(copy, data, data_size));
+    data[data_size - 1] = '\0';
+
+    /* Fewer or more patterns than the header counts; the patterns are the last section, so a missing terminator
+       would be looked for past the end of the mapping */
+    {
+        size_t first = data_size - hdr.patterns_size + strlen(data + data_size - hdr.patterns_size);
+
+        data[first] = 'x';
+        CHECK(!list_file_accepted(copy, data, data_size));
+        data[first] = '\0';
+        data[first - 1] = '\0';
+        CHECK(!list_file_accepted(copy, data, data_size));
+        data[first - 1] = 'p';
+    }
+
+    CHECK(list_file_accepted(copy, data, data_size));
+    free(data);
+
+out:
+    unlink(source);
+    unlink(path);
+    unlink(copy);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(apr_pool_t *pool);
+} tests[] = {
+    { "ntt", test_ntt },
+    { "trie", test_trie },
+    { "rate", test_rate },
+    { "sketch", test_sketch },
+    { "uri", test_uri },
+    { "regex", test_regex },
+    { "list-file", test_list_file },
+};
+
+/* END Tests */
+
+static void print_log(int level, const char *fmt, va_list ap) {
+    if (level <= EVASIVE_LOG_ERR && getenv("EVASIVE_TEST_VERBOSE") != NULL) {
+        vfprintf(stderr, fmt, ap);
+        fputc('\n', stderr);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *test_name = argc > 1 ? argv[1] : NULL;
+    apr_pool_t *pool, *test_pool;
+    int run = 0;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [test]\n", argv[0]);
+        return 2;
+    }
+
+    apr_initialize();
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS || apr_pool_create(&test_pool, pool) != APR_SUCCESS) {
+        fprintf(stderr, "Failed to create memory pool\n");
+        return 1;
+    }
+    evasive_log_hook = print_log;
+    ntt_secret_init();
+    if (pcre_context_init(pool) != APR_SUCCESS)
+        fprintf(stderr, "Failed to create thread key for regex matching\n");
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        int before = failures;
+
+        if (test_name != NULL && strcmp(test_name, tests[i].name) != 0)
+            continue;
+
+        tests[i].run(test_pool);
+        printf("%-10s %s\n", tests[i].name, failures == before ? "ok" : "FAILED");
+        apr_pool_clear(test_pool);
+        run++;
+    }
+    if (run == 0) {
+        fprintf(stderr, "Unknown test %s\n", test_name);
+        return 2;
+    }
+
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return failures ? 1 : 0;
+}
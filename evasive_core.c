@@ -0,0 +1,2275 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   mod_evasive core: hit tables and address and URI lists, without httpd
+   Copyright (c) by Jonathan A. Zdziarski
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include <sys/types.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>  // _getpid
+#define getpid _getpid
+#define strtok_r strtok_s
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>  // getpid(2)
+#endif
+#include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "apr_atomic.h"
+#include "apr_file_io.h"
+#include "apr_general.h"
+#include "apr_mmap.h"
+#include "apr_thread_proc.h"
+
+#include "evasive_core.h"
+
+/* BEGIN Core Hooks */
+
+void (*evasive_log_hook)(int level, const char *fmt, va_list ap);
+void (*ntt_event_hook)(int event);
+
+#ifdef __GNUC__
+__attribute__((format(printf, 2, 3)))
+#endif
+static void evasive_log(int level, const char *fmt, ...) {
+    va_list ap;
+
+    if (evasive_log_hook == NULL)
+        return;
+
+    va_start(ap, fmt);
+    evasive_log_hook(level, fmt, ap);
+    va_end(ap);
+}
+
+static void ntt_event(int event) {
+    if (ntt_event_hook != NULL)
+        ntt_event_hook(event);
+}
+
+/* END Core Hooks */
+
+/* BEGIN List Functions */
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *pcre_context_key;   // Per-thread struct pcre_context, set up by pcre_context_init
+#else
+static struct pcre_context *pcre_context_single;
+#endif
+
+void * ev_reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+        if (size && nmemb > SIZE_MAX / size) {
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        return realloc(ptr, nmemb * size);
+}
+
+static int parse_wildcard(const char *ip, struct in_addr *addr, uint32_t *mask)
+{
+    char *dip;
+    const char *oct;
+    char *safeptr;
+    int i = 0;
+    uint32_t ip_byte = 0, mask_byte = 0;
+    unsigned long val;
+    char *endptr;
+
+    dip = strdup(ip);
+    if (!dip)
+        goto err;
+
+    oct = strtok_r(dip, ".", &safeptr);
+    while(oct != NULL && i < 4) {
+        if (oct[0] == '\0' || strlen(oct) > 3)
+            goto err;
+
+        if (oct[0] == '*' && oct[1] == '\0') {
+            ip_byte += 0;
+            mask_byte += 0;
+        } else {
+            errno = 0;
+            val = strtoul(oct, &endptr, 10);
+            if (errno || *endptr != '\0' || val > 255)
+                goto err;
+
+            ip_byte += val;
+            mask_byte += 255;
+        }
+
+        i++;
+        if (i < 4) {
+            ip_byte <<= 8;
+            mask_byte <<= 8;
+        }
+
+        oct = strtok_r(NULL, ".", &safeptr);
+    }
+
+    if (oct || i != 4)
+        goto err;
+
+    free(dip);
+
+    addr->s_addr = htonl(ip_byte);
+    *mask = htonl(mask_byte);
+    return 1;
+err:
+    free(dip);
+    return -1;
+}
+
+/* Bytewise, since s6_addr is the only member of struct in6_addr every platform has */
+
+static void ipv6_cidr_bits_to_mask(unsigned long cidr_bits, struct in6_addr *mask)
+{
+    for (unsigned i = 0; i < 16; i++) {
+        if (cidr_bits == 0) {
+            mask->s6_addr[i] = 0;
+        } else if (cidr_bits >= 8) {
+            mask->s6_addr[i] = 0xff;
+        } else {
+            mask->s6_addr[i] = (unsigned char) (0xff << (8 - cidr_bits));
+        }
+
+        if (cidr_bits >= 8)
+            cidr_bits -= 8;
+        else
+            cidr_bits = 0;
+    }
+}
+
+static void ipv6_apply_mask(struct in6_addr *addr, const struct in6_addr *mask)
+{
+    for (unsigned i = 0; i < 16; i++)
+        addr->s6_addr[i] &= mask->s6_addr[i];
+}
+
+/* Add a node to the trie; returns its index, or 0 on failure */
+
+static apr_uint32_t ip_trie_new_node(struct ip_trie *trie)
+{
+    if (trie->size == trie->capacity) {
+        size_t capacity = trie->capacity ? trie->capacity * 2 : 64;
+        struct ip_trie_node *nodes;
+
+        if (capacity >= IP_TRIE_MATCH) {
+            errno = ENOMEM;
+            return 0;
+        }
+
+        nodes = ev_reallocarray(trie->nodes, capacity, sizeof(*trie->nodes));
+        if (!nodes)
+            return 0;
+
+        trie->nodes = nodes;
+        trie->capacity = capacity;
+    }
+
+    memset(&trie->nodes[trie->size], 0, sizeof(*trie->nodes));
+    return (apr_uint32_t) trie->size++;
+}
+
+/* Whitelist a prefix of prefix_bits bits of an address in network byte order */
+
+static int ip_trie_insert(struct ip_trie *trie, char family, const unsigned char *addr, unsigned long prefix_bits)
+{
+    apr_uint32_t node;
+
+    if (trie->nodes == NULL) {
+        /* Both roots, so neither can ever be mistaken for a child */
+        if (ip_trie_new_node(trie) != ip_trie_root_v4 || ip_trie_new_node(trie) != ip_trie_root_v6)
+            return -1;
+    }
+
+    node = family == AF_INET ? ip_trie_root_v4 : ip_trie_root_v6;
+    for (unsigned long depth = 0; ; depth += ip_trie_stride) {
+        unsigned int nibble = (addr[depth / 8] >> (4 - depth % 8)) & 0xf;
+        apr_uint32_t child;
+
+        /* The prefix ends in this node, mark every child it covers */
+        if (prefix_bits - depth <= ip_trie_stride) {
+            unsigned int span = 1U << (ip_trie_stride - (prefix_bits - depth));
+
+            nibble &= ~(span - 1);
+            for (unsigned int i = 0; i < span; i++)
+                trie->nodes[node].child[nibble + i] = IP_TRIE_MATCH;
+            return 0;
+        }
+
+        child = trie->nodes[node].child[nibble];
+
+        /* A shorter prefix already covers this one */
+        if (child == IP_TRIE_MATCH)
+            return 0;
+
+        if (child == 0) {
+            child = ip_trie_new_node(trie);
+            if (child == 0)
+                return -1;
+            trie->nodes[node].child[nibble] = child;
+        }
+        node = child;
+    }
+}
+
+/* Whether an address in network byte order is within a whitelisted prefix; takes one step per 4 bits */
+
+static int ip_trie_match(const struct ip_trie *trie, char family, const unsigned char *addr)
+{
+    size_t nibbles = family == AF_INET ? 2 * sizeof(struct in_addr) : 2 * sizeof(struct in6_addr);
+    apr_uint32_t node = family == AF_INET ? ip_trie_root_v4 : ip_trie_root_v6;
+
+    if (trie->nodes == NULL)
+        return 0;
+
+    for (size_t i = 0; i < nibbles; i++) {
+        unsigned int nibble = (i & 1) ? addr[i / 2] & 0xf : addr[i / 2] >> 4;
+        apr_uint32_t child = trie->nodes[node].child[nibble];
+
+        if (child == IP_TRIE_MATCH)
+            return 1;
+        if (child == 0)
+            return 0;
+        node = child;
+    }
+
+    /* Not reached, full length prefixes end in a match */
+    return 0;
+}
+
+
+/* Whitelist an address, a CIDR range or an IPv4 wildcard pattern, e.g. 10.*.0.* */
+
+int ip_whitelist_add(struct ip_whitelist *wl, const char *ip)
+{
+    struct in_addr ipv4;
+    struct in6_addr ipv6, maskv6;
+    struct ip_node *newdata;
+    const char *ip_parse = ip;
+    char *ip_copy = NULL;
+    const char *cidr_split;
+    char *endptr;
+    char family;
+    char wildcard = 0;
+    unsigned long mask_bits;
+    uint32_t maskv4;
+    int rc;
+
+    cidr_split = strchr(ip, '/');
+    if (cidr_split) {
+        ip_copy = malloc(cidr_split - ip + 1);
+        if (!ip_copy) {
+            evasive_log(EVASIVE_LOG_ERR, "DOSWhitelist: OOM");
+            return -1;
+        }
+        memcpy(ip_copy, ip, cidr_split - ip);
+        ip_copy[cidr_split - ip] = '\0';
+
+        ip_parse = ip_copy;
+    }
+
+    if (strchr(ip_parse, '*') != NULL) {
+        family = AF_INET;
+        wildcard = 1;
+        rc = parse_wildcard(ip_parse, &ipv4, &maskv4);
+    } else if (strchr(ip_parse, ':') != NULL) {
+        family = AF_INET6;
+        rc = inet_pton(AF_INET6, ip_parse, &ipv6);
+    } else {
+        family = AF_INET;
+        rc = inet_pton(AF_INET, ip_parse, &ipv4);
+    }
+
+    if (cidr_split)
+        free(ip_copy);
+
+    if (rc != 1) {
+        evasive_log(EVASIVE_LOG_ERR, "DOSWhitelist: Invalid IP address '%s'", ip);
+        return -1;
+    }
+
+    if (cidr_split) {
+        errno = 0;
+        mask_bits = strtoul(cidr_split + 1, &endptr, 10);
+        if (errno || *endptr != '\0' || mask_bits == 0 || mask_bits > (family == AF_INET ? 32 : 128)) {
+            evasive_log(EVASIVE_LOG_ERR, "DOSWhitelist: Invalid IP CIDR range '%s'", ip);
+            return -1;
+        }
+    } else {
+        mask_bits = family == AF_INET ? 32 : 128;
+    }
+
+    if (wildcard) {
+        uint32_t host_bits = ~ntohl(maskv4);
+
+        /* Wildcards only in the trailing octets form a prefix */
+        if ((host_bits & (host_bits + 1)) == 0) {
+            wildcard = 0;
+            for (mask_bits = 32; host_bits != 0; host_bits >>= 1)
+                mask_bits--;
+        }
+    } else if (family == AF_INET) {
+        maskv4 = ~((UINT32_C(1) << (32 - mask_bits)) - 1);
+        maskv4 = htonl(maskv4);
+        ipv4.s_addr &= maskv4;
+    } else {
+        ipv6_cidr_bits_to_mask(mask_bits, &maskv6);
+        ipv6_apply_mask(&ipv6, &maskv6);
+    }
+
+    if (!wildcard) {
+        const unsigned char *addr = family == AF_INET ? (const unsigned char *) &ipv4 : ipv6.s6_addr;
+
+        if (ip_trie_insert(&wl->trie, family, addr, mask_bits) < 0) {
+            evasive_log(EVASIVE_LOG_ERR, "DOSWhitelist: OOM");
+            return -1;
+        }
+        return 0;
+    }
+
+    newdata = ev_reallocarray(wl->wildcards.data, wl->wildcards.size + 1, sizeof(*wl->wildcards.data));
+    if (!newdata) {
+        evasive_log(EVASIVE_LOG_ERR, "DOSWhitelist: OOM");
+        return -1;
+    }
+    wl->wildcards.data = newdata;
+
+    wl->wildcards.data[wl->wildcards.size++] = (struct ip_node) {
+        .family = AF_INET,
+        .ip.v4 = ipv4,
+        .mask.v4 = maskv4,
+    };
+
+    return 0;
+}
+
+void ip_whitelist_destroy(struct ip_whitelist *wl)
+{
+    free(wl->trie.nodes);
+    free(wl->wildcards.data);
+}
+
+/* Compile a pattern, with JIT if available; returns a PCRE2 error number, or 0 on success */
+
+static int pcre_node_compile(struct pcre_node *node, const char *uri_re, PCRE2_SIZE *erroroffset) {
+    int errornumber = 0;
+    int rc;
+
+    node->re = pcre2_compile(
+            (PCRE2_SPTR) uri_re,   /* the pattern */
+            PCRE2_ZERO_TERMINATED, /* indicates pattern is zero-terminated */
+            PCRE2_NO_AUTO_CAPTURE, /* Disable numbered capturing parentheses */
+            &errornumber,          /* for error number */
+            erroroffset,           /* for error offset */
+            NULL);                 /* use default compile context */
+    if (!node->re)
+        return errornumber;
+
+    /* Matching falls back to the interpreter if there is no JIT support */
+    rc = pcre2_jit_compile(node->re, PCRE2_JIT_COMPLETE);
+    if (rc < 0) {
+        PCRE2_UCHAR buffer[256];
+        pcre2_get_error_message(rc, buffer, sizeof(buffer));
+        evasive_log(EVASIVE_LOG_DEBUG, "PCRE2 JIT compilation of regex '%s' failed: %s", uri_re, buffer);
+    }
+
+    return 0;
+}
+
+static void pcre_node_destroy(struct pcre_node *node)
+{
+    pcre2_code_free(node->re);
+    free(node->pattern);
+}
+
+int pcre_vector_push(struct pcre_vector *vec, const char *uri_re) {
+    struct pcre_node *newdata;
+    struct pcre_node node = { .re = NULL, .pattern = NULL };
+    int errornumber;
+    PCRE2_SIZE erroroffset;
+
+    errornumber = pcre_node_compile(&node, uri_re, &erroroffset);
+
+    /* Compilation failed: print the error message and exit. */
+
+    if (errornumber != 0) {
+        PCRE2_UCHAR buffer[256];
+        pcre2_get_error_message(errornumber, buffer, sizeof(buffer));
+        evasive_log(EVASIVE_LOG_ERR, "PCRE2 compilation of regex '%s' failed at offset %lu: %s",
+                    uri_re, (unsigned long) erroroffset, buffer);
+        return -1;
+    }
+
+    node.pattern = strdup(uri_re);
+    newdata = node.pattern ? ev_reallocarray(vec->data, vec->size + 1, sizeof(*(vec->data))) : NULL;
+    if (!newdata) {
+        evasive_log(EVASIVE_LOG_ERR, "Failed to allocate array for URI list");
+        pcre_node_destroy(&node);
+        return -1;
+    }
+    vec->data = newdata;
+
+    vec->data[vec->size++] = node;
+
+    return 0;
+}
+
+/* Whether a pattern refers to a group by its absolute number, or to the whole pattern: \1 and the like, (?1),
+   (?R), (?(1)...), (?(R)...) and \g<1>.  Groups of a combined pattern keep their names, not their numbers.
+   Text escaped with a backslash is skipped; anything else that looks like a reference counts as one. */
+
+static int pcre_pattern_numbered(const struct pcre_node *node) {
+    uint32_t backrefs;
+    const char *p = node->pattern;
+
+    if (pcre2_pattern_info(node->re, PCRE2_INFO_BACKREFMAX, &backrefs) != 0 || backrefs > 0)
+        return 1;
+
+    for (; *p != '\0'; p++) {
+        if (p[0] == '\\' && p[1] == 'g') {
+            const char *q = p + 2 + (p[2] == '<' || p[2] == '\'' || p[2] == '{');
+
+            if (*q >= '0' && *q <= '9')
+                return 1;
+        } else if (p[0] == '(' && p[1] == '?') {
+            const char *q = p + 2 + (p[2] == '(');
+
+            if ((*q >= '0' && *q <= '9') || *q == 'R')
+                return 1;
+        }
+        if (p[0] == '\\' && p[1] != '\0')
+            p++;
+    }
+
+    return 0;
+}
+
+/* Combine the patterns of a list into one alternation, so a URI is matched against the list in a single pass.
+   Every pattern becomes a non-capturing group, so lists with a pattern referring to groups by number are
+   matched pattern by pattern.  A pattern leaking out of its group (e.g. an unterminated \Q) leaves the group
+   open, which is caught by compiling every pattern in its group alone first. */
+
+void pcre_vector_combine(struct pcre_vector *vec) {
+    struct pcre_node node = { .re = NULL, .pattern = NULL };
+    uint32_t expected = 0, captures;
+    size_t len = 0;
+    PCRE2_SIZE erroroffset;
+    int errornumber;
+    char *p;
+
+    if (vec->size < 2 || vec->combined.re != NULL)
+        return;
+
+    for (size_t i = 0; i < vec->size; i++)
+        len += strlen(vec->data[i].pattern) + sizeof("|(?:)");
+
+    node.pattern = malloc(len + 1);
+    if (!node.pattern)
+        return;
+
+    for (size_t i = 0; i < vec->size; i++) {
+        pcre2_code *re;
+        uint32_t own;
+        int contained;
+
+        if (pcre_pattern_numbered(&vec->data[i])) {
+            evasive_log(EVASIVE_LOG_INFO, "URI pattern '%s' refers to groups by number, matching its list of %zu "
+                        "patterns one by one", vec->data[i].pattern, vec->size);
+            free(node.pattern);
+            return;
+        }
+
+        sprintf(node.pattern, "(?:%s)", vec->data[i].pattern);
+        re = pcre2_compile((PCRE2_SPTR) node.pattern, PCRE2_ZERO_TERMINATED, PCRE2_NO_AUTO_CAPTURE, &errornumber,
+                           &erroroffset, NULL);
+        contained = re != NULL && pcre2_pattern_info(re, PCRE2_INFO_CAPTURECOUNT, &captures) == 0
+                && pcre2_pattern_info(vec->data[i].re, PCRE2_INFO_CAPTURECOUNT, &own) == 0 && captures == own;
+        pcre2_code_free(re);
+        if (!contained) {
+            evasive_log(EVASIVE_LOG_INFO, "Could not combine URI list of %zu patterns, matching them one by one",
+                        vec->size);
+            free(node.pattern);
+            return;
+        }
+        expected += own;
+    }
+
+    p = node.pattern;
+    for (size_t i = 0; i < vec->size; i++)
+        p += sprintf(p, "%s(?:%s)", i ? "|" : "", vec->data[i].pattern);
+
+    if (pcre_node_compile(&node, node.pattern, &erroroffset) != 0
+            || pcre2_pattern_info(node.re, PCRE2_INFO_CAPTURECOUNT, &captures) != 0 || captures != expected) {
+        evasive_log(EVASIVE_LOG_INFO, "Could not combine URI list of %zu patterns, matching them one by one", vec->size);
+        pcre_node_destroy(&node);
+        return;
+    }
+
+    vec->combined = node;
+}
+
+void pcre_vector_destroy(struct pcre_vector *vec)
+{
+    for (size_t i = 0; i < vec->size; i++)
+        pcre_node_destroy(&vec->data[i]);
+
+    if (vec->combined.re != NULL)
+        pcre_node_destroy(&vec->combined);
+
+    free(vec->data);
+}
+
+int is_whitelisted(const apr_sockaddr_t *client, const struct ip_whitelist *wl) {
+    switch (client->family) {
+    case AF_INET:
+    case AF_INET6:
+        break;
+    default:
+        evasive_log(EVASIVE_LOG_ERR, "Invalid client family 0x%x", client->family);
+        return 0;
+    }
+
+    if (client->family == AF_INET) {
+        if (ip_trie_match(&wl->trie, AF_INET, (const unsigned char *) &client->sa.sin.sin_addr))
+            return 1;
+    } else {
+        if (ip_trie_match(&wl->trie, AF_INET6, client->sa.sin6.sin6_addr.s6_addr))
+            return 1;
+    }
+
+    for (size_t i = 0; i < wl->wildcards.size; i++) {
+        const struct ip_node *node = &wl->wildcards.data[i];
+        int rc;
+
+        if (node->family != client->family)
+            continue;
+
+        if (client->family == AF_INET) {
+            struct in_addr addrv4 = client->sa.sin.sin_addr;
+            addrv4.s_addr &= node->mask.v4;
+            rc = memcmp(&node->ip.v4, &addrv4, sizeof(node->ip.v4));
+        } else {
+            struct in6_addr addrv6 = client->sa.sin6.sin6_addr;
+            ipv6_apply_mask(&addrv6, &node->mask.v6);
+            rc = memcmp(&node->ip.v6, &addrv6, sizeof(node->ip.v6));
+        }
+
+        if (rc == 0)
+            return 1;
+    }
+
+    /* No match */
+    return 0;
+}
+
+static void pcre_context_destroy(void *data) {
+    struct pcre_context *ctx = (struct pcre_context *) data;
+
+    pcre2_match_data_free(ctx->match_data);
+    pcre2_match_context_free(ctx->match_context);
+    pcre2_jit_stack_free(ctx->jit_stack);
+    free(ctx);
+}
+
+static struct pcre_context *pcre_context_create(void) {
+    struct pcre_context *ctx = (struct pcre_context *) calloc(1, sizeof(struct pcre_context));
+
+    if (ctx == NULL)
+        return NULL;
+
+    ctx->match_data = pcre2_match_data_create(1, NULL);
+    ctx->match_context = pcre2_match_context_create(NULL);
+    ctx->jit_stack = pcre2_jit_stack_create(32 * 1024, 512 * 1024, NULL);
+    if (ctx->match_data == NULL || ctx->match_context == NULL) {
+        pcre_context_destroy(ctx);
+        return NULL;
+    }
+
+    /* Without a JIT stack, JIT matches use 32K of the thread's own stack */
+    if (ctx->jit_stack != NULL)
+        pcre2_jit_stack_assign(ctx->match_context, NULL, ctx->jit_stack);
+
+    return ctx;
+}
+
+/* Set up the per-thread matching state, once per process before any match; without it, every match allocates its own */
+
+apr_status_t pcre_context_init(apr_pool_t *p) {
+#if APR_HAS_THREADS
+    apr_status_t rv = apr_threadkey_private_create(&pcre_context_key, pcre_context_destroy, p);
+
+    if (rv != APR_SUCCESS)
+        pcre_context_key = NULL;
+    return rv;
+#else
+    (void) p;
+    return APR_SUCCESS;
+#endif
+}
+
+/* Get the matching state of the calling thread, allocated on its first match */
+
+static struct pcre_context *pcre_context_get(void) {
+    struct pcre_context *ctx = NULL;
+
+#if APR_HAS_THREADS
+    if (pcre_context_key == NULL || apr_threadkey_private_get((void **) &ctx, pcre_context_key) != APR_SUCCESS)
+        return NULL;
+
+    if (ctx == NULL) {
+        ctx = pcre_context_create();
+        if (ctx != NULL && apr_threadkey_private_set(ctx, pcre_context_key) != APR_SUCCESS) {
+            pcre_context_destroy(ctx);
+            ctx = NULL;
+        }
+    }
+#else
+    if (pcre_context_single == NULL)
+        pcre_context_single = pcre_context_create();
+    ctx = pcre_context_single;
+#endif
+
+    return ctx;
+}
+
+int pcre_vector_match(const char *uri, const struct pcre_vector *vec) {
+    int rc;
+
+    PCRE2_SPTR subject;
+    size_t subject_length;
+
+    struct pcre_context *ctx;
+    pcre2_match_data *match_data;
+    int matched = 0;
+
+    if (vec->size == 0)
+        return 0;
+
+    subject = (PCRE2_SPTR) uri;
+    subject_length = strlen((const char *)subject);
+
+    ctx = pcre_context_get();
+    if (ctx != NULL) {
+        match_data = ctx->match_data;
+    } else {
+        /* No per-thread state, fall back to a temporary block */
+        match_data = pcre2_match_data_create(1, NULL);
+        if (match_data == NULL) {
+            evasive_log(EVASIVE_LOG_ERR, "Failed to allocate PCRE2 match data");
+            return 0;
+        }
+    }
+
+    if (vec->combined.re != NULL) {
+        rc = pcre2_match(vec->combined.re, subject, subject_length, 0, 0, match_data, ctx != NULL ? ctx->match_context : NULL);
+        matched = rc >= 0;
+    } else {
+        for (size_t i = 0; i < vec->size && !matched; i++) {
+            const struct pcre_node *node = &vec->data[i];
+
+            rc = pcre2_match(
+                    node->re,             /* the compiled pattern */
+                    subject,              /* the subject string */
+                    subject_length,       /* the length of the subject */
+                    0,                    /* start at offset 0 in the subject */
+                    0,                    /* default options */
+                    match_data,           /* block for storing the result; 0 if too small, which still is a match */
+                    ctx != NULL ? ctx->match_context : NULL);
+
+            matched = rc >= 0;
+        }
+    }
+
+    if (ctx == NULL)
+        pcre2_match_data_free(match_data);
+
+    return matched;
+}
+
+int pcre_vector_find(const char *uri, const struct pcre_vector *vec) {
+    struct pcre_vector one = { NULL, 1, { NULL, NULL } };
+
+    /* The combined pattern only tells whether some pattern matches, not which one */
+    if (!pcre_vector_match(uri, vec))
+        return -1;
+
+    if (vec->size == 1)
+        return 0;
+
+    for (size_t i = 0; i < vec->size; i++) {
+        one.data = &vec->data[i];
+        if (pcre_vector_match(uri, &one))
+            return (int) i;
+    }
+
+    return -1;
+}
+
+/* Whether uri_canonicalize would leave a URI as it is */
+static int uri_is_canonical(const char *uri, size_t length, unsigned int flags) {
+    for (size_t i = 0; i < length; i++) {
+        char c = uri[i];
+
+        if ((flags & URI_STRIP_PARAMS) && c == ';')
+            return 0;
+        if ((flags & URI_MERGE_SLASHES) && c == '/' && i > 0 && uri[i - 1] == '/')
+            return 0;
+        if ((flags & URI_LOWERCASE) && c >= 'A' && c <= 'Z')
+            return 0;
+    }
+
+    return !((flags & URI_TRAILING_SLASH) && length > 1 && uri[length - 1] == '/');
+}
+
+const char *uri_canonicalize(const char *uri, unsigned int flags, apr_pool_t *pool) {
+    size_t length = strlen(uri);
+    size_t n = 0;
+    char *out;
+
+    /* Most URIs are canonical already and are used in place, so only variants cost an allocation */
+    if (uri_is_canonical(uri, length, flags))
+        return uri;
+
+    out = apr_palloc(pool, length + 1);
+
+    for (size_t i = 0; i < length; i++) {
+        char c = uri[i];
+
+        if ((flags & URI_STRIP_PARAMS) && c == ';') {
+            /* Drop the parameters up to the end of the segment */
+            while (i + 1 < length && uri[i + 1] != '/')
+                i++;
+            continue;
+        }
+        if ((flags & URI_MERGE_SLASHES) && c == '/' && n > 0 && out[n - 1] == '/')
+            continue;
+        if ((flags & URI_LOWERCASE) && c >= 'A' && c <= 'Z')
+            c = (char) (c - 'A' + 'a');
+
+        out[n++] = c;
+    }
+
+    if ((flags & URI_TRAILING_SLASH) && n > 1 && out[n - 1] == '/')
+        n--;
+
+    out[n] = '\0';
+
+    return out;
+}
+
+/* END List Functions */
+
+/* BEGIN List File Functions */
+
+/* Append a trie to a list file; an empty trie is stored without nodes */
+
+static int list_file_write_trie(FILE *file, const struct ip_trie *trie) {
+    return trie->size == 0 || fwrite(trie->nodes, sizeof(*trie->nodes), trie->size, file) == trie->size ? 0 : -1;
+}
+
+/* Compile a list source into a list file. The source has one entry per line, "whitelist <address>",
+   "blocklist <address>" or "blocklist-uri <regex>", with "#" starting a comment; addresses take the forms of
+   DOSWhitelist, but only prefixes, not wildcards in the leading octets. The file is written next to path and
+   renamed over it, so readers only ever see whole files. */
+
+int list_file_compile(const char *source, const char *path, apr_pool_t *pool) {
+    struct ip_whitelist whitelist = { .trie = { .nodes = NULL }, .wildcards = { .data = NULL } };
+    struct ip_whitelist blocklist = { .trie = { .nodes = NULL }, .wildcards = { .data = NULL } };
+    struct pcre_vector uri_blocklist = { .data = NULL, .size = 0 };
+    struct list_file_header hdr = { .magic = LIST_FILE_MAGIC, .node_size = sizeof(struct ip_trie_node) };
+    const pcre2_code **codes = NULL;
+    apr_uint64_t *code_sizes = NULL;
+    uint8_t *serialized = NULL;
+    PCRE2_SIZE serialized_size = 0;
+    char line[8192];
+    unsigned long lineno = 0;
+    char *tmp = NULL;
+    FILE *in;
+    FILE *out = NULL;
+    int rc = -1;
+
+    in = fopen(source, "r");
+    if (in == NULL) {
+        evasive_log(EVASIVE_LOG_ERR, "Failed to open list source %s: %s", source, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        size_t length = strlen(line);
+        char *value;
+        int added;
+
+        lineno++;
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+            evasive_log(EVASIVE_LOG_ERR, "%s:%lu: Line too long", source, lineno);
+            goto out;
+        }
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'
+                    || line[length - 1] == ' ' || line[length - 1] == '\t'))
+            line[--length] = '\0';
+        if (length == 0 || line[0] == '#')
+            continue;
+
+        value = strpbrk(line, " \t");
+        if (value == NULL) {
+            evasive_log(EVASIVE_LOG_ERR, "%s:%lu: Missing value", source, lineno);
+            goto out;
+        }
+        *value++ = '\0';
+        value += strspn(value, " \t");
+
+        if (strcmp(line, "whitelist") == 0) {
+            added = ip_whitelist_add(&whitelist, value);
+        } else if (strcmp(line, "blocklist") == 0) {
+            added = ip_whitelist_add(&blocklist, value);
+        } else if (strcmp(line, "blocklist-uri") == 0) {
+            added = pcre_vector_push(&uri_blocklist, value);
+        } else {
+            evasive_log(EVASIVE_LOG_ERR, "%s:%lu: Unknown list '%s'", source, lineno, line);
+            goto out;
+        }
+
+        if (added != 0) {
+            evasive_log(EVASIVE_LOG_ERR, "%s:%lu: Invalid entry '%s'", source, lineno, value);
+            goto out;
+        }
+        if (whitelist.wildcards.size > 0 || blocklist.wildcards.size > 0) {
+            evasive_log(EVASIVE_LOG_ERR, "%s:%lu: Only prefixes can be compiled, not '%s'", source, lineno, value);
+            goto out;
+        }
+    }
+    if (ferror(in)) {
+        evasive_log(EVASIVE_LOG_ERR, "Failed to read list source %s", source);
+        goto out;
+    }
+
+    /* The combined pattern is compiled once here too, and stored after the others */
+    pcre_vector_combine(&uri_blocklist);
+
+    hdr.pattern_count = uri_blocklist.size;
+    hdr.code_count = uri_blocklist.size + (uri_blocklist.combined.re != NULL);
+    hdr.whitelist_nodes = whitelist.trie.size;
+    hdr.blocklist_nodes = blocklist.trie.size;
+
+    if (hdr.code_count > 0) {
+        codes = calloc(hdr.code_count, sizeof(*codes));
+        code_sizes = calloc(hdr.code_count, sizeof(*code_sizes));
+        if (codes == NULL || code_sizes == NULL) {
+            evasive_log(EVASIVE_LOG_ERR, "Failed to allocate list file codes");
+            goto out;
+        }
+        for (size_t i = 0; i < uri_blocklist.size; i++) {
+            codes[i] = uri_blocklist.data[i].re;
+            hdr.patterns_size += strlen(uri_blocklist.data[i].pattern) + 1;
+        }
+        if (uri_blocklist.combined.re != NULL)
+            codes[uri_blocklist.size] = uri_blocklist.combined.re;
+
+        /* Recorded so that readers check the codes before PCRE2 decodes them */
+        for (apr_uint32_t i = 0; i < hdr.code_count; i++) {
+            size_t size;
+
+            if (pcre2_pattern_info(codes[i], PCRE2_INFO_SIZE, &size) != 0) {
+                evasive_log(EVASIVE_LOG_ERR, "Failed to size the URI blocklist of %s", source);
+                goto out;
+            }
+            code_sizes[i] = size;
+        }
+
+        if (pcre2_serialize_encode(codes, (int32_t) hdr.code_count, &serialized, &serialized_size, NULL) < 0) {
+            evasive_log(EVASIVE_LOG_ERR, "Failed to serialize the URI blocklist of %s", source);
+            goto out;
+        }
+        hdr.codes_size = serialized_size;
+    }
+
+    tmp = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmp == NULL)
+        goto out;
+    sprintf(tmp, "%s.tmp", path);
+
+    out = fopen(tmp, "wb");
+    if (out == NULL) {
+        evasive_log(EVASIVE_LOG_ERR, "Failed to create list file %s: %s", tmp, strerror(errno));
+        goto out;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1
+            || list_file_write_trie(out, &whitelist.trie) != 0
+            || list_file_write_trie(out, &blocklist.trie) != 0
+            || (hdr.code_count > 0 && fwrite(code_sizes, sizeof(*code_sizes), hdr.code_count, out) != hdr.code_count)
+            || (serialized_size > 0 && fwrite(serialized, serialized_size, 1, out) != 1)) {
+        evasive_log(EVASIVE_LOG_ERR, "Failed to write list file %s", tmp);
+        goto out;
+    }
+    for (size_t i = 0; i < uri_blocklist.size; i++) {
+        if (fputs(uri_blocklist.data[i].pattern, out) == EOF || fputc('\0', out) == EOF) {
+            evasive_log(EVASIVE_LOG_ERR, "Failed to write list file %s", tmp);
+            goto out;
+        }
+    }
+
+    rc = fclose(out);
+    out = NULL;
+    if (rc == 0)
+        rc = apr_file_rename(tmp, path, pool) == APR_SUCCESS ? 0 : -1;
+    if (rc != 0)
+        evasive_log(EVASIVE_LOG_ERR, "Failed to replace list file %s", path);
+
+out:
+    if (out != NULL)
+        fclose(out);
+    if (rc != 0 && tmp != NULL)
+        remove(tmp);
+    free(tmp);
+    if (serialized != NULL)
+        pcre2_serialize_free(serialized);
+    free(codes);
+    free(code_sizes);
+    pcre_vector_destroy(&uri_blocklist);
+    ip_whitelist_destroy(&blocklist);
+    ip_whitelist_destroy(&whitelist);
+    fclose(in);
+
+    return rc;
+}
+
+/* Whether every child of a mapped trie is within it; a file is only trusted as far as its nodes are checked */
+
+static int list_file_trie_valid(const struct ip_trie *trie) {
+    if (trie->size == 0)
+        return 1;
+    if (trie->size <= ip_trie_root_v6)
+        return 0;
+
+    for (size_t i = 0; i < trie->size; i++) {
+        for (unsigned int j = 0; j < (1U << ip_trie_stride); j++) {
+            apr_uint32_t child = trie->nodes[i].child[j];
+
+            if (child != IP_TRIE_MATCH && child >= trie->size)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Layout of serialized codes in this PCRE2 build, found by serializing a pattern of a known size: the bytes before
+   the first code, and where in its code the stream keeps the size PCRE2 decodes it with */
+
+static int list_file_stream_layout(apr_uint64_t *overhead, size_t *size_offset) {
+    const pcre2_code *codes[1];
+    pcre2_code *re;
+    uint8_t *bytes;
+    PCRE2_SIZE bytes_size, erroffset;
+    size_t code_size;
+    int rc = -1;
+    int err;
+
+    re = pcre2_compile((PCRE2_SPTR) "x", 1, 0, &err, &erroffset, NULL);
+    if (re == NULL)
+        return -1;
+    codes[0] = re;
+
+    if (pcre2_pattern_info(re, PCRE2_INFO_SIZE, &code_size) == 0
+            && pcre2_serialize_encode(codes, 1, &bytes, &bytes_size, NULL) == 1) {
+        if (bytes_size > code_size) {
+            *overhead = bytes_size - code_size;
+            for (size_t offset = 0; offset + sizeof(size_t) <= code_size; offset += sizeof(size_t)) {
+                size_t v;
+
+                memcpy(&v, bytes + *overhead + offset, sizeof(v));
+                if (v == code_size) {
+                    *size_offset = offset;
+                    rc = 0;
+                    break;
+                }
+            }
+        }
+        pcre2_serialize_free(bytes);
+    }
+    pcre2_code_free(re);
+
+    return rc;
+}
+
+/* Whether serialized codes are exactly as large as their recorded sizes, and every code states its recorded size;
+   PCRE2 trusts the sizes in the stream, so this is what keeps it within the mapping */
+
+static int list_file_codes_valid(const struct list_file_header *hdr, const unsigned char *sizes,
+                                 const unsigned char *codes) {
+    apr_uint64_t overhead, offset;
+    size_t size_offset;
+
+    if (list_file_stream_layout(&overhead, &size_offset) != 0) {
+        evasive_log(EVASIVE_LOG_ERR, "Failed to find the layout of serialized PCRE2 codes");
+        return 0;
+    }
+    if (hdr->codes_size < overhead || pcre2_serialize_get_number_of_codes(codes) != (int32_t) hdr->code_count)
+        return 0;
+
+    offset = overhead;
+    for (apr_uint32_t i = 0; i < hdr->code_count; i++) {
+        apr_uint64_t recorded;
+        size_t stated;
+
+        memcpy(&recorded, sizes + (size_t) i * sizeof(recorded), sizeof(recorded));
+        if (recorded < size_offset + sizeof(stated) || recorded > hdr->codes_size - offset)
+            return 0;
+        memcpy(&stated, codes + offset + size_offset, sizeof(stated));
+        if (stated != recorded)
+            return 0;
+        offset += recorded;
+    }
+
+    return offset == hdr->codes_size;
+}
+
+/* Set up the URI blocklist of a list file from its serialized codes; the patterns stay in the mapping */
+
+static int list_file_load_patterns(struct list_file *list, const struct list_file_header *hdr,
+                                   const unsigned char *sizes, const unsigned char *codes, const char *patterns) {
+    pcre2_code **decoded;
+    const char *end = patterns + hdr->patterns_size;
+    int32_t n;
+
+    if (hdr->code_count != hdr->pattern_count && hdr->code_count != hdr->pattern_count + 1)
+        return -1;
+    if (hdr->pattern_count == 0)
+        return hdr->code_count == 0 && hdr->codes_size == 0 && hdr->patterns_size == 0 ? 0 : -1;
+    if (hdr->patterns_size == 0 || end[-1] != '\0')
+        return -1;
+    if (!list_file_codes_valid(hdr, sizes, codes))
+        return -1;
+
+    decoded = calloc(hdr->code_count, sizeof(*decoded));
+    list->uri_blocklist.data = calloc(hdr->pattern_count, sizeof(struct pcre_node));
+    if (decoded == NULL || list->uri_blocklist.data == NULL) {
+        free(decoded);
+        return -1;
+    }
+
+    /* Decoding only copies the compiled codes; JIT code is process specific and is made again */
+    n = pcre2_serialize_decode(decoded, (int32_t) hdr->code_count, codes, NULL);
+    if (n != (int32_t) hdr->code_count) {
+        evasive_log(EVASIVE_LOG_ERR, "Failed to decode the URI blocklist (%d), was it compiled with another PCRE2?", n);
+        for (int32_t i = 0; i < n; i++)
+            pcre2_code_free(decoded[i]);
+        free(decoded);
+        return -1;
+    }
+
+    for (apr_uint32_t i = 0; i < hdr->code_count; i++) {
+        struct pcre_node *node = i < hdr->pattern_count ? &list->uri_blocklist.data[i] : &list->uri_blocklist.combined;
+        apr_uint64_t recorded;
+        size_t size = 0;
+
+        /* Anything but the codes that were checked is unused */
+        memcpy(&recorded, sizes + (size_t) i * sizeof(recorded), sizeof(recorded));
+        if (pcre2_pattern_info(decoded[i], PCRE2_INFO_SIZE, &size) != 0 || size != recorded) {
+            for (apr_uint32_t j = i; j < hdr->code_count; j++)
+                pcre2_code_free(decoded[j]);
+            free(decoded);
+            return -1;
+        }
+
+        /* Every pattern must end within the section, it is the last one of the mapping */
+        if (i < hdr->pattern_count) {
+            const char *nul = patterns < end ? memchr(patterns, '\0', (size_t) (end - patterns)) : NULL;
+
+            if (nul == NULL) {
+                for (apr_uint32_t j = i; j < hdr->code_count; j++)
+                    pcre2_code_free(decoded[j]);
+                free(decoded);
+                return -1;
+            }
+            node->pattern = (char *) patterns;
+            patterns = nul + 1;
+        }
+
+        pcre2_jit_compile(decoded[i], PCRE2_JIT_COMPLETE);
+        node->re = decoded[i];
+        list->uri_blocklist.size += i < hdr->pattern_count;
+    }
+    free(decoded);
+
+    return patterns == end ? 0 : -1;
+}
+
+struct list_file *list_file_open(const char *path) {
+    struct list_file *list;
+    const struct list_file_header *hdr;
+    const unsigned char *base;
+    apr_uint64_t offset, nodes_size, sizes_size;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_pool_t *pool;
+    apr_status_t rv;
+
+    list = calloc(1, sizeof(struct list_file));
+    if (list == NULL)
+        return NULL;
+
+    rv = apr_pool_create(&pool, NULL);
+    if (rv != APR_SUCCESS) {
+        free(list);
+        return NULL;
+    }
+    list->pool = pool;
+
+    rv = apr_file_open(&file, path, APR_READ | APR_BINARY, APR_OS_DEFAULT, pool);
+    if (rv == APR_SUCCESS)
+        rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+    if (rv == APR_SUCCESS && (apr_uint64_t) finfo.size < sizeof(struct list_file_header)) {
+        evasive_log(EVASIVE_LOG_ERR, "Invalid list file %s", path);
+        list_file_close(list);
+        return NULL;
+    }
+    if (rv == APR_SUCCESS)
+        rv = apr_mmap_create(&mm, file, 0, (apr_size_t) finfo.size, APR_MMAP_READ, pool);
+    if (rv != APR_SUCCESS) {
+        evasive_log(EVASIVE_LOG_ERR, "Failed to map list file %s (%d)", path, rv);
+        list_file_close(list);
+        return NULL;
+    }
+    /* The mapping outlives the descriptor */
+    apr_file_close(file);
+
+    base = (const unsigned char *) mm->mm;
+    hdr = (const struct list_file_header *) base;
+    nodes_size = (hdr->whitelist_nodes + hdr->blocklist_nodes) * sizeof(struct ip_trie_node);
+    sizes_size = (apr_uint64_t) hdr->code_count * sizeof(apr_uint64_t);
+    offset = sizeof(struct list_file_header);
+
+    if (memcmp(hdr->magic, LIST_FILE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->node_size != sizeof(struct ip_trie_node)
+            || hdr->whitelist_nodes > IP_TRIE_MATCH || hdr->blocklist_nodes > IP_TRIE_MATCH
+            || hdr->codes_size > (apr_uint64_t) finfo.size || hdr->patterns_size > (apr_uint64_t) finfo.size
+            || offset + nodes_size + sizes_size + hdr->codes_size + hdr->patterns_size != (apr_uint64_t) finfo.size) {
+        evasive_log(EVASIVE_LOG_ERR, "Invalid list file %s", path);
+        list_file_close(list);
+        return NULL;
+    }
+
+    /* The tries are used in place, sizes without capacity mark them as not owned */
+    list->whitelist.trie = (struct ip_trie) {
+        .nodes = hdr->whitelist_nodes ? (struct ip_trie_node *) (base + offset) : NULL,
+        .size = hdr->whitelist_nodes,
+    };
+    offset += hdr->whitelist_nodes * sizeof(struct ip_trie_node);
+    list->blocklist.trie = (struct ip_trie) {
+        .nodes = hdr->blocklist_nodes ? (struct ip_trie_node *) (base + offset) : NULL,
+        .size = hdr->blocklist_nodes,
+    };
+    offset += hdr->blocklist_nodes * sizeof(struct ip_trie_node);
+
+    if (!list_file_trie_valid(&list->whitelist.trie) || !list_file_trie_valid(&list->blocklist.trie)
+            || list_file_load_patterns(list, hdr, base + offset, base + offset + sizes_size,
+                                       (const char *) (base + offset + sizes_size + hdr->codes_size)) != 0) {
+        evasive_log(EVASIVE_LOG_ERR, "Invalid list file %s", path);
+        list_file_close(list);
+        return NULL;
+    }
+
+    return list;
+}
+
+void list_file_close(struct list_file *list) {
+    for (size_t i = 0; i < list->uri_blocklist.size; i++)
+        pcre2_code_free(list->uri_blocklist.data[i].re);
+    if (list->uri_blocklist.combined.re != NULL)
+        pcre2_code_free(list->uri_blocklist.combined.re);
+    free(list->uri_blocklist.data);
+
+    /* Unmaps the file */
+    apr_pool_destroy(list->pool);
+    free(list);
+}
+
+/* END List File Functions */
+
+
+/* BEGIN NTT (Named Timestamp Tree) Functions */
+
+/* Get the next power of two bigger or equal than the given number */
+
+size_t ntt_size_get_next(size_t n) {
+    size_t size = ntt_min_stripe_size;
+
+    while (size < n && size <= SIZE_MAX / 2)
+        size <<= 1;
+
+    return size;
+}
+
+/* Build a key for a client address */
+
+void ntt_key_init(struct ntt_key *key, const apr_sockaddr_t *addr, apr_uint32_t type, apr_uint64_t uri_hash) {
+    memset(key, 0, sizeof(*key));
+
+    if (addr->family == AF_INET) {
+        key->addr[10] = 0xff;
+        key->addr[11] = 0xff;
+        memcpy(&key->addr[12], &addr->sa.sin.sin_addr, 4);
+    } else if (addr->family == AF_INET6) {
+        memcpy(key->addr, &addr->sa.sin6.sin6_addr, 16);
+    }
+
+    key->type = type;
+    key->uri_hash = uri_hash;
+}
+
+/* Reduce the address of a key to its prefix, of prefix4 bits for IPv4 and prefix6 bits for IPv6 addresses */
+
+void ntt_key_prefix(struct ntt_key *key, unsigned int prefix4, unsigned int prefix6) {
+    static const unsigned char v4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    unsigned int bits = memcmp(key->addr, v4_mapped, sizeof(v4_mapped)) == 0 ? 96 + prefix4 : prefix6;
+
+    for (unsigned int i = 0; i < sizeof(key->addr); i++) {
+        if (bits >= 8) {
+            bits -= 8;
+        } else {
+            key->addr[i] &= (unsigned char) (0xff00 >> bits);
+            bits = 0;
+        }
+    }
+}
+
+/* Secret key of the hash function, generated at startup */
+
+apr_uint64_t ntt_secret[2];
+
+void ntt_secret_init(void) {
+    if (apr_generate_random_bytes((unsigned char *) ntt_secret, sizeof(ntt_secret)) != APR_SUCCESS) {
+        evasive_log(EVASIVE_LOG_WARNING, "Failed to generate a random hash secret, using a weaker one");
+        ntt_secret[0] = (apr_uint64_t) apr_time_now();
+        ntt_secret[1] = (apr_uint64_t) getpid() * UINT64_C(0x9e3779b97f4a7c15);
+    }
+}
+
+/* SipHash-1-3; keyed with ntt_secret, colliding keys cannot be predicted */
+
+#define NTT_ROTL(x, b) (apr_uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define NTT_SIPROUND                                                            \
+    do {                                                                        \
+        v0 += v1; v1 = NTT_ROTL(v1, 13); v1 ^= v0; v0 = NTT_ROTL(v0, 32);       \
+        v2 += v3; v3 = NTT_ROTL(v3, 16); v3 ^= v2;                              \
+        v0 += v3; v3 = NTT_ROTL(v3, 21); v3 ^= v0;                              \
+        v2 += v1; v1 = NTT_ROTL(v1, 17); v1 ^= v2; v2 = NTT_ROTL(v2, 32);       \
+    } while (0)
+
+apr_uint64_t ntt_siphash_keyed(const apr_uint64_t secret[2], const unsigned char *data, size_t len) {
+    apr_uint64_t v0 = UINT64_C(0x736f6d6570736575) ^ secret[0];
+    apr_uint64_t v1 = UINT64_C(0x646f72616e646f6d) ^ secret[1];
+    apr_uint64_t v2 = UINT64_C(0x6c7967656e657261) ^ secret[0];
+    apr_uint64_t v3 = UINT64_C(0x7465646279746573) ^ secret[1];
+    apr_uint64_t b = (apr_uint64_t) len << 56;
+    const unsigned char *end = data + (len & ~(size_t) 7);
+    apr_uint64_t m;
+
+    /* Words are little endian whatever the host, decoded by hand as not every platform has le64toh */
+    for (; data != end; data += 8) {
+        m = (apr_uint64_t) data[0] | (apr_uint64_t) data[1] << 8 | (apr_uint64_t) data[2] << 16
+                | (apr_uint64_t) data[3] << 24 | (apr_uint64_t) data[4] << 32 | (apr_uint64_t) data[5] << 40
+                | (apr_uint64_t) data[6] << 48 | (apr_uint64_t) data[7] << 56;
+        v3 ^= m;
+        NTT_SIPROUND;
+        v0 ^= m;
+    }
+
+    switch (len & 7) {
+    case 7: b |= (apr_uint64_t) data[6] << 48; /* fall through */
+    case 6: b |= (apr_uint64_t) data[5] << 40; /* fall through */
+    case 5: b |= (apr_uint64_t) data[4] << 32; /* fall through */
+    case 4: b |= (apr_uint64_t) data[3] << 24; /* fall through */
+    case 3: b |= (apr_uint64_t) data[2] << 16; /* fall through */
+    case 2: b |= (apr_uint64_t) data[1] << 8;  /* fall through */
+    case 1: b |= (apr_uint64_t) data[0];       /* fall through */
+    case 0: break;
+    }
+
+    v3 ^= b;
+    NTT_SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    NTT_SIPROUND;
+    NTT_SIPROUND;
+    NTT_SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static apr_uint64_t ntt_siphash(const unsigned char *data, size_t len) {
+    return ntt_siphash_keyed(ntt_secret, data, len);
+}
+
+/* Hash a URI into the fixed-width part of a key */
+
+apr_uint64_t ntt_hash_uri(const char *uri) {
+    return ntt_siphash((const unsigned char *) uri, strlen(uri));
+}
+
+/* Hash a key; both the stripe and the position within the stripe are derived from this */
+
+apr_uint64_t ntt_hashcode(const struct ntt_key *key) {
+    return ntt_siphash((const unsigned char *) key, offsetof(struct ntt_key, type) + sizeof(key->type));
+}
+
+/* Whether two keys are the same */
+
+static int ntt_key_equal(const struct ntt_key *a, const struct ntt_key *b) {
+    return a->uri_hash == b->uri_hash && a->type == b->type && memcmp(a->addr, b->addr, sizeof(a->addr)) == 0;
+}
+
+/* Find the numeric position in a table of a stripe based on hash code; the low bits select the stripe */
+
+size_t ntt_index(size_t size, apr_uint64_t hash_code) {
+    return((hash_code / ntt_num_stripes) & (size - 1));
+}
+
+/* Lock the stripe a hash code belongs to; all other operations on the stripe require this lock */
+
+struct ntt_stripe *ntt_lock(struct ntt *ntt, apr_uint64_t hash_code) {
+    struct ntt_stripe *stripe = &ntt->stripes[hash_code & (ntt_num_stripes - 1)];
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(stripe->mutex);
+#endif
+    return stripe;
+}
+
+/* Unlock a stripe */
+
+void ntt_unlock(struct ntt_stripe *stripe) {
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(stripe->mutex);
+#else
+    (void) stripe;
+#endif
+}
+
+/* Tree initializer; the total size is spread over the stripes */
+
+struct ntt *ntt_create(size_t size, apr_pool_t *pool) {
+    struct ntt *ntt = (struct ntt *) calloc(1, sizeof(struct ntt));
+    size_t stripe_size;
+
+    if (ntt == NULL)
+        return NULL;
+
+    stripe_size = ntt_size_get_next(size / ntt_num_stripes);
+    for (size_t i = 0; i < ntt_num_stripes; i++) {
+        struct ntt_stripe *stripe = &ntt->stripes[i];
+
+        stripe->tbl   = (struct ntt_node *) calloc(stripe_size, sizeof(struct ntt_node));
+        if (stripe->tbl == NULL) {
+            ntt_destroy(ntt);
+            return NULL;
+        }
+        stripe->size  = stripe_size;
+        stripe->min_size = stripe_size;
+        stripe->items = 0;
+        stripe->sweep = 0;
+        stripe->ttl   = NTT_DEFAULT_TTL;
+        stripe->old_tbl = NULL;
+        stripe->old_items = 0;
+#if APR_HAS_THREADS
+        if (apr_thread_mutex_create(&stripe->mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS) {
+            stripe->mutex = NULL;
+            ntt_destroy(ntt);
+            return NULL;
+        }
+#else
+        (void) pool;
+#endif
+    }
+    return(ntt);
+}
+
+/* Store a copy of a node in the current table of a locked stripe; the key must not be present yet */
+
+static struct ntt_node *ntt_place(struct ntt_stripe *stripe, const struct ntt_node *node, apr_uint64_t hash_code) {
+    size_t index = ntt_index(stripe->size, hash_code);
+
+    while (stripe->tbl[index].key.type != NTT_KEY_NONE) {
+        index = (index + 1) & (stripe->size - 1);
+    }
+
+    stripe->tbl[index] = *node;
+    stripe->items++;
+    return &stripe->tbl[index];
+}
+
+/* Move nodes of the previous table of a locked stripe into the current one.
+   At most batch slots are examined, so every operation only pays for a few
+   of them; the previous table is released once it is empty. */
+
+static void ntt_migrate(struct ntt_stripe *stripe, size_t batch) {
+    while (stripe->old_tbl != NULL) {
+        struct ntt_node *node;
+
+        if (stripe->old_items == 0 || stripe->migrate == stripe->old_size) {
+            free(stripe->old_tbl);
+            stripe->old_tbl = NULL;
+            stripe->old_items = 0;
+            return;
+        }
+
+        if (batch-- == 0)
+            return;
+
+        node = &stripe->old_tbl[stripe->migrate++];
+        if (node->key.type != NTT_KEY_NONE && node->key.type != NTT_KEY_MOVED) {
+            ntt_place(stripe, node, ntt_hashcode(&node->key));
+            node->key.type = NTT_KEY_MOVED;
+            stripe->old_items--;
+        }
+    }
+}
+
+/* Take a node out of the previous table of a locked stripe; returns its slot, now marked as moved */
+
+static struct ntt_node *ntt_take_old(struct ntt_stripe *stripe, const struct ntt_key *key, apr_uint64_t hash_code) {
+    size_t index;
+
+    if (stripe->old_tbl == NULL)
+        return NULL;
+
+    /* Moved nodes keep their slot, so probe sequences in the previous table stay intact */
+    index = ntt_index(stripe->old_size, hash_code);
+    for (;;) {
+        struct ntt_node *node = &stripe->old_tbl[index];
+
+        if (node->key.type == NTT_KEY_NONE)
+            return((struct ntt_node *)NULL);
+        if (ntt_key_equal(&node->key, key)) {
+            node->key.type = NTT_KEY_MOVED;
+            stripe->old_items--;
+            return(node);
+        }
+
+        index = (index + 1) & (stripe->old_size - 1);
+    }
+}
+
+/* Whether a node in a stripe is expired */
+
+static int ntt_node_is_expired(const struct ntt_stripe *stripe, const struct ntt_node *node, apr_time_t timestamp) {
+    return timestamp - node->timestamp >= stripe->ttl;
+}
+
+/* Remove the node at an index from a locked stripe.
+   Following nodes of the probe sequence are shifted back into the gap, so
+   lookups never need tombstones to skip over removed nodes. */
+
+static void ntt_remove(struct ntt_stripe *stripe, size_t index) {
+    size_t mask = stripe->size - 1;
+    size_t next = index;
+
+    for (;;) {
+        size_t home;
+
+        next = (next + 1) & mask;
+        if (stripe->tbl[next].key.type == NTT_KEY_NONE)
+            break;
+
+        /* A node may only move back if the gap is not before its home slot */
+        home = ntt_index(stripe->size, ntt_hashcode(&stripe->tbl[next].key));
+        if (((next - home) & mask) < ((next - index) & mask))
+            continue;
+
+        stripe->tbl[index] = stripe->tbl[next];
+        index = next;
+    }
+
+    stripe->tbl[index].key.type = NTT_KEY_NONE;
+    stripe->items--;
+}
+
+/* Remove expired nodes from a small, fixed number of slots of a locked stripe.
+   Each operation continues where the previous one stopped, so the whole stripe
+   is swept long before it fills up, at a constant cost per operation. */
+
+static void ntt_sweep(struct ntt_stripe *stripe, apr_time_t timestamp) {
+    for (size_t i = 0; i < ntt_sweep_batch && stripe->items > 0; i++) {
+        struct ntt_node *node = &stripe->tbl[stripe->sweep];
+
+        if (node->key.type != NTT_KEY_NONE && ntt_node_is_expired(stripe, node, timestamp)) {
+            /* Another node may have been shifted into this slot, look at it again next */
+            ntt_remove(stripe, stripe->sweep);
+            ntt_event(NTT_EVENT_EXPIRE);
+        } else {
+            stripe->sweep = (stripe->sweep + 1) & (stripe->size - 1);
+        }
+    }
+}
+
+/* Start resizing a locked stripe; the other stripes remain available meanwhile.
+   Only a new, empty table is allocated here. The nodes are moved over a few at
+   a time by the following operations on the stripe (see ntt_migrate). */
+
+static int ntt_resize(struct ntt_stripe *stripe, size_t new_size) {
+    struct ntt_node *new_tbl;
+
+    new_tbl = calloc(new_size, sizeof(struct ntt_node));
+    if (!new_tbl)
+        return -1;
+
+    /* Resizing again before the last resize completed, finish that one first */
+    ntt_migrate(stripe, SIZE_MAX);
+
+    evasive_log(EVASIVE_LOG_INFO, "Resizing hash table stripe from %zu to %zu",
+                stripe->size, new_size);
+
+    stripe->old_tbl = stripe->tbl;
+    stripe->old_size = stripe->size;
+    stripe->old_items = stripe->items;
+    stripe->migrate = 0;
+
+    stripe->tbl = new_tbl;
+    stripe->size = new_size;
+    stripe->items = 0;
+    stripe->sweep = 0;
+
+    return 0;
+}
+
+/* Bounded housekeeping done by every operation on a locked stripe */
+
+static void ntt_maintain(struct ntt_stripe *stripe, apr_time_t timestamp) {
+    ntt_migrate(stripe, ntt_migrate_batch);
+    ntt_sweep(stripe, timestamp);
+
+    /* Shrink on 12.5% utilization, but never below the configured size; failing to do so is harmless */
+    if (stripe->old_tbl == NULL && stripe->size > stripe->min_size && stripe->items < stripe->size / 8
+            && ntt_resize(stripe, stripe->size / 2) == 0)
+        ntt_event(NTT_EVENT_SHRINK);
+}
+
+/* Find an object in a locked stripe.
+   Stripes always keep unused nodes (see ntt_insert), so the probe terminates. */
+
+struct ntt_node *ntt_find(struct ntt_stripe *stripe, const struct ntt_key *key, apr_uint64_t hash_code, apr_time_t timestamp) {
+    size_t index;
+    struct ntt_node *old;
+
+    ntt_maintain(stripe, timestamp);
+
+    index = ntt_index(stripe->size, hash_code);
+    for (;;) {
+        struct ntt_node *node = &stripe->tbl[index];
+
+        if (node->key.type == NTT_KEY_NONE)
+            break;
+        if (ntt_key_equal(&node->key, key))
+            return(node);
+
+        index = (index + 1) & (stripe->size - 1);
+    }
+
+    /* Not migrated yet, move it over right away */
+    old = ntt_take_old(stripe, key, hash_code);
+    if (old != NULL) {
+        struct ntt_node *node = ntt_place(stripe, old, hash_code);
+
+        node->key.type = key->type;
+        return(node);
+    }
+
+    return((struct ntt_node *)NULL);
+}
+
+/* Insert a node into a locked stripe */
+
+struct ntt_node *ntt_insert(struct ntt_stripe *stripe, const struct ntt_key *key, apr_uint64_t hash_code, apr_time_t timestamp) {
+    size_t index;
+    struct ntt_node *node;
+
+    ntt_maintain(stripe, timestamp);
+
+    /* Grow on 75% utilization, counting nodes which are not migrated yet */
+    if (((stripe->size * 3) / 4) < stripe->items + stripe->old_items) {
+        int rv = -1;
+
+        if (stripe->size > SIZE_MAX / 2 / sizeof(struct ntt_node))
+            errno = EOVERFLOW;
+        else
+            rv = ntt_resize(stripe, stripe->size * 2);
+
+        if (rv < 0) {
+            evasive_log(EVASIVE_LOG_ERR, "Failed to increase hashtable stripe of size %zu and %zu entries: %s",
+                        stripe->size, stripe->items, strerror(errno));
+            return NULL;
+        }
+        ntt_event(NTT_EVENT_GROW);
+    }
+
+    /* The key is stored anew below, drop a copy which is not migrated yet */
+    ntt_take_old(stripe, key, hash_code);
+
+    index = ntt_index(stripe->size, hash_code);
+    for (;;) {
+        node = &stripe->tbl[index];
+
+        if (node->key.type == NTT_KEY_NONE || ntt_key_equal(&node->key, key))
+            break;
+
+        index = (index + 1) & (stripe->size - 1);
+    }
+
+    if (node->key.type == NTT_KEY_NONE)
+        stripe->items++;
+
+    *node = (struct ntt_node) {
+        .key = *key,
+        .timestamp = timestamp,
+        .count = 0,
+    };
+    return node;
+}
+
+/* Set the age after which nodes expire; no other thread may be using the tree yet */
+
+void ntt_set_ttl(struct ntt *ntt, apr_time_t ttl) {
+    for (size_t i = 0; i < ntt_num_stripes; i++)
+        ntt->stripes[i].ttl = ttl;
+}
+
+/* Tree destructor; no other thread may be using the tree anymore */
+
+int ntt_destroy(struct ntt *ntt) {
+    if (ntt == NULL) return -1;
+
+    for (size_t i = 0; i < ntt_num_stripes; i++) {
+        free(ntt->stripes[i].tbl);
+        free(ntt->stripes[i].old_tbl);
+#if APR_HAS_THREADS
+        if (ntt->stripes[i].mutex)
+            apr_thread_mutex_destroy(ntt->stripes[i].mutex);
+#endif
+    }
+    free(ntt);
+
+    return 0;
+}
+
+/* END NTT (Named Timestamp Tree) Functions */
+
+
+/* BEGIN Rate Functions */
+
+/* Parse an interval in whole seconds, or in milliseconds with an ms suffix */
+
+int parse_interval(const char *value, apr_interval_time_t *interval)
+{
+    char *endptr;
+    long n;
+
+    errno = 0;
+    n = strtol(value, &endptr, 0);
+    if (errno || n <= 0 || n > INT_MAX)
+        return -1;
+
+    if (*endptr == '\0')
+        *interval = apr_time_from_sec(n);
+    else if (strcmp(endptr, "ms") == 0)
+        *interval = apr_time_from_msec(n);
+    else
+        return -1;
+
+    return 0;
+}
+
+/* Parse the name of a rate algorithm */
+
+int parse_rate_algorithm(const char *value, int *algorithm)
+{
+    if (strcmp("fixed", value) == 0)
+        *algorithm = RATE_FIXED;
+    else if (strcmp("sliding", value) == 0)
+        *algorithm = RATE_SLIDING;
+    else if (strcmp("bucket", value) == 0)
+        *algorithm = RATE_BUCKET;
+    else
+        return -1;
+
+    return 0;
+}
+
+/* Age after which a hit list entry no longer matters; it must outlive the blocking period and every interval */
+
+apr_interval_time_t hit_ttl(int algorithm, apr_interval_time_t blocking_period, apr_interval_time_t page_interval,
+        apr_interval_time_t site_interval)
+{
+    /* A sliding window looks back at the previous interval as well */
+    apr_interval_time_t windows = algorithm == RATE_SLIDING ? 2 : 1;
+    apr_interval_time_t ttl = blocking_period;
+
+    if (windows * page_interval > ttl)
+        ttl = windows * page_interval;
+    if (windows * site_interval > ttl)
+        ttl = windows * site_interval;
+
+    /* Whole second intervals are compared in whole seconds, which can add up to one */
+    return ttl + apr_time_from_sec(1);
+}
+
+/* Whether less than interval passed since a timestamp; whole second intervals are compared in whole seconds */
+
+int hit_within(apr_time_t t, apr_time_t since, apr_interval_time_t interval)
+{
+    if (interval % APR_USEC_PER_SEC == 0)
+        return apr_time_sec(t) - apr_time_sec(since) < apr_time_sec(interval);
+
+    return t - since < interval;
+}
+
+/* Fixed: count hits until an interval passes without one; a new entry (count 0) does not count its first hit */
+
+static int hit_count_fixed(struct ntt_node *n, apr_time_t t, apr_interval_time_t interval, unsigned int threshold)
+{
+    int exceeded = 0;
+
+    if (hit_within(t, n->timestamp, interval) && n->count >= threshold) {
+        exceeded = 1;
+    } else {
+
+        /* Reset our hit count list as necessary */
+        if (!hit_within(t, n->timestamp, interval)) {
+            n->count = 0;
+        }
+    }
+    n->timestamp = t;
+    n->count++;
+
+    return exceeded;
+}
+
+/* Sliding: timestamp is the start of the current interval, count holds the hits of the previous one in the
+   upper and of the current one in the lower half */
+
+#define RATE_SLIDING_SHIFT  (sizeof(size_t) * CHAR_BIT / 2)
+#define RATE_SLIDING_MASK   (((size_t) 1 << RATE_SLIDING_SHIFT) - 1)
+
+static int hit_count_sliding(struct ntt_node *n, int fresh, apr_time_t t, apr_interval_time_t interval,
+        unsigned int threshold)
+{
+    apr_time_t window = t - t % interval;
+    size_t previous, current;
+    apr_uint64_t estimate;
+
+    if (fresh || window - n->timestamp > interval || window < n->timestamp) {
+        previous = 0;
+        current = 0;
+    } else if (window - n->timestamp == interval) {
+        previous = n->count & RATE_SLIDING_MASK;
+        current = 0;
+    } else {
+        previous = n->count >> RATE_SLIDING_SHIFT;
+        current = n->count & RATE_SLIDING_MASK;
+    }
+
+    /* Hits of the previous interval within the last interval length, assuming they were spread evenly */
+    estimate = (apr_uint64_t) previous * (apr_uint64_t) (interval - (t - window)) / (apr_uint64_t) interval + current;
+
+    if (current < RATE_SLIDING_MASK)
+        current++;
+    n->timestamp = window;
+    n->count = previous << RATE_SLIDING_SHIFT | current;
+
+    return estimate >= threshold;
+}
+
+/* Token bucket, as the theoretical arrival time (GCRA): timestamp is when the bucket will be full again, each
+   allowed hit adding interval / threshold to it; hits arriving while the bucket is empty are refused */
+
+static int hit_count_bucket(struct ntt_node *n, apr_time_t t, apr_interval_time_t interval, unsigned int threshold)
+{
+    apr_interval_time_t emission = interval / threshold;
+    apr_time_t tat = n->timestamp > t ? n->timestamp : t;
+
+    if (emission < 1)
+        emission = 1;
+
+    n->count++;
+
+    if (tat - t > interval - emission)
+        return 1;
+
+    n->timestamp = tat + emission;
+
+    return 0;
+}
+
+/* Count a hit on a hit list entry; returns 1 if the entry exceeded its threshold within the interval */
+
+int hit_count(int algorithm, struct ntt_node *n, int fresh, apr_time_t t, apr_interval_time_t interval,
+        unsigned int threshold)
+{
+    switch (algorithm) {
+    case RATE_SLIDING:
+        return hit_count_sliding(n, fresh, t, interval, threshold);
+    case RATE_BUCKET:
+        return hit_count_bucket(n, t, interval, threshold);
+    default:
+        return fresh ? 0 : hit_count_fixed(n, t, interval, threshold);
+    }
+}
+
+/* Whether a key of a per-process table is on "hold"; if it is, the hold is extended */
+
+int ntt_on_hold(struct ntt *ntt, const struct ntt_key *key, apr_time_t t, apr_interval_time_t blocking_period)
+{
+    apr_uint64_t hash_code = ntt_hashcode(key);
+    struct ntt_stripe *stripe = ntt_lock(ntt, hash_code);
+    struct ntt_node *n = ntt_find(stripe, key, hash_code, t);
+    int on_hold = 0;
+
+    if (n != NULL && hit_within(t, n->timestamp, blocking_period)) {
+        n->timestamp = t;
+        on_hold = 1;
+    }
+
+    ntt_unlock(stripe);
+    return on_hold;
+}
+
+/* Put a key of a per-process table on "hold" */
+
+void ntt_hold(struct ntt *ntt, const struct ntt_key *key, apr_time_t t)
+{
+    apr_uint64_t hash_code = ntt_hashcode(key);
+    struct ntt_stripe *stripe = ntt_lock(ntt, hash_code);
+
+    ntt_insert(stripe, key, hash_code, t);
+    ntt_unlock(stripe);
+}
+
+/* Count a hit on a key of a per-process table; returns 1 if it is being hit too much */
+
+int ntt_hit(struct ntt *ntt, int algorithm, const struct ntt_key *key, apr_time_t t, apr_interval_time_t interval,
+        unsigned int threshold)
+{
+    apr_uint64_t hash_code = ntt_hashcode(key);
+    struct ntt_stripe *stripe = ntt_lock(ntt, hash_code);
+    struct ntt_node *n = ntt_find(stripe, key, hash_code, t);
+    int fresh = 0;
+    int exceeded = 0;
+
+    if (n == NULL) {
+        n = ntt_insert(stripe, key, hash_code, t);
+        fresh = 1;
+    }
+
+    if (n != NULL)
+        exceeded = hit_count(algorithm, n, fresh, t, interval, threshold);
+
+    ntt_unlock(stripe);
+    return exceeded;
+}
+
+/* END Rate Functions */
+
+
+/* BEGIN Sketch Functions */
+
+static int cms_init(struct cms *cms, size_t width, apr_interval_time_t interval) {
+    cms->width = width;
+    cms->interval = interval;
+    cms->counters = (apr_uint32_t *) calloc(cms_depth * width, sizeof(apr_uint32_t));
+    cms->windows = (apr_uint32_t *) calloc(cms_depth * width / cms_line, sizeof(apr_uint32_t));
+
+    return cms->counters != NULL && cms->windows != NULL ? 0 : -1;
+}
+
+/* Sketch constructor; width and holds are rounded up to powers of two */
+
+struct sketch *sketch_create(size_t width, size_t holds, apr_interval_time_t page_interval,
+        apr_interval_time_t site_interval, apr_pool_t *pool) {
+    struct sketch *sk = (struct sketch *) calloc(1, sizeof(struct sketch));
+
+    if (sk == NULL)
+        return NULL;
+
+    width = ntt_size_get_next(width);
+    sk->holds_size = ntt_size_get_next(holds);
+    sk->ttl = NTT_DEFAULT_TTL;
+    sk->holds = (struct ntt_node *) calloc(sk->holds_size, sizeof(struct ntt_node));
+
+    if (sk->holds == NULL || cms_init(&sk->page, width, page_interval) < 0 || cms_init(&sk->site, width, site_interval) < 0) {
+        sketch_destroy(sk);
+        return NULL;
+    }
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&sk->mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS) {
+        sketch_destroy(sk);
+        return NULL;
+    }
+#else
+    (void) pool;
+#endif
+    return sk;
+}
+
+void sketch_destroy(struct sketch *sk) {
+    if (sk == NULL)
+        return;
+
+    free(sk->page.counters);
+    free(sk->page.windows);
+    free(sk->site.counters);
+    free(sk->site.windows);
+    free(sk->holds);
+    free(sk);
+}
+
+/* Bytes allocated for a sketch; it never changes */
+
+size_t sketch_memory(const struct sketch *sk) {
+    return sizeof(*sk) + (sk->page.width + sk->site.width) * cms_depth * sizeof(apr_uint32_t) * (cms_line + 1) / cms_line
+        + sk->holds_size * sizeof(struct ntt_node);
+}
+
+/* Count a hit in a sketch; returns the estimated hits of the key in the current window, this one included.
+   The rows are indexed by double hashing of the key hash, and only the smallest counters are raised
+   (conservative update), which keeps the overestimate down. Counters left from an earlier window are cleared
+   a cache line at a time, when first hit in the current one, so no hit pays for clearing the whole sketch. */
+
+apr_uint32_t cms_add(struct cms *cms, apr_uint64_t hash_code, apr_time_t t) {
+    apr_uint32_t window = (apr_uint32_t) (t / cms->interval);
+    apr_uint32_t h1 = (apr_uint32_t) hash_code;
+    apr_uint32_t h2 = (apr_uint32_t) (hash_code >> 32) | 1;
+    apr_uint32_t *cell[cms_depth];
+    apr_uint32_t estimate = UINT32_MAX;
+
+    for (unsigned int i = 0; i < cms_depth; i++) {
+        size_t idx = i * cms->width + ((h1 + i * h2) & (cms->width - 1));
+        size_t line = idx / cms_line;
+
+        if (cms->windows[line] != window) {
+            memset(&cms->counters[line * cms_line], 0, cms_line * sizeof(apr_uint32_t));
+            cms->windows[line] = window;
+        }
+        cell[i] = &cms->counters[idx];
+        if (*cell[i] < estimate)
+            estimate = *cell[i];
+    }
+
+    if (estimate < UINT32_MAX)
+        estimate++;
+
+    for (unsigned int i = 0; i < cms_depth; i++) {
+        if (*cell[i] < estimate)
+            *cell[i] = estimate;
+    }
+
+    return estimate;
+}
+
+/* Find the hold slot of a key; the caller must hold the sketch mutex */
+
+static struct ntt_node *sketch_find(struct sketch *sk, const struct ntt_key *key, apr_uint64_t hash_code) {
+    size_t idx = hash_code & (sk->holds_size - 1);
+
+    for (size_t i = 0; i < sketch_max_probe && i < sk->holds_size; i++) {
+        struct ntt_node *slot = &sk->holds[(idx + i) & (sk->holds_size - 1)];
+
+        if (slot->key.type == NTT_KEY_NONE)
+            break;
+
+        if (ntt_key_equal(&slot->key, key))
+            return slot;
+    }
+    return NULL;
+}
+
+/* Whether a key is on "hold"; if it is, the hold is extended. Each hit while on hold counts, so keys
+   which keep trying are the last to be replaced. */
+
+int sketch_on_hold(struct sketch *sk, const struct ntt_key *key, apr_time_t t, apr_interval_time_t blocking_period) {
+    struct ntt_node *n;
+    int on_hold = 0;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sk->mutex);
+#endif
+    n = sketch_find(sk, key, ntt_hashcode(key));
+    if (n != NULL && hit_within(t, n->timestamp, blocking_period)) {
+        n->timestamp = t;
+        n->count++;
+        on_hold = 1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sk->mutex);
+#endif
+    return on_hold;
+}
+
+/* Put a key on "hold". Outdated slots are reused; when every probed slot is in use, the one hit least
+   often is replaced and its count inherited, as Space-Saving does. */
+
+void sketch_hold(struct sketch *sk, const struct ntt_key *key, apr_time_t t) {
+    apr_uint64_t hash_code = ntt_hashcode(key);
+    size_t idx = hash_code & (sk->holds_size - 1);
+    struct ntt_node *slot = NULL;
+    struct ntt_node *least = NULL;
+    size_t count = 0;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sk->mutex);
+#endif
+    for (size_t i = 0; i < sketch_max_probe && i < sk->holds_size; i++) {
+        struct ntt_node *curr = &sk->holds[(idx + i) & (sk->holds_size - 1)];
+
+        if (curr->key.type == NTT_KEY_NONE || ntt_key_equal(&curr->key, key)) {
+            slot = curr;
+            count = curr->count;
+            break;
+        }
+
+        if (t - curr->timestamp >= sk->ttl) {
+            if (slot == NULL)
+                slot = curr;
+        } else if (least == NULL || curr->count < least->count) {
+            least = curr;
+        }
+    }
+
+    if (slot == NULL) {
+        slot = least;
+        count = least->count;
+    }
+
+    *slot = (struct ntt_node) {
+        .key = *key,
+        .timestamp = t,
+        .count = count + 1,
+    };
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sk->mutex);
+#endif
+}
+
+/* Count a hit; returns 1 if the key is estimated to have been hit more than threshold times in the window */
+
+int sketch_hit(struct sketch *sk, const struct ntt_key *key, apr_time_t t, unsigned int threshold) {
+    struct cms *cms = key->type == NTT_KEY_URI ? &sk->page : &sk->site;
+    apr_uint32_t estimate;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(sk->mutex);
+#endif
+    estimate = cms_add(cms, ntt_hashcode(key), t);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(sk->mutex);
+#endif
+    return estimate > threshold;
+}
+
+/* END Sketch Functions */
+
+
+/* BEGIN Block Filter Functions */
+
+/* The period is a second longer than the blocking period, which whole seconds can add to a hold */
+
+struct block_filter *block_filter_create(apr_interval_time_t blocking_period, apr_pool_t *pool) {
+    struct block_filter *bf = apr_pcalloc(pool, sizeof(struct block_filter));
+
+    if (bf == NULL)
+        return NULL;
+
+    bf->period = (apr_uint32_t) (apr_time_sec(blocking_period + APR_USEC_PER_SEC - 1) + 1);
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&bf->mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS)
+        return NULL;
+#endif
+    return bf;
+}
+
+/* A cheap hash of the address and type of a key; only the rate of false positives depends on it */
+
+static apr_uint64_t block_filter_hash(const struct ntt_key *key) {
+    apr_uint64_t h = ntt_secret[0] ^ key->type;
+    apr_uint64_t w;
+
+    for (size_t i = 0; i < sizeof(key->addr); i += sizeof(w)) {
+        memcpy(&w, &key->addr[i], sizeof(w));
+        h = (h ^ w) * UINT64_C(0x9e3779b97f4a7c15);
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/* Move on to the generation of a later period, forgetting what the one it replaces held; returns the
+   current period. Requests of other threads may be a little older, they never move it back. The caller
+   must hold the mutex. */
+
+static apr_uint32_t block_filter_rotate(struct block_filter *bf, apr_uint32_t epoch) {
+    apr_uint32_t old = apr_atomic_read32(&bf->epoch);
+
+    if ((apr_int32_t) (epoch - old) <= 0)
+        return old;
+
+    for (size_t i = 0; i < block_filter_words; i++)
+        apr_atomic_set32(&bf->bits[epoch & 1][i], 0);
+    if (epoch - old > 1) {
+        for (size_t i = 0; i < block_filter_words; i++)
+            apr_atomic_set32(&bf->bits[(epoch - 1) & 1][i], 0);
+    }
+    apr_atomic_set32(&bf->epoch, epoch);
+    return epoch;
+}
+
+static int block_filter_has(struct block_filter *bf, unsigned int gen, apr_uint64_t h) {
+    for (unsigned int i = 0; i < block_filter_hashes; i++, h >>= 16) {
+        apr_uint32_t bit = (apr_uint32_t) h & (block_filter_words * 32 - 1);
+
+        if (!(apr_atomic_read32(&bf->bits[gen][bit / 32]) & (UINT32_C(1) << (bit % 32))))
+            return 0;
+    }
+    return 1;
+}
+
+/* Record a key put on hold, or whose hold was extended */
+
+void block_filter_add(struct block_filter *bf, const struct ntt_key *key, apr_time_t t) {
+    apr_uint32_t epoch = (apr_uint32_t) (apr_time_sec(t) / bf->period);
+    apr_uint32_t current = apr_atomic_read32(&bf->epoch);
+    apr_uint64_t h = block_filter_hash(key);
+
+    /* Nothing to write for keys held again and again */
+    if ((apr_int32_t) (epoch - current) <= 0 && block_filter_has(bf, current & 1, h))
+        return;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(bf->mutex);
+#endif
+    epoch = block_filter_rotate(bf, epoch);
+    for (unsigned int i = 0; i < block_filter_hashes; i++, h >>= 16) {
+        apr_uint32_t bit = (apr_uint32_t) h & (block_filter_words * 32 - 1);
+        apr_uint32_t *word = &bf->bits[epoch & 1][bit / 32];
+
+        apr_atomic_set32(word, apr_atomic_read32(word) | (UINT32_C(1) << (bit % 32)));
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(bf->mutex);
+#endif
+}
+
+/* Whether a key may be on hold; 0 means it certainly is not. Lock free except once per period. */
+
+int block_filter_test(struct block_filter *bf, const struct ntt_key *key, apr_time_t t) {
+    apr_uint32_t epoch = (apr_uint32_t) (apr_time_sec(t) / bf->period);
+    apr_uint64_t h = block_filter_hash(key);
+
+    if ((apr_int32_t) (epoch - apr_atomic_read32(&bf->epoch)) > 0) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(bf->mutex);
+#endif
+        block_filter_rotate(bf, epoch);
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(bf->mutex);
+#endif
+    }
+
+    return block_filter_has(bf, 0, h) || block_filter_has(bf, 1, h);
+}
+
+/* END Block Filter Functions */
+
+
+/* BEGIN SHT (Shared Hit Table) Functions */
+
+/* Find a slot in the table; the caller must hold shm_mutex */
+
+struct ntt_node *sht_find(struct sht *sht, const struct ntt_key *key, apr_uint64_t hash_code) {
+    size_t idx = hash_code & (sht->size - 1);
+
+    for (size_t i = 0; i < SHT_MAX_PROBE && i < sht->size; i++) {
+        struct ntt_node *slot = &sht->slots[(idx + i) & (sht->size - 1)];
+
+        /* Slots are never emptied again, so the key cannot be further down */
+        if (slot->key.type == NTT_KEY_NONE)
+            break;
+
+        if (ntt_key_equal(&slot->key, key))
+            return slot;
+    }
+    return NULL;
+}
+
+/* Insert a key into the table; the caller must hold shm_mutex.
+   Outdated slots are reused, and when every probed slot is in use the least
+   recently updated one is evicted, so the table never needs to grow. */
+
+struct ntt_node *sht_insert(struct sht *sht, const struct ntt_key *key, apr_uint64_t hash_code, apr_time_t timestamp) {
+    size_t idx = hash_code & (sht->size - 1);
+    struct ntt_node *free_slot = NULL;
+    struct ntt_node *oldest = NULL;
+    struct ntt_node *slot = NULL;
+
+    for (size_t i = 0; i < SHT_MAX_PROBE && i < sht->size; i++) {
+        struct ntt_node *curr = &sht->slots[(idx + i) & (sht->size - 1)];
+
+        if (curr->key.type == NTT_KEY_NONE) {
+            if (!free_slot)
+                free_slot = curr;
+            break;
+        }
+
+        if (ntt_key_equal(&curr->key, key)) {
+            slot = curr;
+            break;
+        }
+
+        if (!free_slot && timestamp - curr->timestamp >= sht->ttl)
+            free_slot = curr;
+
+        if (!oldest || curr->timestamp < oldest->timestamp)
+            oldest = curr;
+    }
+
+    if (!slot)
+        slot = free_slot ? free_slot : oldest;
+
+    *slot = (struct ntt_node) {
+        .key = *key,
+        .timestamp = timestamp,
+        .count = 0,
+    };
+    return slot;
+}
+
+/* END SHT (Shared Hit Table) Functions */
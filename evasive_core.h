@@ -0,0 +1,377 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   mod_evasive core: hit tables and address and URI lists, without httpd
+   Copyright (c) by Jonathan A. Zdziarski
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#ifndef EVASIVE_CORE_H
+#define EVASIVE_CORE_H
+
+#include <sys/types.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#endif
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+
+#include "apr_network_io.h"
+#include "apr_pools.h"
+#include "apr_thread_mutex.h"
+#include "apr_time.h"
+
+/* The core is linked into the module, httpd does not need to see its symbols */
+#ifdef __GNUC__
+#pragma GCC visibility push(hidden)
+#endif
+
+/* BEGIN Core Hooks */
+
+/* log levels, the same as the syslog levels httpd uses */
+enum {
+    EVASIVE_LOG_ERR = 3,
+    EVASIVE_LOG_WARNING = 4,
+    EVASIVE_LOG_INFO = 6,
+    EVASIVE_LOG_DEBUG = 7,
+};
+
+/* hit table events, reported for statistics */
+enum {
+    NTT_EVENT_GROW = 0,     // A stripe started to grow
+    NTT_EVENT_SHRINK,       // A stripe started to shrink
+    NTT_EVENT_EXPIRE,       // An expired node was removed
+};
+
+/* Set by the program using the core; if unset, messages and events are dropped */
+extern void (*evasive_log_hook)(int level, const char *fmt, va_list ap);
+extern void (*ntt_event_hook)(int event);
+
+/* END Core Hooks */
+
+/* BEGIN NTT (Named Timestamp Tree) Headers */
+
+enum { ntt_num_stripes = 16 };      // Power of two
+enum { ntt_min_stripe_size = 16 };  // Power of two
+enum { ntt_sweep_batch = 8 };       // Slots examined for expiry per insert
+enum { ntt_migrate_batch = 16 };    // Slots moved to the new table per operation while resizing
+
+#define NTT_DEFAULT_TTL apr_time_from_sec(6 * 60 * 60) // Age after which nodes expire, until post_config sets it
+
+/* ntt key types */
+enum {
+    NTT_KEY_NONE = 0,       // Unused node
+    NTT_KEY_IP,             // Blocking list entry of a client
+    NTT_KEY_URI,            // Hits of a client on a single URI
+    NTT_KEY_SITE,           // Hits of a client on the whole site
+    NTT_KEY_NOTIFIED,       // Client already reported as blocked
+    NTT_KEY_MOVED,          // Node already moved to the new table during a resize
+    NTT_KEY_SUBNET,         // Blocking list entry of a whole prefix
+    NTT_KEY_SUBNET_SITE,    // Hits of all clients of a prefix on the whole site
+};
+
+/* ntt key (fixed-width, binary) */
+struct ntt_key {
+    unsigned char addr[16]; // Client address, IPv4 addresses are stored IPv4-mapped
+    apr_uint64_t uri_hash;  // Hash of the URI for NTT_KEY_URI, 0 otherwise
+    apr_uint32_t type;
+};
+
+/* ntt node (fixed-size entry, stored inline in the ntt stripe); how timestamp and count are used depends on the rate algorithm */
+struct ntt_node {
+    struct ntt_key key;
+    apr_time_t timestamp;   // Microseconds
+    size_t count;
+};
+
+/* ntt stripe (independently locked, open-addressed part of the ntt root tree) */
+struct ntt_stripe {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    size_t size;
+    size_t min_size;        // Configured size, the stripe never shrinks below it
+    size_t items;
+    size_t sweep;           // Next slot the expiry sweep looks at
+    apr_time_t ttl;         // Age after which a node is expired
+    struct ntt_node *tbl;
+
+    /* Previous table while resizing; its nodes are moved over a few at a time */
+    struct ntt_node *old_tbl;
+    size_t old_size;
+    size_t old_items;
+    size_t migrate;         // Next slot of the previous table to move
+};
+
+/* ntt root tree */
+struct ntt {
+    struct ntt_stripe stripes[ntt_num_stripes];
+};
+
+extern apr_uint64_t ntt_secret[2];  // Secret key of the hash function, see ntt_secret_init
+
+struct ntt *ntt_create(size_t size, apr_pool_t *pool);
+int ntt_destroy(struct ntt *ntt);
+void ntt_set_ttl(struct ntt *ntt, apr_time_t ttl);
+size_t ntt_size_get_next(size_t n);
+void ntt_key_init(struct ntt_key *key, const apr_sockaddr_t *addr, apr_uint32_t type, apr_uint64_t uri_hash);
+void ntt_key_prefix(struct ntt_key *key, unsigned int prefix4, unsigned int prefix6);
+void ntt_secret_init(void);
+apr_uint64_t ntt_siphash_keyed(const apr_uint64_t secret[2], const unsigned char *data, size_t len);
+apr_uint64_t ntt_hash_uri(const char *uri);
+apr_uint64_t ntt_hashcode(const struct ntt_key *key);
+size_t ntt_index(size_t size, apr_uint64_t hash_code);
+struct ntt_stripe *ntt_lock(struct ntt *ntt, apr_uint64_t hash_code);
+void ntt_unlock(struct ntt_stripe *stripe);
+struct ntt_node *ntt_find(struct ntt_stripe *stripe, const struct ntt_key *key, apr_uint64_t hash_code, apr_time_t timestamp);
+struct ntt_node *ntt_insert(struct ntt_stripe *stripe, const struct ntt_key *key, apr_uint64_t hash_code, apr_time_t timestamp);
+
+/* END NTT (Named Timestamp Tree) Headers */
+
+/* BEGIN Rate Headers */
+
+/* rate algorithms for DOSRateAlgorithm */
+enum {
+    RATE_FIXED = 0,         // Hits counted until the interval passes without one, in whole seconds for whole second intervals
+    RATE_SLIDING,           // Hits of the current and the previous interval, the latter weighted by its overlap
+    RATE_BUCKET,            // Token bucket of threshold tokens refilled over the interval
+};
+
+int parse_interval(const char *value, apr_interval_time_t *interval);
+int parse_rate_algorithm(const char *value, int *algorithm);
+apr_interval_time_t hit_ttl(int algorithm, apr_interval_time_t blocking_period, apr_interval_time_t page_interval,
+        apr_interval_time_t site_interval);
+int hit_within(apr_time_t t, apr_time_t since, apr_interval_time_t interval);
+int hit_count(int algorithm, struct ntt_node *n, int fresh, apr_time_t t, apr_interval_time_t interval,
+        unsigned int threshold);
+int ntt_on_hold(struct ntt *ntt, const struct ntt_key *key, apr_time_t t, apr_interval_time_t blocking_period);
+void ntt_hold(struct ntt *ntt, const struct ntt_key *key, apr_time_t t);
+int ntt_hit(struct ntt *ntt, int algorithm, const struct ntt_key *key, apr_time_t t, apr_interval_time_t interval,
+        unsigned int threshold);
+
+/* END Rate Headers */
+
+/* BEGIN SHT (Shared Hit Table) Headers */
+
+#define SHT_MAX_PROBE   16              // Maximum number of slots probed per lookup
+
+/* sht table (process-local view on a range of ntt nodes in the shared memory segment) */
+struct sht {
+    size_t size;
+    apr_time_t ttl;         // Age after which a slot may be reused for another key
+    struct ntt_node *slots;
+};
+
+struct ntt_node *sht_find(struct sht *sht, const struct ntt_key *key, apr_uint64_t hash_code);
+struct ntt_node *sht_insert(struct sht *sht, const struct ntt_key *key, apr_uint64_t hash_code, apr_time_t timestamp);
+
+/* END SHT (Shared Hit Table) Headers */
+
+/* BEGIN Sketch Headers */
+
+enum { cms_depth = 4 };                 // Rows of a count-min sketch, i.e. independent hash functions
+enum { cms_line = 16 };                 // Counters cleared together, one cache line; rows are never narrower
+enum { sketch_max_probe = 8 };          // Slots of the hold table probed per lookup
+
+/* count-min sketch (hits per key within fixed windows of interval, overestimated but never underestimated) */
+struct cms {
+    size_t width;                       // Counters per row, power of two
+    apr_interval_time_t interval;
+    apr_uint32_t *counters;             // cms_depth rows of width counters
+    apr_uint32_t *windows;              // Window, t / interval, each line of cms_line counters was last cleared in
+};
+
+/* sketch (fixed-memory replacement of the per-process ntt: hits are counted in count-min sketches, blocked
+   keys kept in a fixed-size table in which the key least often hit is replaced first, as in Space-Saving) */
+struct sketch {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    struct cms page;                    // NTT_KEY_URI hits
+    struct cms site;                    // NTT_KEY_SITE and NTT_KEY_SUBNET_SITE hits
+    size_t holds_size;                  // Power of two
+    apr_time_t ttl;                     // Age after which a hold slot may be reused
+    struct ntt_node *holds;
+};
+
+struct sketch *sketch_create(size_t width, size_t holds, apr_interval_time_t page_interval,
+        apr_interval_time_t site_interval, apr_pool_t *pool);
+void sketch_destroy(struct sketch *sk);
+size_t sketch_memory(const struct sketch *sk);
+apr_uint32_t cms_add(struct cms *cms, apr_uint64_t hash_code, apr_time_t t);
+int sketch_on_hold(struct sketch *sk, const struct ntt_key *key, apr_time_t t, apr_interval_time_t blocking_period);
+void sketch_hold(struct sketch *sk, const struct ntt_key *key, apr_time_t t);
+int sketch_hit(struct sketch *sk, const struct ntt_key *key, apr_time_t t, unsigned int threshold);
+
+/* END Sketch Headers */
+
+/* BEGIN Block Filter Headers */
+
+enum { block_filter_words = 1024 };     // 32-bit words per generation, 4 KB
+enum { block_filter_hashes = 3 };       // Bits set per key
+
+/* block filter (per-process bloom filter of the keys put on hold; it may report keys which are not on hold,
+   but never misses one which is); each generation covers one period of at least the blocking period,
+   inserts go to the current one and lookups check both, so a key is forgotten two periods after its last hold */
+struct block_filter {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;          // Serializes inserts and the change of generation
+#endif
+    apr_uint32_t period;                // Seconds
+    apr_uint32_t epoch;                 // Current period since the epoch
+    apr_uint32_t bits[2][block_filter_words];
+};
+
+struct block_filter *block_filter_create(apr_interval_time_t blocking_period, apr_pool_t *pool);
+void block_filter_add(struct block_filter *bf, const struct ntt_key *key, apr_time_t t);
+int block_filter_test(struct block_filter *bf, const struct ntt_key *key, apr_time_t t);
+
+/* END Block Filter Headers */
+
+/* BEGIN List Headers */
+
+struct pcre_node {
+    pcre2_code *re;
+    char *pattern;
+};
+
+/* Per-thread state for matching; matches only need to succeed, so a single ovector pair is enough for any pattern */
+struct pcre_context {
+    pcre2_match_data *match_data;
+    pcre2_match_context *match_context;
+    pcre2_jit_stack *jit_stack;
+};
+
+struct pcre_vector {
+    struct pcre_node *data;
+    size_t size;
+    struct pcre_node combined;  // All patterns as one alternation, set up in post_config; NULL re if not combined
+};
+
+struct ip_node {
+    union {
+        struct in_addr v4;
+        struct in6_addr v6;
+    } ip;
+
+    union {
+        uint32_t v4;
+        struct in6_addr v6;
+    } mask;
+
+    char family; // AF_INET or AF_INET6
+};
+
+struct ip_vector {
+    struct ip_node *data;
+    size_t size;
+};
+
+enum { ip_trie_stride = 4 };            // Address bits consumed per trie node
+enum { ip_trie_root_v4 = 0, ip_trie_root_v6 = 1 };
+
+#define IP_TRIE_MATCH UINT32_MAX        // Child value for a whitelisted subtree
+
+/* ip trie node (one cache line); children are node indices, 0 being none since roots are never children */
+struct ip_trie_node {
+    apr_uint32_t child[1 << ip_trie_stride];
+};
+
+/* ip trie (multibit trie of whitelisted prefixes in a flat node array) */
+struct ip_trie {
+    struct ip_trie_node *nodes;
+    size_t size;
+    size_t capacity;
+};
+
+/* ip whitelist (prefixes in the trie, other wildcard patterns tried one by one) */
+struct ip_whitelist {
+    struct ip_trie trie;
+    struct ip_vector wildcards;     // Wildcard entries which are no prefix, e.g. 10.*.0.*
+};
+
+void *ev_reallocarray(void *ptr, size_t nmemb, size_t size);
+
+int ip_whitelist_add(struct ip_whitelist *wl, const char *ip);
+void ip_whitelist_destroy(struct ip_whitelist *wl);
+int is_whitelisted(const apr_sockaddr_t *client, const struct ip_whitelist *wl);
+
+int pcre_vector_push(struct pcre_vector *vec, const char *uri_re);
+void pcre_vector_combine(struct pcre_vector *vec);
+void pcre_vector_destroy(struct pcre_vector *vec);
+apr_status_t pcre_context_init(apr_pool_t *p);
+int pcre_vector_match(const char *uri, const struct pcre_vector *vec);
+int pcre_vector_find(const char *uri, const struct pcre_vector *vec);  // Index of the first matching pattern, -1 if none
+
+/* URI canonicalization, so that variants of a URI are counted as one */
+enum {
+    URI_MERGE_SLASHES  = 1 << 0,    // "/a//b" as "/a/b"
+    URI_STRIP_PARAMS   = 1 << 1,    // "/a;jsessionid=1/b" as "/a/b"
+    URI_LOWERCASE      = 1 << 2,    // "/A/B" as "/a/b"
+    URI_TRAILING_SLASH = 1 << 3,    // "/a/" as "/a"
+};
+
+const char *uri_canonicalize(const char *uri, unsigned int flags, apr_pool_t *pool);
+
+/* END List Headers */
+
+/* BEGIN List File Headers */
+
+#define LIST_FILE_MAGIC "EVLIST3"
+
+/* list file header; it is followed by the whitelist and blocklist trie nodes as they are in memory, the size of
+   every code (PCRE2_INFO_SIZE, 8 bytes each), the URI blocklist as serialized PCRE2 codes, the combined pattern
+   last if there is one, and the patterns they were compiled from, each NUL-terminated */
+struct list_file_header {
+    char magic[8];
+    apr_uint32_t node_size;         // sizeof(struct ip_trie_node), files of another layout are refused
+    apr_uint32_t pattern_count;
+    apr_uint32_t code_count;        // pattern_count, one more with the combined pattern
+    apr_uint32_t flags;             // Unused
+    apr_uint64_t whitelist_nodes;
+    apr_uint64_t blocklist_nodes;
+    apr_uint64_t codes_size;        // Bytes of serialized codes, after code_count sizes
+    apr_uint64_t patterns_size;     // Bytes of patterns
+};
+
+/* list file (a precompiled list mapped read-only; tries are used in place, only the patterns are JIT compiled) */
+struct list_file {
+    apr_pool_t *pool;               // Holds the mapping
+    struct ip_whitelist whitelist;  // Addresses never denied
+    struct ip_whitelist blocklist;  // Addresses always denied
+    struct pcre_vector uri_blocklist;
+};
+
+int list_file_compile(const char *source, const char *path, apr_pool_t *pool);
+struct list_file *list_file_open(const char *path);
+void list_file_close(struct list_file *list);
+
+/* END List File Headers */
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
+#endif /* EVASIVE_CORE_H */
@@ -0,0 +1,53 @@
+#!/bin/bash
+
+# load.sh: one load run inside the load container, printing a line of results
+# usage: load.sh <event|worker|prefork> <off|on|shared>
+
+mpm=$1
+mode=$2
+
+: ${LOAD_THREADS:=4}
+: ${LOAD_CONNECTIONS:=2000}
+: ${LOAD_DURATION:=30s}
+: ${LOAD_CLIENTS:=65536}
+: ${LOAD_PAGES:=64}
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+a2dismod -q -f mpm_event mpm_worker mpm_prefork > /dev/null
+a2enmod -q mpm_${mpm} > /dev/null || exit 1
+
+case ${mode} in
+off)
+	a2dismod -q evasive > /dev/null
+	;;
+on|shared)
+	a2enmod -q evasive > /dev/null
+	a2enconf -q mod_evasive > /dev/null
+	;;
+*)
+	echo "usage: $0 <event|worker|prefork> <off|on|shared>" >&2
+	exit 2
+	;;
+esac
+[ "${mode}" = shared ] && export APACHE_ARGUMENTS="-D EVASIVE_SHARED"
+
+ulimit -n 65536
+apache2ctl start || exit 1
+for i in $(seq 100); do
+	(echo > /dev/tcp/127.0.0.1/80) 2> /dev/null && break
+	sleep 0.1
+done
+
+out=$(wrk -t${LOAD_THREADS} -c${LOAD_CONNECTIONS} -d${LOAD_DURATION} --latency -s ${DIR}/xff.lua \
+	http://127.0.0.1/ -- ${LOAD_CLIENTS} ${LOAD_PAGES})
+echo "== ${mpm} ${mode}" >&2
+echo "${out}" >&2
+
+echo "${out}" | awk -v mpm=${mpm} -v mode=${mode} '
+	/^Requests\/sec:/ { rps = $2 }
+	$1 == "50%" { p50 = $2 }
+	$1 == "99%" { p99 = $2 }
+	/Non-2xx or 3xx responses:/ { non2xx = $NF }
+	/Socket errors:/ { errors = $0; sub(/.*Socket errors: /, "", errors); gsub(/ /, "", errors) }
+	END { printf "%-8s %-7s %12s %10s %10s %8d %s\n", mpm, mode, rps, p50, p99, non2xx, errors }'
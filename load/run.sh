@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# run.sh: load test every MPM without mod_evasive, with per-child tables and with the shared table
+# - the results are printed and appended to load_results.txt, the full wrk output to load_results.log
+# - LOAD_MPMS, LOAD_MODES, LOAD_THREADS, LOAD_CONNECTIONS, LOAD_DURATION, LOAD_CLIENTS and LOAD_PAGES
+#   override the defaults
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+cd "${DIR}/.."
+
+echo "Building load container"
+docker build . --target load -t mod_evasive_load || exit 1
+
+printf "%-8s %-7s %12s %10s %10s %8s %s\n" mpm evasive "requests/s" "p50" "p99" "non-2xx" "socket errors" | tee -a load_results.txt
+for mpm in ${LOAD_MPMS:-event worker prefork}
+do
+	for mode in ${LOAD_MODES:-off on shared}
+	do
+		docker run --rm --ulimit nofile=65536:65536 --name=mod_evasive_load \
+			-e LOAD_THREADS -e LOAD_CONNECTIONS -e LOAD_DURATION -e LOAD_CLIENTS -e LOAD_PAGES \
+			mod_evasive_load load/load.sh ${mpm} ${mode} 2>> load_results.log | tee -a load_results.txt
+	done
+done
@@ -0,0 +1,20 @@
+-- xff.lua: wrk script sending every request from one of many clients, told apart by X-Forwarded-For
+-- usage: wrk -s xff.lua http://127.0.0.1/ -- [clients] [pages]
+
+local clients = 65536
+local pages = 64
+
+function init(args)
+	clients = tonumber(args[1]) or clients
+	pages = tonumber(args[2]) or pages
+
+	-- Every thread runs its own copy of the script, give each its own sequence
+	math.randomseed(os.time() + tonumber(tostring({}):match("0x(%x+)") or "0", 16) % 1000003)
+end
+
+function request()
+	local c = math.random(0, clients - 1)
+	local ip = string.format("10.%d.%d.%d", math.floor(c / 65536) % 256, math.floor(c / 256) % 256, c % 256)
+
+	return wrk.format("GET", "/page/" .. math.random(0, pages - 1), { ["X-Forwarded-For"] = ip })
+end
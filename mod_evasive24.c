@@ -23,150 +23,479 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>  // getpid(2)
-
-#define PCRE2_CODE_UNIT_WIDTH 8
-#include <pcre2.h>
+#include <signal.h>  // kill(2)
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #include "httpd.h"
 #include "http_core.h"
 #include "http_config.h"
 #include "http_log.h"
 #include "http_main.h"
+#include "http_protocol.h"
 #include "http_request.h"
+#include "ap_mpm.h"
+#include "scoreboard.h"
+#include "util_mutex.h"
+#include "mod_status.h"
+
+#include "apr_shm.h"
+#include "apr_mmap.h"
+#include "apr_global_mutex.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_proc.h"
+
+#include "evasive_core.h"
 
 /* BEGIN DoS Evasive Maneuvers Definitions */
 
 AP_DECLARE_MODULE(evasive);
 
 #define MAILER  "/bin/mail %s"
+#define IPSET_RESTORE   "ipset restore -exist"  // Reads "add <set> <ip>" lines
+#define NFT_RESTORE     "nft -f -"              // Reads "add element <set> { <ip> }" lines
 
 #define DEFAULT_HASH_TBL_SIZE   3079UL  // Default hash table size
 #define DEFAULT_PAGE_COUNT      2       // Default maximum page hit count per interval
 #define DEFAULT_SITE_COUNT      50      // Default maximum site hit count per interval
 #define DEFAULT_PAGE_INTERVAL   1       // Default 1 Second page interval
 #define DEFAULT_SITE_INTERVAL   1       // Default 1 Second site interval
+#define DEFAULT_SUBNET_PREFIX4  24      // Default prefix length of IPv4 clients counted together
+#define DEFAULT_SUBNET_PREFIX6  64      // Default prefix length of IPv6 clients counted together
+#define DEFAULT_SKETCH_HOLDS    1024    // Default number of blocked clients kept with DOSSketchSize
+#define DEFAULT_RATE_ALGORITHM  RATE_FIXED // Default counting of hits per interval
+#define DEFAULT_CLUSTER_INTERVAL apr_time_from_msec(100) // Default interval between two cluster datagrams
 #define DEFAULT_BLOCKING_PERIOD 10      // Default for Detected IPs; blocked for 10 seconds
 #define DEFAULT_LOG_DIR         "/tmp"  // Default temp directory
 #define DEFAULT_HTTP_REPLY      HTTP_FORBIDDEN // Default HTTP Reply code (403)
+#define DEFAULT_LOG_SAMPLE      1       // Default of logging every denial
+#define DEFAULT_ADAPTIVE_FLOOR  50      // Default percentage of the counts left with all workers busy
+
+#define SHT_MUTEX_TYPE  "evasive-shm"   // Mutex type, configurable with the Mutex directive
 
 /* END DoS Evasive Maneuvers Definitions */
 
-/* BEGIN NTT (Named Timestamp Tree) Headers */
 
-enum { ntt_num_primes = 28 };
+/* BEGIN DoS Evasive Maneuvers Globals */
 
-/* ntt root tree */
-struct ntt {
-    size_t size;
-    size_t items;
-    struct ntt_node **tbl;
+static apr_shm_t *shm_segment;          // Shared memory holding the shared hit tables
+static apr_global_mutex_t *shm_mutex;   // Serializes access to the shared hit tables
+static apr_uint32_t deny_log_count;     // Denials of this child that could have been logged, for DOSLogSample
+static volatile apr_uint32_t load_busy; // Permille of MaxRequestWorkers busy at the last sample, for DOSAdaptiveLoad
+static volatile apr_uint32_t load_next; // Second of the next sample
+static int load_daemons;                // Scoreboard size, set up in child_init; 0 if there is no scoreboard
+static int load_threads;
+static int load_workers;                // MaxRequestWorkers
+
+/* Directives set in a configuration; virtual hosts inherit the others from the main server */
+#define CONFIG_ENABLED          (APR_UINT64_C(1) << 0)
+#define CONFIG_SHARED_TABLE     (APR_UINT64_C(1) << 1)
+#define CONFIG_HASH_TABLE_SIZE  (APR_UINT64_C(1) << 2)
+#define CONFIG_SKETCH_SIZE      (APR_UINT64_C(1) << 3)
+#define CONFIG_PAGE_COUNT       (APR_UINT64_C(1) << 4)
+#define CONFIG_SITE_COUNT       (APR_UINT64_C(1) << 5)
+#define CONFIG_PAGE_INTERVAL    (APR_UINT64_C(1) << 6)
+#define CONFIG_SITE_INTERVAL    (APR_UINT64_C(1) << 7)
+#define CONFIG_SUBNET_COUNT     (APR_UINT64_C(1) << 8)
+#define CONFIG_SUBNET_PREFIX    (APR_UINT64_C(1) << 9)
+#define CONFIG_RATE_ALGORITHM   (APR_UINT64_C(1) << 10)
+#define CONFIG_BLOCKING_PERIOD  (APR_UINT64_C(1) << 11)
+#define CONFIG_EMAIL_NOTIFY     (APR_UINT64_C(1) << 12)
+#define CONFIG_LOG_DIR          (APR_UINT64_C(1) << 13)
+#define CONFIG_SYSTEM_COMMAND   (APR_UINT64_C(1) << 14)
+#define CONFIG_FIREWALL_SET     (APR_UINT64_C(1) << 15)
+#define CONFIG_CLUSTER_ADDRESS  (APR_UINT64_C(1) << 16)
+#define CONFIG_CLUSTER_KEY      (APR_UINT64_C(1) << 17)
+#define CONFIG_CLUSTER_INTERVAL (APR_UINT64_C(1) << 18)
+#define CONFIG_SNAPSHOT_FILE    (APR_UINT64_C(1) << 19)
+#define CONFIG_WHITELIST        (APR_UINT64_C(1) << 20)
+#define CONFIG_WHITELIST_URI    (APR_UINT64_C(1) << 21)
+#define CONFIG_TARGETLIST_URI   (APR_UINT64_C(1) << 22)
+#define CONFIG_BLOCKLIST_URI    (APR_UINT64_C(1) << 23)
+#define CONFIG_CONNECTION_CHECK (APR_UINT64_C(1) << 24)
+#define CONFIG_HTTP_STATUS      (APR_UINT64_C(1) << 25)
+#define CONFIG_FAST_REPLY       (APR_UINT64_C(1) << 26)
+#define CONFIG_LOG_SAMPLE       (APR_UINT64_C(1) << 27)
+#define CONFIG_TABLE_SCOPE      (APR_UINT64_C(1) << 28)
+#define CONFIG_URI_CANONICAL    (APR_UINT64_C(1) << 29)
+#define CONFIG_URI_STRIP_PREFIX (APR_UINT64_C(1) << 30)
+#define CONFIG_URI_ROUTES       (APR_UINT64_C(1) << 31)
+#define CONFIG_LIST_FILE        (APR_UINT64_C(1) << 32)
+#define CONFIG_ADAPTIVE_LOAD    (APR_UINT64_C(1) << 33)
+#define CONFIG_EVENT_LOG        (APR_UINT64_C(1) << 34)
+
+typedef struct evasive_config {
+    apr_uint64_t set;       // CONFIG_* bits of the directives set here
+    int enabled;
+    int shared;
+    int table_scope;        // TABLE_VHOST or TABLE_SERVER
+    server_rec *server;     // First server found with this configuration, set up in post_config
+    struct evasive_config *table_owner; // Configuration whose tables are used, set up in post_config
+    struct ntt *hit_list;   // Our dynamic hash table, set up in post_config
+    struct sht *shared_table; // Hit table shared by all children, set up in post_config
+    size_t hash_table_size;
+    size_t sketch_width;    // Counters per sketch row, 0 to count hits in the hash table
+    size_t sketch_holds;
+    struct sketch *sketch;  // Fixed-memory replacement of hit_list, set up in post_config
+    struct block_filter *block_filter; // Clients and prefixes this child put on hold, set up in post_config
+    struct pcre_vector uri_whitelist;
+    struct pcre_vector uri_targetlist;
+    struct pcre_vector uri_blocklist;
+    unsigned int uri_canonical; // URI_* flags of the URIs counted, see uri_canonicalize
+    char **uri_prefixes;    // Prefixes stripped from the URIs counted
+    size_t uri_prefixes_size;
+    int uri_routes;         // Whether URIs matching a targetlist pattern are counted as the pattern
+    char *list_path;        // Precompiled lists, reloaded when the file changes
+    struct list_watch *list; // Set up in post_config
+    char *event_target;     // File or "unix:" socket of detection events
+    struct event_log *events; // Set up in post_config
+    struct ip_whitelist ip_whitelist;
+    unsigned int page_count;
+    apr_interval_time_t page_interval;
+    unsigned int site_count;
+    apr_interval_time_t site_interval;
+    unsigned int subnet_count; // Site hits per site interval of all clients of a prefix, 0 to not count prefixes
+    unsigned int subnet_prefix4;
+    unsigned int subnet_prefix6;
+    unsigned int adaptive_start; // Percentage of busy workers from which counts shrink, 0 for static counts
+    unsigned int adaptive_floor; // Percentage of the counts left with all workers busy
+    apr_interval_time_t blocking_period;
+    int rate_algorithm;     // RATE_FIXED, RATE_SLIDING or RATE_BUCKET
+    char *email_notify;
+    char *log_dir;
+    char *system_command;
+    int firewall;           // FIREWALL_NONE, FIREWALL_IPSET or FIREWALL_NFT
+    char *firewall_set4;    // Set for blocked IPv4 addresses
+    char *firewall_set6;    // Set for blocked IPv6 addresses, optional
+    char *cluster_host;     // Multicast group shared with the other frontends
+    apr_port_t cluster_port;
+    int cluster_keyed;      // Whether cluster_secret is set
+    apr_uint64_t cluster_secret[2]; // Authenticates datagrams and hashes URIs alike on all frontends
+    apr_interval_time_t cluster_interval;
+    struct cluster *cluster; // Channel of this child, set up in child_init
+    volatile apr_uint32_t *cluster_receiver; // Child applying remote hits to the shared table, in shared memory
+    char *snapshot_file;    // Keeps the hit list across restarts
+    int connection_check;   // Whether connections of blocked clients are closed before their first request
+    int http_reply;
+    int fast_reply;         // Whether denials are answered directly, without error documents
+    const char *fast_reply_body; // Set up in post_config, with the Retry-After header
+    const char *retry_after;
+    unsigned int log_sample; // Log one in this many denials, 0 for none
+} evasive_config;
+
+/* scopes of the hit tables for DOSTableScope */
+enum {
+    TABLE_VHOST = 0,        // Every virtual host with its own mod_evasive directives has its own tables
+    TABLE_SERVER,           // Virtual hosts count in the tables of the main server
 };
 
-/* ntt node (entry in the ntt root tree) */
-struct ntt_node {
-    char *key;
-    apr_time_t timestamp;
-    size_t count;
-    struct ntt_node *next;
+/* canonicalization of DOSUriCanonical left to the module, next to the URI_* flags of the core */
+enum {
+    URI_PATH_INFO = 1 << 8,     // "/index.php/junk" as "/index.php"
 };
 
-/* ntt cursor */
-struct ntt_c {
-    size_t iter_index;
-    struct ntt_node *iter_next;
+/* firewall backends for DOSFirewallSet */
+enum {
+    FIREWALL_NONE = 0,
+    FIREWALL_IPSET,
+    FIREWALL_NFT,
 };
 
-static struct ntt *ntt_create(size_t size);
-static int ntt_destroy(struct ntt *ntt);
-static struct ntt_node *ntt_find(struct ntt *ntt, const char *key);
-static struct ntt_node *ntt_insert(struct ntt *ntt, const char *key, apr_time_t timestamp);
-static int ntt_delete(struct ntt *ntt, const char *key);
-static size_t ntt_hashcode(const struct ntt *ntt, const char *key);
-static struct ntt_node *c_ntt_first(struct ntt *ntt, struct ntt_c *c);
-static struct ntt_node *c_ntt_next(struct ntt *ntt, struct ntt_c *c);
+static apr_status_t destroy_config(void *dconfig);
+static int is_uri_whitelisted(const char *uri, const evasive_config *cfg);
+static int is_uri_targeted(const char *uri, const evasive_config *cfg);
+static int is_uri_blocklisted(const char *uri, const evasive_config *cfg);
+static int list_file_whitelisted(const evasive_config *cfg, const apr_sockaddr_t *addr);
+static int list_file_blocked(const evasive_config *cfg, const apr_sockaddr_t *addr);
+static const char *list_file_denied(const evasive_config *cfg, const request_rec *r);
 
-/* END NTT (Named Timestamp Tree) Headers */
+/* END DoS Evasive Maneuvers Globals */
 
+/* BEGIN Notifier Headers */
 
-/* BEGIN DoS Evasive Maneuvers Globals */
+enum { notify_queue_size = 1024 };      // Power of two
+enum { notify_max_children = 8 };       // Mailers and commands running at once per child
+enum { notify_max_batch = 1000 };       // Addresses listed in one email
 
-struct pcre_node {
-    pcre2_code *re;
-    pcre2_match_data *match_data;
+#define NOTIFY_MAIL_INTERVAL 60         // Minimum seconds between two emails to the same address
+
+/* notify event (an address denied by the module) */
+struct notify_event {
+    volatile apr_uint32_t seq;          // Queue position the slot is ready for
+    const evasive_config *cfg;
+    server_rec *server;
+    char ip[64];
 };
 
-struct pcre_vector {
-    struct pcre_node *data;
-    size_t size;
+/* notify queue (bounded and lock-free for request threads, drained by a single notifier thread) */
+struct notify_queue {
+    volatile apr_uint32_t head;         // Next position to fill
+    apr_uint32_t tail;                  // Next position to drain, only touched by the notifier thread
+    volatile apr_uint32_t dropped;      // Events lost to a full queue
+    volatile apr_uint32_t waiting;      // Whether the notifier thread sleeps on cond
+    volatile apr_uint32_t stop;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_thread_t *thread;
+#endif
+    struct notify_event slots[notify_queue_size];
 };
 
-struct ip_node {
-    union {
-        struct in_addr v4;
-        struct in6_addr v6;
-    } ip;
+static struct notify_queue *notify_queue;   // Set up in child_init; NULL to notify on the request thread
+
+static int notify_block(const evasive_config *cfg, server_rec *s, const char *ip);
+
+/* END Notifier Headers */
 
-    union {
-        uint32_t v4;
-        struct in6_addr v6;
-    } mask;
+/* BEGIN Cluster Headers */
 
-    char family; // AF_INET or AF_INET6
+enum { cluster_queue_size = 4096 };     // Power of two
+enum { cluster_max_records = 40 };      // Records per datagram, keeping it below common MTUs
+
+#define CLUSTER_MAGIC       UINT32_C(0x31535645)    // "EVS1" in little endian
+#define CLUSTER_MAX_SKEW    apr_time_from_sec(5)    // Datagrams sent longer ago (or ahead) are ignored
+
+/* Datagram layout, all integers little endian: header, records, SipHash of both */
+enum {
+    cluster_header_size = 32,           // magic, number of records (4 bytes each), server, child, time (8 bytes each)
+    cluster_record_size = 32,           // address (16 bytes), URI hash (8), key type (4), hits (4)
+    cluster_datagram_max = cluster_header_size + cluster_max_records * cluster_record_size + 8,
 };
 
-struct ip_vector {
-    struct ip_node *data;
-    size_t size;
+/* cluster event (a hit or block to share with the other frontends) */
+struct cluster_event {
+    volatile apr_uint32_t seq;          // Queue position the slot is ready for
+    struct ntt_key key;
 };
 
-typedef struct {
-    int enabled;
-    struct ntt *hit_list;   // Our dynamic hash table
-    size_t hash_table_size;
-    struct pcre_vector uri_whitelist;
-    struct pcre_vector uri_targetlist;
-    struct pcre_vector uri_blocklist;
-    struct ip_vector ip_whitelist;
-    unsigned int page_count;
-    int page_interval;
-    unsigned int site_count;
-    int site_interval;
-    int blocking_period;
-    char *email_notify;
-    char *log_dir;
-    char *system_command;
-    int http_reply;
-} evasive_config;
+/* cluster channel of a configuration in a child (queue filled by request threads, drained by the sync thread) */
+struct cluster {
+    volatile apr_uint32_t head;         // Next position to fill
+    apr_uint32_t tail;                  // Next position to drain, only touched by the sync thread
+    volatile apr_uint32_t dropped;      // Events lost to a full queue
+    volatile apr_uint32_t stop;
+    evasive_config *cfg;
+    server_rec *server;
+    apr_uint64_t child;                 // Random id of the child, to ignore its own datagrams
+    apr_socket_t *socket;
+    apr_sockaddr_t *group;
+#if APR_HAS_THREADS
+    apr_thread_t *thread;
+#endif
+    struct cluster_event slots[cluster_queue_size];
+};
 
-static int is_whitelisted(const apr_sockaddr_t *client, const evasive_config *cfg);
+static apr_uint64_t cluster_server;     // Random id of the server, inherited by its children
 
-static int is_uri_whitelisted(const char *uri, const evasive_config *cfg);
-static int is_uri_targeted(const char *uri, const evasive_config *cfg);
-static int is_uri_blocklisted(const char *uri, const evasive_config *cfg);
+static void cluster_publish(evasive_config *cfg, const struct ntt_key *key);
 
-/* END DoS Evasive Maneuvers Globals */
+/* END Cluster Headers */
 
-static void * ev_reallocarray(void *ptr, size_t nmemb, size_t size)
-{
-        if (size && nmemb > SIZE_MAX / size) {
-                errno = ENOMEM;
-                return NULL;
-        }
+/* BEGIN Snapshot Headers */
 
-        return realloc(ptr, nmemb * size);
-}
+#define SNAPSHOT_MAGIC "EVSNAP1"        // Including the terminating NUL
+
+/* snapshot file: this header followed by count ntt nodes, in the byte order and layout of the server */
+struct snapshot_header {
+    char magic[8];
+    apr_uint32_t node_size;             // sizeof(struct ntt_node), snapshots of other builds are ignored
+    apr_uint32_t flags;                 // Reserved, 0
+    apr_uint64_t count;
+    apr_uint64_t secret[2];             // ntt_secret the URI hashes of the nodes were computed with
+};
+
+static size_t snapshot_restored;        // Entries restored by the current post_config
+
+/* END Snapshot Headers */
+
+/* BEGIN List File Headers */
+
+#define LIST_FILE_INTERVAL apr_time_from_sec(1) // Between two checks of a DOSListFile for a new generation
+
+/* list watch (generations of a DOSListFile, shared by the configurations naming the file). Request threads count
+   themselves as readers of the current generation while they use it; the watch thread of each child loads a new
+   generation into the other slot, switches requests over to it, and frees the replaced one once its last reader is
+   done. */
+struct list_watch {
+    const char *path;
+    server_rec *server;                 // Server whose children watch the file
+    struct list_file *generations[2];   // NULL until a valid file is loaded into the slot
+    volatile apr_uint32_t current;      // Slot of the generation new requests use
+    volatile apr_uint32_t readers[2];   // Requests using the generation of each slot
+    apr_time_t mtime;                   // Of the file last tried
+    apr_pool_t *pool;
+    volatile apr_uint32_t stop;
+    apr_thread_t *thread;
+};
+
+/* END List File Headers */
+
+/* BEGIN Event Log Headers */
+
+enum { event_queue_size = 4096 };       // Power of two
+enum { event_batch_size = 8192 };       // Bytes of JSON lines per write, and per datagram to a socket
+
+#define EVENT_LOG_INTERVAL apr_time_from_msec(100)  // Between two flushes of the queued events
+#define EVENT_LOG_SOCKET "unix:"        // Prefix of a DOSEventLog naming a datagram socket rather than a file
+
+/* detection events of DOSEventLog */
+enum {
+    EVENT_BLOCK = 0,                    // A client or prefix was put on hold
+    EVENT_HELD,                         // A request was denied because its client or prefix was on hold
+};
+
+static const char *const event_names[] = { "block", "held" };
+
+/* event record (filled by a request thread, written as a JSON line by the flush thread) */
+struct event_record {
+    volatile apr_uint32_t seq;          // Queue position the slot is ready for
+    apr_uint32_t event;                 // EVENT_BLOCK or EVENT_HELD
+    struct ntt_key key;                 // Key held or exceeded; the address is a prefix for the subnet types
+    const char *reason;                 // Of the block, a string constant; NULL for EVENT_HELD
+    server_rec *server;
+    apr_time_t time;
+    apr_time_t until;                   // End of the hold, unless the client keeps trying
+    unsigned int count;                 // Count exceeded, 0 for blocks by a list
+    unsigned int prefix;                // Prefix length of the subnet types
+};
+
+/* event queue of a log in a child (filled by request threads, drained by the flush thread) */
+struct event_queue {
+    volatile apr_uint32_t head;         // Next position to fill
+    apr_uint32_t tail;                  // Next position to drain, only touched by the flush thread
+    volatile apr_uint32_t stop;
+    int failing;                        // Whether the last write failed, to log failures once
+    pid_t pid;
+    struct event_log *log;
+    apr_pool_t *pool;                   // Cleared after every flush
+#if APR_HAS_THREADS
+    apr_thread_t *thread;
+#endif
+    struct event_record slots[event_queue_size];
+};
+
+/* event log (target of DOSEventLog, shared by the configurations naming it). The file or socket is opened by the
+   parent; request threads never write, each child queues its events and writes them in batches. */
+struct event_log {
+    const char *target;
+    server_rec *server;                 // Server whose children write to the log
+    apr_file_t *file;                   // NULL for a socket
+    int socket;                         // Datagram socket, -1 for a file
+    struct sockaddr_un addr;
+    struct event_queue *queue;          // Set up in child_init; NULL to not log events
+};
+
+static void event_log_publish(const evasive_config *cfg, apr_uint32_t event, const struct ntt_key *key,
+        const char *reason, unsigned int count, server_rec *s, apr_time_t t);
+
+/* END Event Log Headers */
+
+/* BEGIN Statistics Headers */
+
+#define STATS_HANDLER "evasive-status"  // SetHandler name of the status page
+
+/* Counters kept per child: name, Prometheus type and description */
+#define STATS_COUNTERS(X)                                                                       \
+    X(requests,         "counter", "Requests checked")                                          \
+    X(whitelisted,      "counter", "Requests allowed by DOSWhitelist or DOSWhitelistUri")        \
+    X(held,             "counter", "Requests denied because the client was already blocked")    \
+    X(refused,          "counter", "Connections closed because the client was already blocked") \
+    X(filtered,         "counter", "Block lookups skipped by the blocked-address filter")       \
+    X(uri_dos,          "counter", "Clients blocked for exceeding DOSPageCount")                \
+    X(site_dos,         "counter", "Clients blocked for exceeding DOSSiteCount")                \
+    X(subnet_dos,       "counter", "Prefixes blocked for exceeding DOSSubnetCount")             \
+    X(uri_blocklist,    "counter", "Clients blocked for requesting a DOSBlocklistUri")          \
+    X(list_blocklist,   "counter", "Clients blocked by the blocklists of the DOSListFile")      \
+    X(list_reloads,     "counter", "Generations of the DOSListFile loaded by children")         \
+    X(adaptive,         "counter", "Requests counted against counts lowered by DOSAdaptiveLoad") \
+    X(events,           "counter", "Detection events written to the DOSEventLog")               \
+    X(events_dropped,   "counter", "Detection events lost to a full queue or a failed write")   \
+    X(check_usec,       "counter", "Microseconds spent checking requests")                      \
+    X(regex_usec,       "counter", "Microseconds spent matching URI lists")                     \
+    X(table_grows,      "counter", "Hash table stripes grown")                                  \
+    X(table_shrinks,    "counter", "Hash table stripes shrunk")                                 \
+    X(table_expired,    "counter", "Hash table entries expired")
+
+#ifdef EVASIVE_HISTOGRAMS
+
+/* Latency histograms, built with -DEVASIVE_HISTOGRAMS: stages timed, and their names */
+enum {
+    HIST_CHECK = 0,         // All of access_checker
+    HIST_WHITELIST,         // DOSWhitelist
+    HIST_URI_WHITELIST,     // DOSWhitelistUri
+    HIST_URI_TARGETLIST,    // DOSTargetlistUri
+    HIST_URI_BLOCKLIST,     // DOSBlocklistUri
+    HIST_HIT_LIST,          // Every lookup or update of the hash table
+    HIST_NOTIFY,            // Handing a block to the notifier
+    hist_num_stages
+};
+
+static const char *const hist_stage_names[hist_num_stages] = {
+    "check", "whitelist", "uri_whitelist", "uri_targetlist", "uri_blocklist", "hit_list", "notify",
+};
+
+/* Log-linear buckets of nanoseconds, as in HDR histograms: values below 8 exactly, above that 8 buckets per power
+   of two (at most 12.5% apart), up to 2^36 ns */
+enum { hist_sub_bits = 3 };
+enum { hist_max_bits = 36 };
+enum { hist_num_buckets = (hist_max_bits - hist_sub_bits + 1) << hist_sub_bits };
+
+static apr_uint64_t hist_now(void);
+static void hist_record(int stage, apr_uint64_t ns);
+
+#define HIST_START(var) apr_uint64_t var = hist_now()
+#define HIST_STOP(stage, var) hist_record(stage, hist_now() - (var))
+
+#else
+
+#define HIST_START(var) ((void) 0)
+#define HIST_STOP(stage, var) ((void) 0)
+
+#endif
+
+/* stats slot (counters of one child, or of all exited children in slot 0; one cache line per slot or more) */
+struct stats_slot {
+    volatile apr_uint32_t pid;          // Child owning the slot, 0 if free
+#define STATS_FIELD(name, type, help) volatile apr_uint64_t name;
+    STATS_COUNTERS(STATS_FIELD)
+#undef STATS_FIELD
+#ifdef EVASIVE_HISTOGRAMS
+    volatile apr_uint64_t hist_sum[hist_num_stages];                    // Nanoseconds
+    volatile apr_uint64_t hist[hist_num_stages][hist_num_buckets];
+#endif
+} __attribute__((aligned(64)));
+
+static apr_shm_t *stats_segment;        // Shared memory holding the slots of all children
+static struct stats_slot *stats_slots;
+static int stats_num_slots;
+static struct stats_slot *stats;        // Slot of this child, NULL if there is none
+
+#define STATS_ADD(field, n)                                         \
+    do {                                                            \
+        if (stats != NULL)                                          \
+            apr_atomic_add64(&stats->field, (apr_uint64_t) (n));    \
+    } while (0)
+
+#define STATS_INC(field) STATS_ADD(field, 1)
+
+/* END Statistics Headers */
 
 
 static void * create_dir_conf(apr_pool_t *p, __attribute__((unused)) char *context)
 {
-    /* Create a new hit list for this listener */
+    /* The hit tables are only created in post_config, for the configurations that are enabled */
     evasive_config *cfg = apr_palloc(p, sizeof(evasive_config));
     if (!cfg) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to allocate configuration");
@@ -174,1038 +503,3348 @@ static void * create_dir_conf(apr_pool_t *p, __attribute__((unused)) char *conte
     }
 
     *cfg = (evasive_config) {
+        .set = 0,
         .enabled = 0,
-        .hit_list = ntt_create(DEFAULT_HASH_TBL_SIZE),
+        .shared = 0,
+        .table_scope = TABLE_VHOST,
+        .server = NULL,
+        .table_owner = NULL,
+        .hit_list = NULL,
+        .shared_table = NULL,
         .hash_table_size = DEFAULT_HASH_TBL_SIZE,
+        .sketch_holds = DEFAULT_SKETCH_HOLDS,
         .uri_whitelist = (struct pcre_vector) { .data = NULL, .size = 0 },
         .uri_targetlist = (struct pcre_vector) { .data = NULL, .size = 0 },
         .uri_blocklist = (struct pcre_vector) { .data = NULL, .size = 0 },
-        .ip_whitelist = (struct ip_vector) { .data = NULL, .size = 0 },
+        .uri_canonical = 0,
+        .uri_prefixes = NULL,
+        .uri_prefixes_size = 0,
+        .uri_routes = 0,
+        .list_path = NULL,
+        .list = NULL,
+        .event_target = NULL,
+        .events = NULL,
+        .ip_whitelist = (struct ip_whitelist) { .trie = { .nodes = NULL }, .wildcards = { .data = NULL } },
         .page_count = DEFAULT_PAGE_COUNT,
-        .page_interval = DEFAULT_PAGE_INTERVAL,
+        .page_interval = apr_time_from_sec(DEFAULT_PAGE_INTERVAL),
         .site_count = DEFAULT_SITE_COUNT,
-        .site_interval = DEFAULT_SITE_INTERVAL,
-        .blocking_period = DEFAULT_BLOCKING_PERIOD,
+        .site_interval = apr_time_from_sec(DEFAULT_SITE_INTERVAL),
+        .subnet_prefix4 = DEFAULT_SUBNET_PREFIX4,
+        .subnet_prefix6 = DEFAULT_SUBNET_PREFIX6,
+        .adaptive_start = 0,
+        .adaptive_floor = DEFAULT_ADAPTIVE_FLOOR,
+        .blocking_period = apr_time_from_sec(DEFAULT_BLOCKING_PERIOD),
+        .rate_algorithm = DEFAULT_RATE_ALGORITHM,
         .email_notify = NULL,
         .log_dir = NULL,
         .system_command = NULL,
+        .firewall = FIREWALL_NONE,
+        .firewall_set4 = NULL,
+        .firewall_set6 = NULL,
+        .cluster_host = NULL,
+        .cluster_port = 0,
+        .cluster_keyed = 0,
+        .cluster_interval = DEFAULT_CLUSTER_INTERVAL,
+        .cluster = NULL,
+        .cluster_receiver = NULL,
+        .snapshot_file = NULL,
+        .connection_check = 0,
         .http_reply = DEFAULT_HTTP_REPLY,
+        .fast_reply = 0,
+        .fast_reply_body = NULL,
+        .retry_after = NULL,
+        .log_sample = DEFAULT_LOG_SAMPLE,
     };
-    if (!cfg->hit_list)
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to allocate hashtable");
+
+    /* The lists and strings set here are freed with the configuration pool */
+    apr_pool_cleanup_register(p, cfg, destroy_config, apr_pool_cleanup_null);
 
     return cfg;
 }
 
-static int parse_wildcard(const char *ip, struct in_addr *addr, uint32_t *mask)
+/* Settings a virtual host does not set are those of the main server; the merged configuration shares the lists
+   and strings of both, which stay owned by the configurations they were set in */
+
+static void * merge_dir_conf(apr_pool_t *p, void *basev, void *addv)
 {
-    char *dip;
-    const char *oct;
-    char *safeptr;
-    int i = 0;
-    uint32_t ip_byte = 0, mask_byte = 0;
-    unsigned long val;
-    char *endptr;
+    evasive_config *base = (evasive_config *) basev;
+    evasive_config *add = (evasive_config *) addv;
+    evasive_config *cfg = apr_palloc(p, sizeof(evasive_config));
 
-    dip = strdup(ip);
-    if (!dip)
-        goto err;
+    /* Nothing but the settings is set up before post_config */
+    *cfg = *base;
+    cfg->set = base->set | add->set;
+
+#define MERGE(bit, field)           \
+    if (add->set & (bit))           \
+        cfg->field = add->field
+
+    MERGE(CONFIG_ENABLED, enabled);
+    MERGE(CONFIG_SHARED_TABLE, shared);
+    MERGE(CONFIG_TABLE_SCOPE, table_scope);
+    MERGE(CONFIG_HASH_TABLE_SIZE, hash_table_size);
+    MERGE(CONFIG_SKETCH_SIZE, sketch_width);
+    MERGE(CONFIG_SKETCH_SIZE, sketch_holds);
+    MERGE(CONFIG_WHITELIST_URI, uri_whitelist);
+    MERGE(CONFIG_TARGETLIST_URI, uri_targetlist);
+    MERGE(CONFIG_BLOCKLIST_URI, uri_blocklist);
+    MERGE(CONFIG_URI_CANONICAL, uri_canonical);
+    MERGE(CONFIG_URI_STRIP_PREFIX, uri_prefixes);
+    MERGE(CONFIG_URI_STRIP_PREFIX, uri_prefixes_size);
+    MERGE(CONFIG_URI_ROUTES, uri_routes);
+    MERGE(CONFIG_LIST_FILE, list_path);
+    MERGE(CONFIG_EVENT_LOG, event_target);
+    MERGE(CONFIG_WHITELIST, ip_whitelist);
+    MERGE(CONFIG_PAGE_COUNT, page_count);
+    MERGE(CONFIG_PAGE_INTERVAL, page_interval);
+    MERGE(CONFIG_SITE_COUNT, site_count);
+    MERGE(CONFIG_SITE_INTERVAL, site_interval);
+    MERGE(CONFIG_SUBNET_COUNT, subnet_count);
+    MERGE(CONFIG_SUBNET_PREFIX, subnet_prefix4);
+    MERGE(CONFIG_SUBNET_PREFIX, subnet_prefix6);
+    MERGE(CONFIG_ADAPTIVE_LOAD, adaptive_start);
+    MERGE(CONFIG_ADAPTIVE_LOAD, adaptive_floor);
+    MERGE(CONFIG_BLOCKING_PERIOD, blocking_period);
+    MERGE(CONFIG_RATE_ALGORITHM, rate_algorithm);
+    MERGE(CONFIG_EMAIL_NOTIFY, email_notify);
+    MERGE(CONFIG_LOG_DIR, log_dir);
+    MERGE(CONFIG_SYSTEM_COMMAND, system_command);
+    MERGE(CONFIG_FIREWALL_SET, firewall);
+    MERGE(CONFIG_FIREWALL_SET, firewall_set4);
+    MERGE(CONFIG_FIREWALL_SET, firewall_set6);
+    MERGE(CONFIG_CLUSTER_ADDRESS, cluster_host);
+    MERGE(CONFIG_CLUSTER_ADDRESS, cluster_port);
+    MERGE(CONFIG_CLUSTER_KEY, cluster_keyed);
+    MERGE(CONFIG_CLUSTER_KEY, cluster_secret[0]);
+    MERGE(CONFIG_CLUSTER_KEY, cluster_secret[1]);
+    MERGE(CONFIG_CLUSTER_INTERVAL, cluster_interval);
+    MERGE(CONFIG_CONNECTION_CHECK, connection_check);
+    MERGE(CONFIG_HTTP_STATUS, http_reply);
+    MERGE(CONFIG_FAST_REPLY, fast_reply);
+    MERGE(CONFIG_LOG_SAMPLE, log_sample);
+
+#undef MERGE
+
+    /* Two tables cannot be kept in one file */
+    cfg->snapshot_file = add->snapshot_file;
 
-    oct = strtok_r(dip, ".", &safeptr);
-    while(oct != NULL && i < 4) {
-        if (oct[0] == '\0' || strlen(oct) > 3)
-            goto err;
+    return cfg;
+}
 
-        if (oct[0] == '*' && oct[1] == '\0') {
-            ip_byte += 0;
-            mask_byte += 0;
-        } else {
-            errno = 0;
-            val = strtoul(oct, &endptr, 10);
-            if (errno || *endptr != '\0' || val > 255)
-                goto err;
+static const char *whitelist_ip(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *ip)
+{
+    evasive_config *cfg = (evasive_config *) dconfig;
 
-            ip_byte += val;
-            mask_byte += 255;
-        }
+    cfg->set |= CONFIG_WHITELIST;
 
-        i++;
-        if (i < 4) {
-            ip_byte <<= 8;
-            mask_byte <<= 8;
-        }
+    ip_whitelist_add(&cfg->ip_whitelist, ip);
+    return NULL;
+}
 
-        oct = strtok_r(NULL, ".", &safeptr);
-    }
+static const char *whitelist_uri(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *uri_re)
+{
+    evasive_config *cfg = (evasive_config *) dconfig;
 
-    if (oct || i != 4)
-        goto err;
+    cfg->set |= CONFIG_WHITELIST_URI;
 
-    free(dip);
+    pcre_vector_push(&cfg->uri_whitelist, uri_re);
+    return NULL;
+}
 
-    addr->s_addr = htobe32(ip_byte);
-    *mask = htobe32(mask_byte);
-    return 1;
-err:
-    free(dip);
-    return -1;
+static const char *target_uri(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *uri_re)
+{
+    evasive_config *cfg = (evasive_config *) dconfig;
+
+    cfg->set |= CONFIG_TARGETLIST_URI;
+
+    pcre_vector_push(&cfg->uri_targetlist, uri_re);
+    return NULL;
 }
 
-static void ipv6_cidr_bits_to_mask(unsigned long cidr_bits, struct in6_addr *mask)
+static const char *blocklist_uri(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *uri_re)
 {
-    for (unsigned i = 0; i < 4; i++) {
-        if (cidr_bits == 0) {
-            mask->s6_addr32[i] = 0;
-        } else if (cidr_bits >= 32) {
-            mask->s6_addr32[i] = ~UINT32_C(0);
-        } else {
-            mask->s6_addr32[i] = htobe32(~((UINT32_C(1) << (32 - cidr_bits)) - 1));
-        }
+    evasive_config *cfg = (evasive_config *) dconfig;
 
-        if (cidr_bits >= 32)
-            cidr_bits -= 32;
-        else
-            cidr_bits = 0;
-    }
+    cfg->set |= CONFIG_BLOCKLIST_URI;
+
+    pcre_vector_push(&cfg->uri_blocklist, uri_re);
+    return NULL;
 }
 
-static void ipv6_apply_mask(struct in6_addr *restrict addr, const struct in6_addr *restrict mask)
+/* Age after which a hit list entry no longer matters; it must outlive every interval it is consulted for */
+
+static apr_time_t hit_list_ttl(const evasive_config *cfg)
 {
-    for (unsigned i = 0; i < 4; i++)
-        addr->s6_addr32[i] &= mask->s6_addr32[i];
+    return hit_ttl(cfg->rate_algorithm, cfg->blocking_period, cfg->page_interval, cfg->site_interval);
 }
 
-static const char *whitelist_ip(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *ip)
+/* Hash a URI for a key; frontends of a cluster hash them under the shared secret, so their keys agree */
+
+static apr_uint64_t hit_list_hash_uri(const evasive_config *cfg, const char *uri)
 {
-    evasive_config *cfg = (evasive_config *) dconfig;
-    struct in_addr ipv4;
-    struct in6_addr ipv6, maskv6;
-    struct ip_node *newdata;
-    const char *ip_parse = ip;
-    char *ip_copy = NULL;
-    const char *cidr_split;
-    char *endptr;
-    char family;
-    char wildcard = 0;
-    unsigned long mask_bits;
-    uint32_t maskv4;
-    int rc;
+    if (cfg->cluster_keyed)
+        return ntt_siphash_keyed(cfg->cluster_secret, (const unsigned char *) uri, strlen(uri));
 
-    cidr_split = strchr(ip, '/');
-    if (cidr_split) {
-        ip_copy = strndup(ip, cidr_split - ip);
-        if (!ip_copy) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "DOSWhitelist: OOM");
-            return NULL;
-        }
+    return ntt_hash_uri(uri);
+}
 
-        ip_parse = ip_copy;
-    }
+/* URI a request is counted for: variants an attacker could make up to get fresh counters are counted as one */
 
-    if (strchr(ip_parse, '*') != NULL) {
-        family = AF_INET;
-        wildcard = 1;
-        rc = parse_wildcard(ip_parse, &ipv4, &maskv4);
-    } else if (strchr(ip_parse, ':') != NULL) {
-        family = AF_INET6;
-        rc = inet_pton(AF_INET6, ip_parse, &ipv6);
-    } else {
-        family = AF_INET;
-        rc = inet_pton(AF_INET, ip_parse, &ipv4);
-    }
+static const char *hit_list_uri(request_rec *r, const evasive_config *cfg)
+{
+    const char *uri = r->uri;
 
-    if (cidr_split)
-        free(ip_copy);
+    if (cfg->uri_canonical & URI_PATH_INFO && r->path_info != NULL && *r->path_info != '\0') {
+        size_t length = strlen(uri);
+        size_t path_info_length = strlen(r->path_info);
 
-    if (rc != 1) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "DOSWhitelist: Invalid IP address '%s'", ip);
-        return NULL;
+        if (path_info_length < length && strcmp(uri + length - path_info_length, r->path_info) == 0)
+            uri = apr_pstrndup(r->pool, uri, length - path_info_length);
     }
 
-    if (cidr_split) {
-        errno = 0;
-        mask_bits = strtoul(cidr_split + 1, &endptr, 10);
-        if (errno || *endptr != '\0' || mask_bits == 0 || mask_bits > (family == AF_INET ? 32 : 128)) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "DOSWhitelist: Invalid IP CIDR range '%s'", ip);
-            return NULL;
-        }
-    } else {
-        mask_bits = family == AF_INET ? 32 : 128;
-    }
+    for (size_t i = 0; i < cfg->uri_prefixes_size; i++) {
+        size_t length = strlen(cfg->uri_prefixes[i]);
 
-    if (!wildcard) {
-        if (family == AF_INET) {
-            maskv4 = ~((UINT32_C(1) << (32 - mask_bits)) - 1);
-            maskv4 = htobe32(maskv4);
-            ipv4.s_addr &= maskv4;
-        } else {
-            ipv6_cidr_bits_to_mask(mask_bits, &maskv6);
-            ipv6_apply_mask(&ipv6, &maskv6);
+        if (strncmp(uri, cfg->uri_prefixes[i], length) == 0 && (uri[length] == '/' || uri[length] == '\0')) {
+            uri = uri[length] == '\0' ? "/" : uri + length;
+            break;
         }
     }
 
-    newdata = ev_reallocarray(cfg->ip_whitelist.data, cfg->ip_whitelist.size + 1, sizeof(*cfg->ip_whitelist.data));
-    if (!newdata) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "DOSWhitelist: OOM");
-        return NULL;
-    }
-    cfg->ip_whitelist.data = newdata;
+    if (cfg->uri_canonical & ~URI_PATH_INFO)
+        uri = uri_canonicalize(uri, cfg->uri_canonical & ~URI_PATH_INFO, r->pool);
 
-    if (family == AF_INET) {
-        cfg->ip_whitelist.data[cfg->ip_whitelist.size++] = (struct ip_node) {
-            .family = AF_INET,
-            .ip.v4 = ipv4,
-            .mask.v4 = maskv4,
-        };
-    } else {
-        cfg->ip_whitelist.data[cfg->ip_whitelist.size++] = (struct ip_node) {
-            .family = AF_INET6,
-            .ip.v6 = ipv6,
-            .mask.v6 = maskv6,
-        };
+    return uri;
+}
+
+/* Sample the share of busy workers in the scoreboard, at most once a second per child; the request thread that
+   takes the sample walks the scoreboard, the others use the last sample */
+
+static void load_sample(apr_time_t t)
+{
+    apr_uint32_t now = (apr_uint32_t) apr_time_sec(t);
+    apr_uint32_t next = apr_atomic_read32(&load_next);
+    int busy = 0;
+
+    if (now < next || load_daemons == 0 || apr_atomic_cas32(&load_next, now + 1, next) != next)
+        return;
+
+    for (int i = 0; i < load_daemons; i++) {
+        for (int j = 0; j < load_threads; j++) {
+            const worker_score *ws = ap_get_scoreboard_worker_from_indexes(i, j);
+
+            /* Busy as mod_status counts them */
+            if (ws->status != SERVER_DEAD && ws->status != SERVER_READY && ws->status != SERVER_STARTING
+                    && ws->status != SERVER_IDLE_KILL)
+                busy++;
+        }
     }
 
-    return NULL;
+    apr_atomic_set32(&load_busy, busy >= load_workers ? 1000 : (apr_uint32_t) busy * 1000 / (apr_uint32_t) load_workers);
 }
 
-static const char *pcre_vector_push(struct pcre_vector *vec, const char *uri_re) {
-    struct pcre_node *newdata;
-    pcre2_code *re;
-    int errornumber;
-    PCRE2_SIZE erroroffset;
-    PCRE2_SPTR pattern;
-    pcre2_match_data *match_data;
+/* A count under the current load: from DOSAdaptiveLoad busy workers on, it shrinks linearly down to its floor
+   with all workers busy, and grows back as the load drops */
 
-    pattern = (PCRE2_SPTR) uri_re;
+static unsigned int load_count(const evasive_config *cfg, unsigned int count)
+{
+    apr_uint32_t busy = apr_atomic_read32(&load_busy);
+    apr_uint32_t start = cfg->adaptive_start * 10;
+    apr_uint64_t scale;
+    unsigned int n;
 
-    re = pcre2_compile(
-            pattern,               /* the pattern */
-            PCRE2_ZERO_TERMINATED, /* indicates pattern is zero-terminated */
-            PCRE2_NO_AUTO_CAPTURE, /* Disable numbered capturing parentheses */
-            &errornumber,          /* for error number */
-            &erroroffset,          /* for error offset */
-            NULL);                 /* use default compile context */
+    if (cfg->adaptive_start == 0 || busy <= start)
+        return count;
 
-    /* Compilation failed: print the error message and exit. */
+    scale = 1000 - (apr_uint64_t) (100 - cfg->adaptive_floor) * 10 * (busy - start) / (1000 - start);
+    n = (unsigned int) ((apr_uint64_t) count * scale / 1000);
 
-    if (!re) {
-        PCRE2_UCHAR buffer[256];
-        pcre2_get_error_message(errornumber, buffer, sizeof(buffer));
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "PCRE2 compilation of regex '%s' failed at offset %lu: %s\n",
-                     uri_re, (unsigned long) erroroffset, buffer);
-        return NULL;
+    return n > 0 ? n : 1;
+}
+
+/* Hash of the URI key of a request; with DOSUriRoutes, all URIs of a targetlist pattern share the pattern's key */
+
+static apr_uint64_t hit_list_hash_request(request_rec *r, const evasive_config *cfg)
+{
+    if (cfg->uri_routes && cfg->uri_targetlist.size > 0) {
+        apr_time_t regex_start = stats != NULL ? apr_time_now() : 0;
+        int route = pcre_vector_find(r->uri, &cfg->uri_targetlist);
+
+        if (stats != NULL)
+            STATS_ADD(regex_usec, apr_time_now() - regex_start);
+        if (route >= 0)
+            return hit_list_hash_uri(cfg, cfg->uri_targetlist.data[route].pattern);
     }
 
-    match_data = pcre2_match_data_create_from_pattern(re, NULL);
-    if (!match_data) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to allocate PCRE2 match data");
-        pcre2_code_free(re);
-        return NULL;
+    return hit_list_hash_uri(cfg, hit_list_uri(r, cfg));
+}
+
+/* Whether an IP is on "hold"; if it is, the hold is extended */
+
+static int hit_list_filtered(const evasive_config *cfg, const struct ntt_key *key)
+{
+    return cfg->block_filter != NULL && (key->type == NTT_KEY_IP || key->type == NTT_KEY_SUBNET);
+}
+
+static int hit_list_on_hold(evasive_config *cfg, const struct ntt_key *key, apr_time_t t)
+{
+    HIST_START(start);
+    struct ntt_node *n;
+    int on_hold = 0;
+
+    /* Most clients were never put on hold, the filter tells without a lookup */
+    if (hit_list_filtered(cfg, key) && !block_filter_test(cfg->block_filter, key, t)) {
+        STATS_INC(filtered);
+        HIST_STOP(HIST_HIT_LIST, start);
+        return 0;
     }
 
-    newdata = ev_reallocarray(vec->data, vec->size + 1, sizeof(*(vec->data)));
-    if (!newdata) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to allocate array for URI list");
-        pcre2_match_data_free(match_data);
-        pcre2_code_free(re);
-        return NULL;
+    if (cfg->shared_table != NULL) {
+        apr_global_mutex_lock(shm_mutex);
+        n = sht_find(cfg->shared_table, key, ntt_hashcode(key));
+        if (n != NULL && hit_within(t, n->timestamp, cfg->blocking_period)) {
+            n->timestamp = t;
+            on_hold = 1;
+        }
+        apr_global_mutex_unlock(shm_mutex);
+    } else if (cfg->sketch != NULL) {
+        on_hold = sketch_on_hold(cfg->sketch, key, t, cfg->blocking_period);
+    } else {
+        on_hold = ntt_on_hold(cfg->hit_list, key, t, cfg->blocking_period);
     }
-    vec->data = newdata;
 
-    vec->data[vec->size++] = (struct pcre_node) {
-        .re = re,
-        .match_data = match_data,
-    };
+    /* The hold was extended */
+    if (on_hold && hit_list_filtered(cfg, key))
+        block_filter_add(cfg->block_filter, key, t);
 
-    return NULL;
+    HIST_STOP(HIST_HIT_LIST, start);
+    return on_hold;
 }
 
-static const char *whitelist_uri(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *uri_re)
+/* Put an IP on "hold" */
+
+static void hit_list_hold(evasive_config *cfg, const struct ntt_key *key, apr_time_t t)
 {
-    evasive_config *cfg = (evasive_config *) dconfig;
+    HIST_START(start);
+
+    if (cfg->shared_table != NULL) {
+        apr_global_mutex_lock(shm_mutex);
+        sht_insert(cfg->shared_table, key, ntt_hashcode(key), t);
+        apr_global_mutex_unlock(shm_mutex);
+    } else if (cfg->sketch != NULL) {
+        sketch_hold(cfg->sketch, key, t);
+    } else {
+        ntt_hold(cfg->hit_list, key, t);
+    }
+
+    if (hit_list_filtered(cfg, key))
+        block_filter_add(cfg->block_filter, key, t);
 
-    return pcre_vector_push(&cfg->uri_whitelist, uri_re);
+    HIST_STOP(HIST_HIT_LIST, start);
 }
 
-static const char *target_uri(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *uri_re)
+/* Count a hit on a key; returns 1 if it is being hit too much */
+
+static int hit_list_hit(evasive_config *cfg, const struct ntt_key *key, apr_time_t t, apr_interval_time_t interval,
+        unsigned int threshold)
 {
-    evasive_config *cfg = (evasive_config *) dconfig;
+    HIST_START(start);
+    int exceeded;
+
+    if (cfg->shared_table != NULL) {
+        apr_uint64_t hash_code = ntt_hashcode(key);
+        struct ntt_node *n;
+        int fresh = 0;
+
+        apr_global_mutex_lock(shm_mutex);
+        n = sht_find(cfg->shared_table, key, hash_code);
+        if (n == NULL) {
+            n = sht_insert(cfg->shared_table, key, hash_code, t);
+            fresh = 1;
+        }
+        exceeded = hit_count(cfg->rate_algorithm, n, fresh, t, interval, threshold);
+        apr_global_mutex_unlock(shm_mutex);
+    } else if (cfg->sketch != NULL) {
+        /* The sketch counts in fixed windows of the interval it was created with */
+        exceeded = sketch_hit(cfg->sketch, key, t, threshold);
+    } else {
+        exceeded = ntt_hit(cfg->hit_list, cfg->rate_algorithm, key, t, interval, threshold);
+    }
 
-    return pcre_vector_push(&cfg->uri_targetlist, uri_re);
+    HIST_STOP(HIST_HIT_LIST, start);
+    return exceeded;
 }
 
-static const char *blocklist_uri(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *uri_re)
+/* Whether to log this denial with DOSLogSample */
+
+static int deny_log_sampled(const evasive_config *cfg)
 {
-    evasive_config *cfg = (evasive_config *) dconfig;
+    if (cfg->log_sample <= 1)
+        return cfg->log_sample == 1;
 
-    return pcre_vector_push(&cfg->uri_blocklist, uri_re);
+    return apr_atomic_inc32(&deny_log_count) % cfg->log_sample == 0;
 }
 
-static void pcre_vector_destroy(struct pcre_vector *vec)
+/* Answer a denied request with the body precomputed in post_config, in place of any ErrorDocument; the core
+   sends it once the request is finally denied, which under Satisfy Any is up to authentication.  The hold was
+   just set or extended, so the client may come back after a full blocking period */
+
+static int fast_reply(request_rec *r, const evasive_config *cfg)
 {
-    for (size_t i = 0; i < vec->size; i++) {
-        struct pcre_node *node = &vec->data[i];
-        pcre2_code_free(node->re);
-        pcre2_match_data_free(node->match_data);
-    }
+    apr_table_setn(r->err_headers_out, "Retry-After", cfg->retry_after);
+    ap_custom_response(r, cfg->http_reply, cfg->fast_reply_body);
 
-    free(vec->data);
+    return cfg->http_reply;
 }
 
-static int access_checker(request_rec *r)
+static int access_check(request_rec *r)
 {
     evasive_config *cfg = (evasive_config *) ap_get_module_config(r->per_dir_config, &evasive_module);
 
     int ret = OK;
+    int denied = 0;
     const char *log_reason = NULL;
 
     /* BEGIN DoS Evasive Maneuvers Code */
 
-    if (cfg->enabled && r->prev == NULL && r->main == NULL && cfg->hit_list != NULL) {
-        char hash_key[2048];
-        struct ntt_node *ip_node, *n;
-        apr_time_t t = r->request_time / 1000 / 1000; /* convert us to s */
+    if (cfg->enabled && r->prev == NULL && r->main == NULL
+            && (cfg->hit_list != NULL || cfg->shared_table != NULL || cfg->sketch != NULL)) {
+        struct ntt_key ip_key, subnet_key, key;
+        apr_time_t t = r->request_time;
+        int whitelisted;
+        int subnet_held = 0;
+
+        STATS_INC(requests);
 
         /* Check whitelist */
-        if (is_whitelisted(r->useragent_addr, cfg))
+        HIST_START(whitelist_start);
+        whitelisted = is_whitelisted(r->useragent_addr, &cfg->ip_whitelist)
+                || list_file_whitelisted(cfg, r->useragent_addr);
+        HIST_STOP(HIST_WHITELIST, whitelist_start);
+        if (whitelisted) {
+            STATS_INC(whitelisted);
             return OK;
+        }
 
-        /* First see if the IP itself is on "hold" */
-        ip_node = ntt_find(cfg->hit_list, r->useragent_ip);
-
-        if (ip_node != NULL && t-ip_node->timestamp<cfg->blocking_period) {
+        /* First see if the IP itself, or its whole prefix, is on "hold" */
+        ntt_key_init(&ip_key, r->useragent_addr, NTT_KEY_IP, 0);
+        ntt_key_init(&subnet_key, r->useragent_addr, NTT_KEY_SUBNET, 0);
+        ntt_key_prefix(&subnet_key, cfg->subnet_prefix4, cfg->subnet_prefix6);
+        if (hit_list_on_hold(cfg, &ip_key, t)) {
 
             /* If the IP is on "hold", make it wait longer in 403 land */
-            ret = cfg->http_reply;
-            ip_node->timestamp = t;
+            denied = 1;
+            STATS_INC(held);
+            event_log_publish(cfg, EVENT_HELD, &ip_key, NULL, 0, r->server, t);
+
+        } else if (cfg->subnet_count > 0 && hit_list_on_hold(cfg, &subnet_key, t)) {
+
+            /* Likewise its prefix; the block was reported for the client that caused it */
+            denied = 1;
+            subnet_held = 1;
+            STATS_INC(held);
+            event_log_publish(cfg, EVENT_HELD, &subnet_key, NULL, 0, r->server, t);
+
+        } else if (list_file_blocked(cfg, r->useragent_addr)) {
+
+            /* Addresses on the blocklist of the list file rank with the whitelist, ahead of the URI lists */
+            log_reason = "list file blocklist";
+            denied = 1;
+            hit_list_hold(cfg, &ip_key, t);
+            cluster_publish(cfg, &ip_key);
+            STATS_INC(list_blocklist);
+            event_log_publish(cfg, EVENT_BLOCK, &ip_key, log_reason, 0, r->server, t);
 
             /* Not on hold, check hit stats */
         } else {
+            unsigned int page_count = cfg->page_count;
+            unsigned int site_count = cfg->site_count;
+            unsigned int subnet_count = cfg->subnet_count;
 
             /* Check whitelisted uris */
-            if (is_uri_whitelisted(r->uri, cfg))
+            if (is_uri_whitelisted(r->uri, cfg)) {
+                STATS_INC(whitelisted);
                 return OK;
+            }
 
             /* If a Targetlist is defined, and the URI is not one of the targets, then do not perform DoS detection */
             if (cfg->uri_targetlist.size && !is_uri_targeted(r->uri, cfg))
                 return OK;
 
+            /* Tighten the counts while the server is busy */
+            if (cfg->adaptive_start > 0) {
+                load_sample(t);
+                page_count = load_count(cfg, page_count);
+                site_count = load_count(cfg, site_count);
+                subnet_count = subnet_count > 0 ? load_count(cfg, subnet_count) : 0;
+                if (page_count < cfg->page_count)
+                    STATS_INC(adaptive);
+            }
+
             /* Check blocklisted URIs */
             if (is_uri_blocklisted(r->uri, cfg)) {
-                if (!ip_node || t-ip_node->timestamp>=cfg->blocking_period)
-                    log_reason = "URI blocklist";
-                ret = cfg->http_reply;
-                ntt_insert(cfg->hit_list, r->useragent_ip, t);
+                log_reason = "URI blocklist";
+                denied = 1;
+                hit_list_hold(cfg, &ip_key, t);
+                STATS_INC(uri_blocklist);
+                event_log_publish(cfg, EVENT_BLOCK, &ip_key, log_reason, 0, r->server, t);
+            } else if ((log_reason = list_file_denied(cfg, r)) != NULL) {
+                denied = 1;
+                hit_list_hold(cfg, &ip_key, t);
+                STATS_INC(list_blocklist);
+                event_log_publish(cfg, EVENT_BLOCK, &ip_key, log_reason, 0, r->server, t);
             } else {
-                /* Has URI been hit too much? */
-                snprintf(hash_key, sizeof(hash_key), "%s_%s", r->useragent_ip, r->uri);
-
-                n = ntt_find(cfg->hit_list, hash_key);
-                if (n != NULL) {
-
-                    /* If URI is being hit too much, add to "hold" list and 403 */
-                    if (t-n->timestamp<cfg->page_interval && n->count>=cfg->page_count) {
-                        if (!ip_node || t-ip_node->timestamp>=cfg->blocking_period)
-                            log_reason = "URI DOS";
-                        ret = cfg->http_reply;
-                        ntt_insert(cfg->hit_list, r->useragent_ip, t);
-                    } else {
-
-                        /* Reset our hit count list as necessary */
-                        if (t-n->timestamp>=cfg->page_interval) {
-                            n->count=0;
-                        }
-                    }
-                    n->timestamp = t;
-                    n->count++;
-                } else {
-                    ntt_insert(cfg->hit_list, hash_key, t);
+                /* Has URI been hit too much? If so, add to "hold" list and 403 */
+                ntt_key_init(&key, r->useragent_addr, NTT_KEY_URI, hit_list_hash_request(r, cfg));
+                if (hit_list_hit(cfg, &key, t, cfg->page_interval, page_count)) {
+                    log_reason = "URI DOS";
+                    denied = 1;
+                    hit_list_hold(cfg, &ip_key, t);
+                    STATS_INC(uri_dos);
+                    event_log_publish(cfg, EVENT_BLOCK, &key, log_reason, page_count, r->server, t);
                 }
-
-                /* Has site been hit too much? */
-                snprintf(hash_key, sizeof(hash_key), "%s_SITE", r->useragent_ip);
-                n = ntt_find(cfg->hit_list, hash_key);
-                if (n != NULL) {
-
-                    /* If site is being hit too much, add to "hold" list and 403 */
-                    if (t-n->timestamp<cfg->site_interval && n->count>=cfg->site_count) {
-                        if (!ip_node || t-ip_node->timestamp>=cfg->blocking_period)
-                            log_reason = "site DOS";
-                        ret = cfg->http_reply;
-                        ntt_insert(cfg->hit_list, r->useragent_ip, t);
-                    } else {
-
-                        /* Reset our hit count list as necessary */
-                        if (t-n->timestamp>=cfg->site_interval) {
-                            n->count=0;
-                        }
-                    }
-                    n->timestamp = t;
-                    n->count++;
-                } else {
-                    ntt_insert(cfg->hit_list, hash_key, t);
+                cluster_publish(cfg, &key);
+
+                /* Has site been hit too much? If so, add to "hold" list and 403 */
+                ntt_key_init(&key, r->useragent_addr, NTT_KEY_SITE, 0);
+                if (hit_list_hit(cfg, &key, t, cfg->site_interval, site_count)) {
+                    log_reason = "site DOS";
+                    denied = 1;
+                    hit_list_hold(cfg, &ip_key, t);
+                    STATS_INC(site_dos);
+                    event_log_publish(cfg, EVENT_BLOCK, &key, log_reason, site_count, r->server, t);
                 }
+                cluster_publish(cfg, &key);
             }
-        }
 
-        /* Perform email notification and system functions */
-        if (ret == cfg->http_reply) {
-            char filename[1024];
-            struct stat s;
-            FILE *file;
-
-            snprintf(filename, sizeof(filename), "%s/dos-%s", cfg->log_dir != NULL ? cfg->log_dir : DEFAULT_LOG_DIR, r->useragent_ip);
-            if (stat(filename, &s)) {
-                file = fopen(filename, "w");
-                if (file != NULL) {
-                    fprintf(file, "%ld\n", getpid());
-                    fclose(file);
-
-                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "Blacklisting address %s: possible DoS attack.", r->useragent_ip);
-                    if (cfg->email_notify != NULL) {
-                        snprintf(filename, sizeof(filename), MAILER, cfg->email_notify);
-                        file = popen(filename, "w");
-                        if (file != NULL) {
-                            fprintf(file, "To: %s\n", cfg->email_notify);
-                            fprintf(file, "Subject: HTTP BLACKLIST %s\n\n", r->useragent_ip);
-                            fprintf(file, "mod_evasive HTTP Blacklisted %s\n", r->useragent_ip);
-                            pclose(file);
-                        }
-                    }
-
-                    if (cfg->system_command != NULL) {
-                        snprintf(filename, sizeof(filename), cfg->system_command, r->useragent_ip);
-                        system(filename);
-                    }
-
-                } else {
-                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "Couldn't open logfile %s: %s",filename, strerror(errno));
+            /* Share new blocks with the other frontends */
+            if (log_reason != NULL)
+                cluster_publish(cfg, &ip_key);
+
+            /* Has the prefix of the client hit the site too much? If so, add the whole prefix to the "hold" list */
+            if (subnet_count > 0) {
+                key = subnet_key;
+                key.type = NTT_KEY_SUBNET_SITE;
+                if (hit_list_hit(cfg, &key, t, cfg->site_interval, subnet_count)) {
+                    log_reason = "subnet DOS";
+                    denied = 1;
+                    hit_list_hold(cfg, &subnet_key, t);
+                    cluster_publish(cfg, &subnet_key);
+                    STATS_INC(subnet_dos);
+                    event_log_publish(cfg, EVENT_BLOCK, &key, log_reason, subnet_count, r->server, t);
                 }
+                cluster_publish(cfg, &key);
+            }
+        }
 
-            } /* if (temp file does not exist) */
+        /* With a DOSHTTPStatus of OK or DECLINED, a denied request is only logged and carries on */
+        if (denied)
+            ret = cfg->http_reply;
 
-        } /* if (ret == cfg->http_reply) */
+        /* Do not keep a blocked client's connection alive, its next one is closed in connection_check; clients
+           are only logged with a DOSHTTPStatus of OK or DECLINED */
+        if (denied && cfg->connection_check && cfg->http_reply >= 100)
+            r->connection->keepalive = AP_CONN_CLOSE;
+
+        /* Perform email notification and system functions, on the notifier thread */
+        if (denied && !subnet_held) {
+            /* Report every IP once per block, the mark lasts as long as a hold would */
+            ntt_key_init(&key, r->useragent_addr, NTT_KEY_NOTIFIED, 0);
+            if (!hit_list_on_hold(cfg, &key, t)) {
+                HIST_START(notify_start);
+                int queued = notify_block(cfg, r->server, r->useragent_ip) == 0;
+
+                HIST_STOP(HIST_NOTIFY, notify_start);
+                if (queued)
+                    hit_list_hold(cfg, &key, t);
+            }
+        }
 
-    } /* if (r->prev == NULL && r->main == NULL && cfg->hit_list != NULL) */
+    } /* if (r->prev == NULL && r->main == NULL && (cfg->hit_list != NULL || cfg->shared_table != NULL || cfg->sketch != NULL)) */
 
     /* END DoS Evasive Maneuvers Code */
 
-    if (log_reason && ret == cfg->http_reply
-            && (ap_satisfies(r) != SATISFY_ANY || !ap_some_auth_required(r))) {
+    if (log_reason && denied
+            && (ap_satisfies(r) != SATISFY_ANY || !ap_some_auth_required(r)) && deny_log_sampled(cfg)) {
         ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r,
                 "[host %s] [resource \"%s\"] [reason %s] client denied by server configuration",
                 r->hostname, r->filename, log_reason);
     }
 
+    if (denied && cfg->fast_reply_body != NULL)
+        return fast_reply(r, cfg);
+
     return ret;
 }
 
-static int is_whitelisted(const apr_sockaddr_t *client, const evasive_config *cfg) {
-    switch (client->family) {
-    case AF_INET:
-    case AF_INET6:
-        break;
-    default:
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Invalid client family 0x%x", client->family);
-        return 0;
-    }
+static int access_checker(request_rec *r)
+{
+    const evasive_config *cfg = (const evasive_config *) ap_get_module_config(r->per_dir_config, &evasive_module);
+    apr_time_t start;
+    int ret;
 
-    for (size_t i = 0; i < cfg->ip_whitelist.size; i++) {
-        const struct ip_node *node = &cfg->ip_whitelist.data[i];
-        int rc;
+    if (stats == NULL || !cfg->enabled)
+        return access_check(r);
 
-        if (node->family != client->family)
-            continue;
+    start = apr_time_now();
+    HIST_START(hist_start);
+    ret = access_check(r);
+    HIST_STOP(HIST_CHECK, hist_start);
+    STATS_ADD(check_usec, apr_time_now() - start);
 
-        if (client->family == AF_INET) {
-            struct in_addr addrv4 = client->sa.sin.sin_addr;
-            addrv4.s_addr &= node->mask.v4;
-            rc = memcmp(&node->ip.v4, &addrv4, sizeof(node->ip.v4));
-        } else {
-            struct in6_addr addrv6 = client->sa.sin6.sin6_addr;
-            ipv6_apply_mask(&addrv6, &node->mask.v6);
-            rc = memcmp(&node->ip.v6, &addrv6, sizeof(node->ip.v6));
-        }
+    return ret;
+}
 
-        if (rc == 0)
-            return 1;
+/* Close connections of clients on "hold" before TLS is set up or a request is read; the virtual host of a
+   connection is not known yet, so the configuration of the server it arrived on applies */
+
+static int connection_check(conn_rec *c, __attribute__((unused)) void *csd)
+{
+    evasive_config *cfg = (evasive_config *) ap_get_module_config(c->base_server->lookup_defaults, &evasive_module);
+    struct ntt_key ip_key, subnet_key;
+    apr_time_t t;
+    int whitelisted;
+
+    if (cfg == NULL || !cfg->enabled || !cfg->connection_check || cfg->http_reply < 100
+            || (cfg->hit_list == NULL && cfg->shared_table == NULL && cfg->sketch == NULL))
+        return DECLINED;
+
+    HIST_START(whitelist_start);
+    whitelisted = is_whitelisted(c->client_addr, &cfg->ip_whitelist) || list_file_whitelisted(cfg, c->client_addr);
+    HIST_STOP(HIST_WHITELIST, whitelist_start);
+    if (whitelisted)
+        return DECLINED;
+
+    /* Like a request, the attempt makes the client wait longer */
+    t = apr_time_now();
+    ntt_key_init(&ip_key, c->client_addr, NTT_KEY_IP, 0);
+    if (!hit_list_on_hold(cfg, &ip_key, t)) {
+        if (cfg->subnet_count == 0)
+            return DECLINED;
+        ntt_key_init(&subnet_key, c->client_addr, NTT_KEY_SUBNET, 0);
+        ntt_key_prefix(&subnet_key, cfg->subnet_prefix4, cfg->subnet_prefix6);
+        if (!hit_list_on_hold(cfg, &subnet_key, t))
+            return DECLINED;
     }
 
-    /* No match */
-    return 0;
+    STATS_INC(refused);
+    ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, c, "connection of blocked client %s closed", c->client_ip);
+
+    /* The MPM closes aborted connections without processing them; the remaining hooks still set up the filters */
+    c->keepalive = AP_CONN_CLOSE;
+    c->aborted = 1;
+    return OK;
 }
 
-static int pcre_vector_match(const char *uri, const struct pcre_vector *vec) {
-    int rc;
+static int is_uri_whitelisted(const char *uri, const evasive_config *cfg) {
+    HIST_START(start);
+    apr_time_t regex_start;
+    int matched;
+
+    if (cfg->uri_whitelist.size == 0)
+        return 0;
 
-    PCRE2_SPTR subject;
-    size_t subject_length;
+    regex_start = stats != NULL ? apr_time_now() : 0;
+    matched = pcre_vector_match(uri, &cfg->uri_whitelist);
+    if (stats != NULL)
+        STATS_ADD(regex_usec, apr_time_now() - regex_start);
+    HIST_STOP(HIST_URI_WHITELIST, start);
 
-    subject = (PCRE2_SPTR) uri;
-    subject_length = strlen((const char *)subject);
+    return matched;
+}
 
-    for (size_t i = 0; i < vec->size; i++) {
-        const struct pcre_node *node = &vec->data[i];
+static int is_uri_targeted(const char *uri, const evasive_config *cfg) {
+    HIST_START(start);
+    apr_time_t regex_start;
+    int matched;
 
-        rc = pcre2_match(
-                node->re,             /* the compiled pattern */
-                subject,              /* the subject string */
-                subject_length,       /* the length of the subject */
-                0,                    /* start at offset 0 in the subject */
-                0,                    /* default options */
-                node->match_data,     /* block for storing the result */
-                NULL);                /* use default match context */
+    if (cfg->uri_targetlist.size == 0)
+        return 0;
 
-        if (rc >= 0) {
-            // match
-            return 1;
-        }
-    }
+    regex_start = stats != NULL ? apr_time_now() : 0;
+    matched = pcre_vector_match(uri, &cfg->uri_targetlist);
+    if (stats != NULL)
+        STATS_ADD(regex_usec, apr_time_now() - regex_start);
+    HIST_STOP(HIST_URI_TARGETLIST, start);
 
-    // no match
-    return 0;
+    return matched;
 }
 
-static int is_uri_whitelisted(const char *uri, const evasive_config *cfg) {
-    return pcre_vector_match(uri, &cfg->uri_whitelist);
+static int is_uri_blocklisted(const char *uri, const evasive_config *cfg) {
+    HIST_START(start);
+    apr_time_t regex_start;
+    int matched;
+
+    if (cfg->uri_blocklist.size == 0)
+        return 0;
+
+    regex_start = stats != NULL ? apr_time_now() : 0;
+    matched = pcre_vector_match(uri, &cfg->uri_blocklist);
+    if (stats != NULL)
+        STATS_ADD(regex_usec, apr_time_now() - regex_start);
+    HIST_STOP(HIST_URI_BLOCKLIST, start);
+
+    return matched;
 }
 
-static int is_uri_targeted(const char *uri, const evasive_config *cfg) {
-    return pcre_vector_match(uri, &cfg->uri_targetlist);
+/* Count this request as a reader of the generation in use, and return it; NULL, without a reader counted, if there
+   is none. The generation stays valid until list_file_release */
+
+static struct list_file *list_file_acquire(const evasive_config *cfg, apr_uint32_t *slot) {
+    struct list_watch *w = cfg->list;
+
+    if (w == NULL)
+        return NULL;
+
+    for (;;) {
+        apr_uint32_t i = apr_atomic_read32(&w->current);
+
+        apr_atomic_inc32(&w->readers[i]);
+
+        /* Counted while still current, the generation is not freed before we are done */
+        if (apr_atomic_read32(&w->current) == i) {
+            if (w->generations[i] != NULL) {
+                *slot = i;
+                return w->generations[i];
+            }
+            apr_atomic_dec32(&w->readers[i]);
+            return NULL;
+        }
+        apr_atomic_dec32(&w->readers[i]);
+    }
 }
 
-static int is_uri_blocklisted(const char *uri, const evasive_config *cfg) {
-    return pcre_vector_match(uri, &cfg->uri_blocklist);
+static void list_file_release(const evasive_config *cfg, apr_uint32_t slot) {
+    apr_atomic_dec32(&cfg->list->readers[slot]);
+}
+
+static int list_file_whitelisted(const evasive_config *cfg, const apr_sockaddr_t *addr) {
+    apr_uint32_t slot;
+    struct list_file *list = list_file_acquire(cfg, &slot);
+    int whitelisted;
+
+    if (list == NULL)
+        return 0;
+
+    whitelisted = is_whitelisted(addr, &list->whitelist);
+    list_file_release(cfg, slot);
+    return whitelisted;
+}
+
+static int list_file_blocked(const evasive_config *cfg, const apr_sockaddr_t *addr) {
+    apr_uint32_t slot;
+    struct list_file *list = list_file_acquire(cfg, &slot);
+    int blocked;
+
+    if (list == NULL)
+        return 0;
+
+    blocked = is_whitelisted(addr, &list->blocklist);
+    list_file_release(cfg, slot);
+    return blocked;
+}
+
+/* Reason a request is denied by the URI blocklist of the list file, NULL if it is not */
+
+static const char *list_file_denied(const evasive_config *cfg, const request_rec *r) {
+    apr_uint32_t slot;
+    struct list_file *list = list_file_acquire(cfg, &slot);
+    const char *reason = NULL;
+
+    if (list == NULL)
+        return NULL;
+
+    if (list->uri_blocklist.size > 0) {
+        apr_time_t regex_start = stats != NULL ? apr_time_now() : 0;
+
+        if (pcre_vector_match(r->uri, &list->uri_blocklist))
+            reason = "list file URI blocklist";
+        if (stats != NULL)
+            STATS_ADD(regex_usec, apr_time_now() - regex_start);
+    }
+
+    list_file_release(cfg, slot);
+    return reason;
 }
 
 static apr_status_t destroy_config(void *dconfig) {
     evasive_config *cfg = (evasive_config *) dconfig;
     if (cfg != NULL) {
-        ntt_destroy(cfg->hit_list);
+        /* The hit tables have cleanups of their own */
         pcre_vector_destroy(&cfg->uri_whitelist);
         pcre_vector_destroy(&cfg->uri_targetlist);
         pcre_vector_destroy(&cfg->uri_blocklist);
-        free(cfg->ip_whitelist.data);
+        for (size_t i = 0; i < cfg->uri_prefixes_size; i++)
+            free(cfg->uri_prefixes[i]);
+        free(cfg->uri_prefixes);
+        ip_whitelist_destroy(&cfg->ip_whitelist);
         free(cfg->email_notify);
         free(cfg->log_dir);
         free(cfg->system_command);
+        free(cfg->firewall_set4);
+        free(cfg->firewall_set6);
+        free(cfg->cluster_host);
+        free(cfg->snapshot_file);
+        free(cfg->list_path);
+        free(cfg->event_target);
         /* cfg is pool allocated */
    }
    return APR_SUCCESS;
 }
 
+/* Messages of the core end up in the error log of the main server */
 
-/* BEGIN NTT (Named Timestamp Tree) Functions */
+static void core_log(int level, const char *fmt, va_list ap) {
+    char msg[MAX_STRING_LEN];
 
-static const size_t ntt_prime_list[ntt_num_primes] =
-{
-    53UL,         97UL,         193UL,       389UL,       769UL,
-    1543UL,       3079UL,       6151UL,      12289UL,     24593UL,
-    49157UL,      98317UL,      196613UL,    393241UL,    786433UL,
-    1572869UL,    3145739UL,    6291469UL,   12582917UL,  25165843UL,
-    50331653UL,   100663319UL,  201326611UL, 402653189UL, 805306457UL,
-    1610612741UL, 3221225473UL, 4294967291UL
+    apr_vsnprintf(msg, sizeof(msg), fmt, ap);
+    ap_log_error(APLOG_MARK, level, 0, ap_server_conf, "%s", msg);
+}
+
+static void core_event(int event) {
+    switch (event) {
+    case NTT_EVENT_GROW:
+        STATS_INC(table_grows);
+        break;
+    case NTT_EVENT_SHRINK:
+        STATS_INC(table_shrinks);
+        break;
+    case NTT_EVENT_EXPIRE:
+        STATS_INC(table_expired);
+        break;
+    }
+}
+
+
+/* BEGIN Notifier Functions */
+
+extern char **environ;
+
+/* pending email to one address */
+struct notify_mail {
+    const char *to;
+    apr_time_t last_sent;
+    size_t count;                       // Addresses collected since the last email
+    size_t listed;                      // Addresses in body
+    char *body;
+    size_t len;
+    char first_ip[64];
+};
+
+/* pending additions to the firewall sets of one configuration */
+struct notify_firewall {
+    const evasive_config *cfg;
+    char *input;                        // Input for IPSET_RESTORE or NFT_RESTORE
+    size_t len;
 };
 
-/* Get the next prime bigger or equal than the given number */
+/* notifier state, owned by the notifier thread */
+struct notify_state {
+    pid_t children[notify_max_children];
+    size_t num_children;
+    struct notify_mail *mails;
+    size_t num_mails;
+    struct notify_firewall *firewalls;
+    size_t num_firewalls;
+};
 
-static size_t ntt_prime_get_next(size_t n) {
-    for (size_t i = 0; i < ntt_num_primes; i++) {
-        if (ntt_prime_list[i] >= n)
-            return ntt_prime_list[i];
-    }
+/* Reap finished mailers and commands; never blocks */
 
-    return ntt_prime_list[ntt_num_primes - 1];
+static void notify_reap(struct notify_state *st) {
+    for (size_t i = 0; i < st->num_children; ) {
+        if (waitpid(st->children[i], NULL, WNOHANG) != 0)
+            st->children[i] = st->children[--st->num_children];
+        else
+            i++;
+    }
 }
 
+/* Run a shell command without forking the (possibly large, threaded) child process.
+   If in is not NULL, it receives a stream to the standard input of the command.
+   With state the command is reaped later by notify_reap, otherwise the caller waits for it. */
 
-/* Find the numeric position in the hash table based on key and modulus */
+static int notify_spawn(struct notify_state *st, server_rec *s, const char *command, FILE **in) {
+    posix_spawn_file_actions_t actions;
+    char *argv[] = { "/bin/sh", "-c", (char *) command, NULL };
+    int fds[2] = { -1, -1 };
+    pid_t pid;
+    int rc;
 
-static size_t ntt_hashcode(const struct ntt *ntt, const char *key) {
-    size_t val = 0;
-    for (; *key; ++key) val = 5 * val + *key;
-    return(val % ntt->size);
-}
+    if (st != NULL && st->num_children == notify_max_children) {
+        /* Too many still running, wait for the oldest one */
+        waitpid(st->children[0], NULL, 0);
+        st->children[0] = st->children[--st->num_children];
+    }
 
-/* Creates a single node in the tree */
+    if (in != NULL) {
+        if (pipe(fds) != 0) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, errno, s, "Failed to create pipe for '%s'", command);
+            return -1;
+        }
+        /* Keep the pipe out of processes spawned concurrently by other threads */
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
 
-static struct ntt_node *ntt_node_create(const char *key, apr_time_t timestamp) {
-    char *node_key;
-    struct ntt_node* node;
+    posix_spawn_file_actions_init(&actions);
+    if (in != NULL)
+        posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+    rc = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
 
-    node = (struct ntt_node *) malloc(sizeof(struct ntt_node));
-    if (node == NULL) {
-        return NULL;
+    if (in != NULL)
+        close(fds[0]);
+
+    if (rc != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, "Failed to run '%s'", command);
+        if (in != NULL)
+            close(fds[1]);
+        return -1;
     }
-    if ((node_key = strdup(key)) == NULL) {
-        free(node);
-        return NULL;
+
+    if (in != NULL) {
+        *in = fdopen(fds[1], "w");
+        if (*in == NULL)
+            close(fds[1]);
     }
-    *node = (struct ntt_node) {
-        .key = node_key,
-        .timestamp = timestamp,
-        .count = 0,
-        .next = NULL,
-    };
-    return(node);
+
+    if (st != NULL)
+        st->children[st->num_children++] = pid;
+
+    return pid;
 }
 
-/* Tree initializer */
+/* Send an email listing blocked addresses */
 
-static struct ntt *ntt_create(size_t size) {
-    struct ntt *ntt = (struct ntt *) malloc(sizeof(struct ntt));
+static void notify_mail_send(struct notify_state *st, server_rec *s, const char *to, const char *subject_ip,
+                             size_t count, const char *body) {
+    char command[1024];
+    FILE *file = NULL;
+    pid_t pid;
 
-    if (ntt == NULL)
-        return NULL;
-    ntt->size  = ntt_prime_get_next(size);
-    ntt->items = 0;
-    ntt->tbl   = (struct ntt_node **) calloc(ntt->size, sizeof(struct ntt_node *));
-    if (ntt->tbl == NULL) {
-        free(ntt);
-        return NULL;
+    snprintf(command, sizeof(command), MAILER, to);
+    pid = notify_spawn(st, s, command, &file);
+    if (pid < 0)
+        return;
+
+    if (file != NULL) {
+        fprintf(file, "To: %s\n", to);
+        if (count == 1)
+            fprintf(file, "Subject: HTTP BLACKLIST %s\n\n", subject_ip);
+        else
+            fprintf(file, "Subject: HTTP BLACKLIST %zu addresses\n\n", count);
+        fputs(body, file);
+        fclose(file);
     }
-    return(ntt);
+
+    if (st == NULL)
+        waitpid(pid, NULL, 0);
 }
 
-/* Find an object in the tree */
+/* Send the collected addresses of every recipient that has not been mailed within NOTIFY_MAIL_INTERVAL */
 
-static struct ntt_node *ntt_find(struct ntt *ntt, const char *key) {
-    size_t hash_code;
-    struct ntt_node *node;
+static void notify_mail_flush(struct notify_state *st, apr_time_t now, int force) {
+    for (size_t i = 0; i < st->num_mails; i++) {
+        struct notify_mail *mail = &st->mails[i];
 
-    if (ntt == NULL) return NULL;
+        if (mail->count == 0 || (!force && now - mail->last_sent < apr_time_from_sec(NOTIFY_MAIL_INTERVAL)))
+            continue;
 
-    hash_code = ntt_hashcode(ntt, key);
-    node = ntt->tbl[hash_code];
+        if (mail->listed < mail->count) {
+            char more[64];
 
-    while (node) {
-        if (!strcmp(key, node->key)) {
-            return(node);
+            snprintf(more, sizeof(more), "... and %zu more\n", mail->count - mail->listed);
+            mail->len += strlen(more);
+            strcat(mail->body, more);
         }
-        node = node->next;
+
+        notify_mail_send(st, ap_server_conf, mail->to, mail->first_ip, mail->count, mail->body);
+
+        free(mail->body);
+        mail->body = NULL;
+        mail->len = 0;
+        mail->count = 0;
+        mail->listed = 0;
+        mail->last_sent = now;
     }
-    return((struct ntt_node *)NULL);
 }
 
-/* Whether a node is outdated */
+/* Add an address to the next email to a recipient */
+
+static void notify_mail_add(struct notify_state *st, const char *to, const char *ip) {
+    struct notify_mail *mail = NULL;
+    char line[128];
+    size_t line_len;
+    char *body;
+
+    for (size_t i = 0; i < st->num_mails; i++) {
+        if (strcmp(st->mails[i].to, to) == 0) {
+            mail = &st->mails[i];
+            break;
+        }
+    }
+
+    if (mail == NULL) {
+        struct notify_mail *mails = ev_reallocarray(st->mails, st->num_mails + 1, sizeof(*st->mails));
+
+        if (!mails) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to allocate notification for %s", to);
+            return;
+        }
+        st->mails = mails;
+        mail = &st->mails[st->num_mails++];
+        *mail = (struct notify_mail) { .to = to, .last_sent = 0, .count = 0, .listed = 0, .body = NULL, .len = 0 };
+    }
+
+    if (mail->count++ == 0)
+        snprintf(mail->first_ip, sizeof(mail->first_ip), "%s", ip);
+
+    if (mail->listed == notify_max_batch)
+        return;
 
-static int ntt_node_is_outdated(const struct ntt_node *node, apr_time_t timestamp) {
-    return timestamp - node->timestamp >= 6 * 60 * 60; /* 6 hours */
+    /* Room for the line, and the "... and N more" trailer */
+    line_len = snprintf(line, sizeof(line), "mod_evasive HTTP Blacklisted %s\n", ip);
+    body = realloc(mail->body, mail->len + line_len + 64);
+    if (!body) {
+        mail->count--;
+        return;
+    }
+    memcpy(body + mail->len, line, line_len + 1);
+    mail->body = body;
+    mail->len += line_len;
+    mail->listed++;
 }
 
-/* Copy a node into the tree; only used during tree growth */
+/* Add blocked addresses to the firewall sets in one go */
 
-static void ntt_grow_copy(struct ntt *ntt, struct ntt_node *node, apr_time_t timestamp) {
-    size_t hash_code;
-    struct ntt_node **curr;
+static void notify_firewall_send(struct notify_state *st, server_rec *s, int firewall, const char *input) {
+    FILE *file = NULL;
+    pid_t pid;
 
-    /* Ignore outdated entries */
-    if (ntt_node_is_outdated(node, timestamp)) {
-        free(node->key);
-        free(node);
+    pid = notify_spawn(st, s, firewall == FIREWALL_IPSET ? IPSET_RESTORE : NFT_RESTORE, &file);
+    if (pid < 0)
         return;
+
+    if (file != NULL) {
+        fputs(input, file);
+        fclose(file);
     }
 
-    hash_code = ntt_hashcode(ntt, node->key);
-    curr = &ntt->tbl[hash_code];
+    if (st == NULL)
+        waitpid(pid, NULL, 0);
+}
+
+/* Send the collected firewall additions */
+
+static void notify_firewall_flush(struct notify_state *st) {
+    for (size_t i = 0; i < st->num_firewalls; i++) {
+        struct notify_firewall *fw = &st->firewalls[i];
+
+        if (fw->len == 0)
+            continue;
+
+        notify_firewall_send(st, ap_server_conf, fw->cfg->firewall, fw->input);
 
-    while (*curr) {
-        /* No need to compare keys, since the original tree should not have duplicates */
-        curr = &(*curr)->next;
+        free(fw->input);
+        fw->input = NULL;
+        fw->len = 0;
     }
+}
+
+/* Format the firewall addition of an address; returns 0 if there is no set for its family */
+
+static int notify_firewall_line(const evasive_config *cfg, const char *ip, char *line, size_t size) {
+    const char *set = strchr(ip, ':') != NULL ? cfg->firewall_set6 : cfg->firewall_set4;
+
+    if (set == NULL)
+        return 0;
 
-    node->next = NULL;
-    *curr = node;
-    ntt->items++;
+    if (cfg->firewall == FIREWALL_IPSET)
+        return snprintf(line, size, "add %s %s\n", set, ip);
+    else
+        return snprintf(line, size, "add element %s { %s }\n", set, ip);
 }
 
-/* Grow the tree */
+/* Add an address to the next batch for the firewall sets of a configuration */
 
-static int ntt_grow(struct ntt *ntt, apr_time_t timestamp) {
-    struct ntt tmp_ntt;
-    struct ntt_node **new_tbl;
-    size_t new_size;
+static void notify_firewall_add(struct notify_state *st, const evasive_config *cfg, const char *ip) {
+    struct notify_firewall *fw = NULL;
+    char line[1024];
+    int line_len;
+    char *input;
 
-    new_size = ntt_prime_get_next(ntt->size + 1);
-    if (new_size == ntt->size) {
-        errno = EOVERFLOW;
-        return -1;
+    line_len = notify_firewall_line(cfg, ip, line, sizeof(line));
+    if (line_len <= 0 || (size_t) line_len >= sizeof(line))
+        return;
+
+    for (size_t i = 0; i < st->num_firewalls; i++) {
+        if (st->firewalls[i].cfg == cfg) {
+            fw = &st->firewalls[i];
+            break;
+        }
     }
 
-    new_tbl = calloc(new_size, sizeof(struct ntt_node *));
-    if (!new_tbl)
-        return -1;
+    if (fw == NULL) {
+        struct notify_firewall *firewalls = ev_reallocarray(st->firewalls, st->num_firewalls + 1, sizeof(*st->firewalls));
 
-    tmp_ntt = (struct ntt) {
-        .size = new_size,
-        .items = 0,
-        .tbl = new_tbl,
-    };
+        if (!firewalls) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to allocate firewall batch");
+            return;
+        }
+        st->firewalls = firewalls;
+        fw = &st->firewalls[st->num_firewalls++];
+        *fw = (struct notify_firewall) { .cfg = cfg, .input = NULL, .len = 0 };
+    }
 
-    for (size_t i = 0; i < ntt->size; i++) {
-        struct ntt_node *node;
+    input = realloc(fw->input, fw->len + line_len + 1);
+    if (!input)
+        return;
+    memcpy(input + fw->len, line, line_len + 1);
+    fw->input = input;
+    fw->len += line_len;
+}
 
-        node = ntt->tbl[i];
-        while (node) {
-            struct ntt_node *next;
+/* Notify about a denied address: the firewall set, then unless its marker file exists already the marker
+   file, log entry, email and system command. With state (on the notifier thread) emails and firewall
+   additions are collected, see notify_mail_flush and notify_firewall_flush. */
+
+static void notify_process(struct notify_state *st, const struct notify_event *ev) {
+    const evasive_config *cfg = ev->cfg;
+    char filename[1024];
+    struct stat s;
+    FILE *file;
+
+    /* Reports are once per block already; the address may be out of the set since its marker file was made,
+       after the timeout of the set or a restart */
+    if (cfg->firewall != FIREWALL_NONE) {
+        if (st != NULL) {
+            notify_firewall_add(st, cfg, ev->ip);
+        } else {
+            char line[1024];
+            int line_len = notify_firewall_line(cfg, ev->ip, line, sizeof(line));
 
-            next = node->next;
-            ntt_grow_copy(&tmp_ntt, node, timestamp);
-            node = next;
+            if (line_len > 0 && (size_t) line_len < sizeof(line))
+                notify_firewall_send(NULL, ev->server, cfg->firewall, line);
         }
     }
 
-    free(ntt->tbl);
+    snprintf(filename, sizeof(filename), "%s/dos-%s", cfg->log_dir != NULL ? cfg->log_dir : DEFAULT_LOG_DIR, ev->ip);
+    if (stat(filename, &s) == 0)
+        return;
 
-    ap_log_error(APLOG_MARK, APLOG_INFO, 0, ap_server_conf, "Resized hash table from %zu to %zu",
-                 ntt->size, new_size);
+    file = fopen(filename, "w");
+    if (file == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ev->server, "Couldn't open logfile %s: %s", filename, strerror(errno));
+        return;
+    }
+    fprintf(file, "%ld\n", (long) getpid());
+    fclose(file);
 
-    *ntt = tmp_ntt;
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ev->server, "Blacklisting address %s: possible DoS attack.", ev->ip);
+    if (cfg->email_notify != NULL) {
+        if (st != NULL) {
+            notify_mail_add(st, cfg->email_notify, ev->ip);
+        } else {
+            char body[128];
 
-    return 0;
+            snprintf(body, sizeof(body), "mod_evasive HTTP Blacklisted %s\n", ev->ip);
+            notify_mail_send(NULL, ev->server, cfg->email_notify, ev->ip, 1, body);
+        }
+    }
+
+    if (cfg->system_command != NULL) {
+        pid_t pid;
+
+        snprintf(filename, sizeof(filename), cfg->system_command, ev->ip);
+        pid = notify_spawn(st, ev->server, filename, NULL);
+        if (st == NULL && pid > 0)
+            waitpid(pid, NULL, 0);
+    }
 }
 
-/* Insert a node into the tree */
+/* Queue an event; returns -1 if the queue is full. Safe to call from any number of threads. */
 
-static struct ntt_node *ntt_insert(struct ntt *ntt, const char *key, apr_time_t timestamp) {
-    size_t hash_code;
-    struct ntt_node *parent;
-    struct ntt_node *node;
-    struct ntt_node *new_node = NULL;
+static int notify_queue_push(struct notify_queue *q, const evasive_config *cfg, server_rec *s, const char *ip) {
+    apr_uint32_t pos = apr_atomic_read32(&q->head);
 
-    if (ntt == NULL || ntt->items == SIZE_MAX) return NULL;
+    for (;;) {
+        struct notify_event *ev = &q->slots[pos & (notify_queue_size - 1)];
+        apr_int32_t diff = (apr_int32_t) (apr_atomic_read32(&ev->seq) - pos);
 
-    /* Grow on 75% utilization */
-    if (((ntt->size * 3) / 4) < ntt->items) {
-        if (ntt_grow(ntt, timestamp) < 0) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to increase hashtable of size %zu and %zu entries: %s",
-                         ntt->size, ntt->items, strerror(errno));
-            return NULL;
+        if (diff == 0) {
+            apr_uint32_t prev = apr_atomic_cas32(&q->head, pos + 1, pos);
+
+            if (prev == pos) {
+                ev->cfg = cfg;
+                ev->server = s;
+                snprintf(ev->ip, sizeof(ev->ip), "%s", ip);
+                /* Publish the slot to the notifier thread */
+                apr_atomic_set32(&ev->seq, pos + 1);
+                return 0;
+            }
+            pos = prev;
+        } else if (diff < 0) {
+            /* The slot of the previous round was not drained yet */
+            return -1;
+        } else {
+            pos = apr_atomic_read32(&q->head);
         }
     }
+}
 
-    hash_code = ntt_hashcode(ntt, key);
-    parent  = NULL;
-    node    = ntt->tbl[hash_code];
+/* Whether an event is ready to be popped; notifier thread only */
 
-    while (node != NULL) {
-        if (strcmp(key, node->key) == 0) {
-            new_node = node;
-            node = NULL;
-            break;
-        }
+static int notify_queue_pending(struct notify_queue *q) {
+    return apr_atomic_read32(&q->slots[q->tail & (notify_queue_size - 1)].seq) == q->tail + 1;
+}
 
-        /* Delete outdated entries */
-        if (ntt_node_is_outdated(node, timestamp)) {
-            struct ntt_node *next = node->next;
+/* Take the next event off the queue; notifier thread only */
 
-            if (parent)
-                parent->next = next;
-            else
-                ntt->tbl[hash_code] = next;
+static int notify_queue_pop(struct notify_queue *q, struct notify_event *ev) {
+    struct notify_event *slot = &q->slots[q->tail & (notify_queue_size - 1)];
 
-            free(node->key);
-            free(node);
-            ntt->items--;
-            node = next;
-            continue;
-        }
+    if (!notify_queue_pending(q))
+        return 0;
+
+    ev->cfg = slot->cfg;
+    ev->server = slot->server;
+    memcpy(ev->ip, slot->ip, sizeof(ev->ip));
+
+    /* Hand the slot back to the producers of the next round */
+    apr_atomic_set32(&slot->seq, q->tail + notify_queue_size);
+    q->tail++;
+    return 1;
+}
+
+/* Report a denied address; never blocks the request unless there is no notifier thread.
+   Returns -1 if the report was dropped because the queue is full. */
+
+static int notify_block(const evasive_config *cfg, server_rec *s, const char *ip) {
+    struct notify_queue *q = notify_queue;
+
+    if (q == NULL) {
+        struct notify_event ev = { .cfg = cfg, .server = s };
+
+        snprintf(ev.ip, sizeof(ev.ip), "%s", ip);
+        notify_process(NULL, &ev);
+        return 0;
+    }
 
-        parent = node;
-        node = node->next;
+    if (notify_queue_push(q, cfg, s, ip) < 0) {
+        apr_atomic_inc32(&q->dropped);
+        return -1;
     }
 
-    if (new_node != NULL) {
-        new_node->timestamp = timestamp;
-        new_node->count = 0;
-        return new_node;
+#if APR_HAS_THREADS
+    if (apr_atomic_read32(&q->waiting)) {
+        apr_thread_mutex_lock(q->mutex);
+        apr_thread_cond_signal(q->cond);
+        apr_thread_mutex_unlock(q->mutex);
     }
+#endif
+
+    return 0;
+}
+
+#if APR_HAS_THREADS
+
+static void * APR_THREAD_FUNC notify_thread(apr_thread_t *thread, void *data) {
+    struct notify_queue *q = (struct notify_queue *) data;
+    struct notify_state st = { .num_children = 0, .mails = NULL, .num_mails = 0, .firewalls = NULL, .num_firewalls = 0 };
+    struct notify_event ev;
+
+    for (;;) {
+        int stop = apr_atomic_read32(&q->stop);
+        apr_uint32_t dropped;
 
-    /* Create a new node */
-    new_node = ntt_node_create(key, timestamp);
+        while (notify_queue_pop(q, &ev))
+            notify_process(&st, &ev);
 
-    ntt->items++;
+        dropped = apr_atomic_xchg32(&q->dropped, 0);
+        if (dropped)
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Notification queue full, dropped %u notifications", dropped);
 
-    /* Insert */
-    if (parent) {  /* Existing parent */
-        parent->next = new_node;
-        return new_node;  /* Return the locked node */
+        notify_firewall_flush(&st);
+        notify_mail_flush(&st, apr_time_now(), stop);
+        notify_reap(&st);
+
+        if (stop)
+            break;
+
+        /* Sleep until an event is queued; the timeout takes care of pending emails */
+        apr_thread_mutex_lock(q->mutex);
+        apr_atomic_set32(&q->waiting, 1);
+        if (!notify_queue_pending(q) && !apr_atomic_read32(&q->stop))
+            apr_thread_cond_timedwait(q->cond, q->mutex, apr_time_from_sec(1));
+        apr_atomic_set32(&q->waiting, 0);
+        apr_thread_mutex_unlock(q->mutex);
     }
 
-    /* No existing parent; add directly to hash table */
-    ntt->tbl[hash_code] = new_node;
-    return new_node;
+    for (size_t i = 0; i < st.num_mails; i++)
+        free(st.mails[i].body);
+    free(st.mails);
+    free(st.firewalls);
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t notify_stop(void *data) {
+    struct notify_queue *q = (struct notify_queue *) data;
+    apr_status_t rv;
+
+    notify_queue = NULL;
+
+    apr_thread_mutex_lock(q->mutex);
+    apr_atomic_set32(&q->stop, 1);
+    apr_thread_cond_signal(q->cond);
+    apr_thread_mutex_unlock(q->mutex);
+    apr_thread_join(&rv, q->thread);
+
+    free(q);
+    return APR_SUCCESS;
 }
 
-/* Tree destructor */
+#endif
 
-static int ntt_destroy(struct ntt *ntt) {
-    struct ntt_node *node, *next;
-    struct ntt_c c;
+/* Start the notifier thread of a child; without it, notifications run on the request thread */
 
-    if (ntt == NULL) return -1;
+static void notify_start(apr_pool_t *p, server_rec *s) {
+#if APR_HAS_THREADS
+    struct notify_queue *q = (struct notify_queue *) calloc(1, sizeof(struct notify_queue));
+    apr_status_t rv;
 
-    node = c_ntt_first(ntt, &c);
-    while(node != NULL) {
-        next = c_ntt_next(ntt, &c);
-        ntt_delete(ntt, node->key);
-        node = next;
+    if (q == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Failed to allocate notification queue");
+        return;
     }
 
-    free(ntt->tbl);
-    free(ntt);
+    for (apr_uint32_t i = 0; i < notify_queue_size; i++)
+        q->slots[i].seq = i;
+
+    rv = apr_thread_mutex_create(&q->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_cond_create(&q->cond, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_create(&q->thread, NULL, notify_thread, q, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to start notifier thread, notifying on request threads");
+        free(q);
+        return;
+    }
 
-    return 0;
+    notify_queue = q;
+    apr_pool_cleanup_register(p, q, notify_stop, apr_pool_cleanup_null);
+#else
+    (void) p;
+    (void) s;
+#endif
 }
 
-/* Delete a single node in the tree */
+/* END Notifier Functions */
+
+/* BEGIN Cluster Functions */
+
+/* Queue a hit or block for the other frontends; never blocks, the event is dropped if the queue is full */
 
-static int ntt_delete(struct ntt *ntt, const char *key) {
-    size_t hash_code;
-    struct ntt_node *parent = NULL;
-    struct ntt_node *node;
-    struct ntt_node *del_node = NULL;
+static void cluster_publish(evasive_config *cfg, const struct ntt_key *key) {
+    struct cluster *c = cfg->cluster;
+    apr_uint32_t pos;
 
-    if (ntt == NULL) return -1;
+    if (c == NULL)
+        return;
+
+    pos = apr_atomic_read32(&c->head);
+    for (;;) {
+        struct cluster_event *ev = &c->slots[pos & (cluster_queue_size - 1)];
+        apr_int32_t diff = (apr_int32_t) (apr_atomic_read32(&ev->seq) - pos);
 
-    hash_code = ntt_hashcode(ntt, key);
-    node        = ntt->tbl[hash_code];
+        if (diff == 0) {
+            apr_uint32_t prev = apr_atomic_cas32(&c->head, pos + 1, pos);
 
-    while (node != NULL) {
-        if (strcmp(key, node->key) == 0) {
-            del_node = node;
-            node = NULL;
+            if (prev == pos) {
+                ev->key = *key;
+                /* Publish the slot to the sync thread */
+                apr_atomic_set32(&ev->seq, pos + 1);
+                return;
+            }
+            pos = prev;
+        } else if (diff < 0) {
+            /* The slot of the previous round was not drained yet */
+            apr_atomic_inc32(&c->dropped);
+            return;
+        } else {
+            pos = apr_atomic_read32(&c->head);
         }
+    }
+}
+
+/* Take the next event off the queue; sync thread only */
+
+static int cluster_pop(struct cluster *c, struct ntt_key *key) {
+    struct cluster_event *slot = &c->slots[c->tail & (cluster_queue_size - 1)];
+
+    if (apr_atomic_read32(&slot->seq) != c->tail + 1)
+        return 0;
+
+    *key = slot->key;
+
+    /* Hand the slot back to the producers of the next round */
+    apr_atomic_set32(&slot->seq, c->tail + cluster_queue_size);
+    c->tail++;
+    return 1;
+}
+
+static void cluster_put32(unsigned char *p, apr_uint32_t v) {
+    v = htole32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void cluster_put64(unsigned char *p, apr_uint64_t v) {
+    v = htole64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static apr_uint32_t cluster_get32(const unsigned char *p) {
+    apr_uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le32toh(v);
+}
+
+static apr_uint64_t cluster_get64(const unsigned char *p) {
+    apr_uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+/* Order keys so that equal ones are adjacent; the padding of keys is not compared */
+
+static int cluster_key_cmp(const void *a, const void *b) {
+    const struct ntt_key *x = (const struct ntt_key *) a;
+    const struct ntt_key *y = (const struct ntt_key *) b;
+    int rc = memcmp(x->addr, y->addr, sizeof(x->addr));
+
+    if (rc != 0)
+        return rc;
+    if (x->uri_hash != y->uri_hash)
+        return x->uri_hash < y->uri_hash ? -1 : 1;
+    if (x->type != y->type)
+        return x->type < y->type ? -1 : 1;
+    return 0;
+}
+
+/* Sign and send a datagram of count records */
+
+static void cluster_send(struct cluster *c, unsigned char *buf, apr_uint32_t count, apr_time_t now) {
+    apr_size_t len = cluster_header_size + (apr_size_t) count * cluster_record_size;
+    apr_status_t rv;
+
+    cluster_put32(buf, CLUSTER_MAGIC);
+    cluster_put32(buf + 4, count);
+    cluster_put64(buf + 8, cluster_server);
+    cluster_put64(buf + 16, c->child);
+    cluster_put64(buf + 24, (apr_uint64_t) now);
+    cluster_put64(buf + len, ntt_siphash_keyed(c->cfg->cluster_secret, buf, len));
+    len += 8;
+
+    rv = apr_socket_sendto(c->socket, c->group, 0, (const char *) buf, &len);
+    if (rv != APR_SUCCESS)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, c->server, "Failed to send cluster datagram");
+}
+
+/* Send everything queued since the last flush, as one record per key with its number of hits */
+
+static void cluster_flush(struct cluster *c, struct ntt_key *keys, unsigned char *buf, apr_time_t now) {
+    size_t n = 0;
+    apr_uint32_t count = 0;
+    apr_uint32_t dropped;
+
+    while (n < cluster_queue_size && cluster_pop(c, &keys[n]))
+        n++;
+
+    dropped = apr_atomic_xchg32(&c->dropped, 0);
+    if (dropped)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, c->server, "Cluster queue full, dropped %u events", dropped);
+
+    if (n == 0)
+        return;
 
-        if (del_node == NULL) {
-            parent = node;
-            node = node->next;
+    qsort(keys, n, sizeof(struct ntt_key), cluster_key_cmp);
+
+    for (size_t i = 0; i < n; ) {
+        unsigned char *rec = buf + cluster_header_size + (size_t) count * cluster_record_size;
+        size_t j = i + 1;
+
+        while (j < n && cluster_key_cmp(&keys[i], &keys[j]) == 0)
+            j++;
+
+        memcpy(rec, keys[i].addr, sizeof(keys[i].addr));
+        cluster_put64(rec + 16, keys[i].uri_hash);
+        cluster_put32(rec + 24, keys[i].type);
+        cluster_put32(rec + 28, (apr_uint32_t) (j - i));
+        i = j;
+
+        if (++count == cluster_max_records) {
+            cluster_send(c, buf, count, now);
+            count = 0;
         }
     }
 
-    if (del_node != NULL) {
+    if (count > 0)
+        cluster_send(c, buf, count, now);
+}
 
-        if (parent) {
-            parent->next = del_node->next;
-        } else {
-            ntt->tbl[hash_code] = del_node->next;
+/* Apply a record of another frontend to the local hit list, as if its hits had been made here */
+
+static void cluster_apply(evasive_config *cfg, const struct ntt_key *key, apr_uint32_t hits, apr_time_t t) {
+    struct ntt_key hold_key = { .uri_hash = 0, .type = NTT_KEY_IP };
+    apr_interval_time_t interval;
+    unsigned int threshold;
+
+    memcpy(hold_key.addr, key->addr, sizeof(hold_key.addr));
+
+    switch (key->type) {
+    case NTT_KEY_IP:
+        hit_list_hold(cfg, &hold_key, t);
+        return;
+    case NTT_KEY_SUBNET:
+        hold_key.type = NTT_KEY_SUBNET;
+        hit_list_hold(cfg, &hold_key, t);
+        return;
+    case NTT_KEY_URI:
+        interval = cfg->page_interval;
+        threshold = load_count(cfg, cfg->page_count);
+        break;
+    case NTT_KEY_SITE:
+        interval = cfg->site_interval;
+        threshold = load_count(cfg, cfg->site_count);
+        break;
+    case NTT_KEY_SUBNET_SITE:
+        if (cfg->subnet_count == 0)
+            return;
+        hold_key.type = NTT_KEY_SUBNET;
+        interval = cfg->site_interval;
+        threshold = load_count(cfg, cfg->subnet_count);
+        break;
+    default:
+        return;
+    }
+
+    /* Hits beyond the threshold do not change the outcome */
+    if (hits > threshold + 1)
+        hits = threshold + 1;
+
+    while (hits-- > 0) {
+        if (hit_list_hit(cfg, key, t, interval, threshold)) {
+            hit_list_hold(cfg, &hold_key, t);
+            break;
         }
+    }
+}
+
+/* Check and apply a received datagram */
+
+/* Whether this child applies remote records to the shared table; the first child to ask does, until it exits */
 
-        free(del_node->key);
-        free(del_node);
-        ntt->items--;
+static int cluster_receiving(struct cluster *c) {
+    volatile apr_uint32_t *receiver = c->cfg->cluster_receiver;
+    apr_uint32_t pid = (apr_uint32_t) getpid();
+    apr_uint32_t owner;
 
+    if (receiver == NULL)
         return 0;
+
+    owner = apr_atomic_read32(receiver);
+    if (owner == pid)
+        return 1;
+    if (owner != 0 && (kill((pid_t) owner, 0) == 0 || errno != ESRCH))
+        return 0;
+
+    return apr_atomic_cas32(receiver, pid, owner) == owner;
+}
+
+static void cluster_receive(struct cluster *c, const unsigned char *buf, apr_size_t len, apr_time_t now) {
+    apr_uint32_t count;
+    apr_uint64_t server, child;
+    apr_int64_t skew;
+
+    if (len < cluster_header_size + 8 || cluster_get32(buf) != CLUSTER_MAGIC)
+        return;
+
+    count = cluster_get32(buf + 4);
+    if (count > cluster_max_records || len != cluster_header_size + (apr_size_t) count * cluster_record_size + 8)
+        return;
+
+    len -= 8;
+    if (cluster_get64(buf + len) != ntt_siphash_keyed(c->cfg->cluster_secret, buf, len)) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, c->server, "Ignoring cluster datagram with a bad signature");
+        return;
+    }
+
+    /* Skip our own datagrams, and those of our siblings if we already share their hit list */
+    server = cluster_get64(buf + 8);
+    child = cluster_get64(buf + 16);
+    if (child == c->child || (server == cluster_server && c->cfg->shared_table != NULL))
+        return;
+
+    /* Every child receives the datagram, but a shared table must count it once */
+    if (c->cfg->shared_table != NULL && !cluster_receiving(c))
+        return;
+
+    skew = (apr_int64_t) (now - (apr_time_t) cluster_get64(buf + 24));
+    if (skew > CLUSTER_MAX_SKEW || skew < -CLUSTER_MAX_SKEW)
+        return;
+
+    for (apr_uint32_t i = 0; i < count; i++) {
+        const unsigned char *rec = buf + cluster_header_size + (size_t) i * cluster_record_size;
+        struct ntt_key key;
+
+        memset(&key, 0, sizeof(key));
+        memcpy(key.addr, rec, sizeof(key.addr));
+        key.uri_hash = cluster_get64(rec + 16);
+        key.type = cluster_get32(rec + 24);
+
+        cluster_apply(c->cfg, &key, cluster_get32(rec + 28), now);
+    }
+}
+
+#if APR_HAS_THREADS
+
+/* Send the queued events every cluster_interval, and apply received datagrams in between */
+
+static void * APR_THREAD_FUNC cluster_thread(apr_thread_t *thread, void *data) {
+    struct cluster *c = (struct cluster *) data;
+    struct ntt_key *keys = (struct ntt_key *) malloc(cluster_queue_size * sizeof(struct ntt_key));
+    unsigned char buf[cluster_datagram_max];
+    apr_time_t next = apr_time_now() + c->cfg->cluster_interval;
+
+    if (keys == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, c->server, "Failed to allocate cluster buffer");
+        apr_thread_exit(thread, APR_ENOMEM);
+        return NULL;
+    }
+
+    while (!apr_atomic_read32(&c->stop)) {
+        apr_time_t now = apr_time_now();
+        apr_sockaddr_t from;
+        apr_size_t len = sizeof(buf);
+
+        if (now >= next) {
+            cluster_flush(c, keys, buf, now);
+            next = now + c->cfg->cluster_interval;
+            continue;
+        }
+
+        apr_socket_timeout_set(c->socket, next - now);
+        if (apr_socket_recvfrom(&from, c->socket, 0, (char *) buf, &len) == APR_SUCCESS)
+            cluster_receive(c, buf, len, apr_time_now());
     }
 
-    return -5;
+    cluster_flush(c, keys, buf, apr_time_now());
+    free(keys);
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
 }
 
-/* Point cursor to first item in tree */
+static apr_status_t cluster_stop(void *data) {
+    struct cluster *c = (struct cluster *) data;
+    apr_status_t rv;
 
-static struct ntt_node *c_ntt_first(struct ntt *ntt, struct ntt_c *c) {
+    c->cfg->cluster = NULL;
 
-    c->iter_index = 0;
-    c->iter_next = (struct ntt_node *)NULL;
-    return(c_ntt_next(ntt, c));
+    /* The thread notices within one interval */
+    apr_atomic_set32(&c->stop, 1);
+    apr_thread_join(&rv, c->thread);
+    apr_socket_close(c->socket);
+
+    /* Let a sibling take over applying remote records */
+    if (c->cfg->cluster_receiver != NULL)
+        apr_atomic_cas32(c->cfg->cluster_receiver, 0, (apr_uint32_t) getpid());
+
+    free(c);
+    return APR_SUCCESS;
 }
 
-/* Point cursor to next iteration in tree */
+#endif
 
-static struct ntt_node *c_ntt_next(struct ntt *ntt, struct ntt_c *c) {
-    size_t index;
-    struct ntt_node *node = c->iter_next;
+/* Join the multicast group of a configuration and start its sync thread */
 
-    if (ntt == NULL) return NULL;
+static void cluster_start(apr_pool_t *p, server_rec *s, evasive_config *cfg) {
+#if APR_HAS_THREADS
+    struct cluster *c = (struct cluster *) calloc(1, sizeof(struct cluster));
+    apr_status_t rv;
 
-    if (node) {
-        c->iter_next = node->next;
-        return (node);
+    if (c == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Failed to allocate cluster queue");
+        return;
+    }
+
+    for (apr_uint32_t i = 0; i < cluster_queue_size; i++)
+        c->slots[i].seq = i;
+    c->cfg = cfg;
+    c->server = s;
+
+    rv = apr_generate_random_bytes((unsigned char *) &c->child, sizeof(c->child));
+    if (rv == APR_SUCCESS)
+        rv = apr_sockaddr_info_get(&c->group, cfg->cluster_host, APR_UNSPEC, cfg->cluster_port, 0, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_socket_create(&c->socket, c->group->family, SOCK_DGRAM, APR_PROTO_UDP, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to create cluster socket for %s:%u",
+                     cfg->cluster_host, cfg->cluster_port);
+        free(c);
+        return;
+    }
+
+    /* Every child joins the group, so all of them receive every datagram */
+    rv = apr_socket_opt_set(c->socket, APR_SO_REUSEADDR, 1);
+    if (rv == APR_SUCCESS)
+        rv = apr_socket_bind(c->socket, c->group);
+    if (rv == APR_SUCCESS)
+        rv = apr_mcast_join(c->socket, c->group, NULL, NULL);
+    if (rv == APR_SUCCESS)
+        rv = apr_mcast_loopback(c->socket, 1);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_create(&c->thread, NULL, cluster_thread, c, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to join cluster group %s:%u, hits are not shared",
+                     cfg->cluster_host, cfg->cluster_port);
+        apr_socket_close(c->socket);
+        free(c);
+        return;
+    }
+
+    cfg->cluster = c;
+    apr_pool_cleanup_register(p, c, cluster_stop, apr_pool_cleanup_null);
+#else
+    (void) p;
+    (void) cfg;
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "DOSClusterAddress requires thread support, hits are not shared");
+#endif
+}
+
+/* END Cluster Functions */
+
+/* BEGIN Snapshot Functions */
+
+/* Whether a node is worth keeping across a restart */
+
+static int snapshot_keep(const struct ntt_node *node, apr_time_t now, apr_time_t ttl) {
+    switch (node->key.type) {
+    case NTT_KEY_IP:
+    case NTT_KEY_URI:
+    case NTT_KEY_SITE:
+    case NTT_KEY_NOTIFIED:
+    case NTT_KEY_SUBNET:
+    case NTT_KEY_SUBNET_SITE:
+        return now - node->timestamp < ttl;
+    default:
+        return 0;
+    }
+}
+
+/* Write the live entries of the shared table to the snapshot file; runs when the configuration pool is
+   cleared, i.e. on every restart and at shutdown */
+
+static apr_status_t snapshot_save(void *data) {
+    evasive_config *cfg = (evasive_config *) data;
+    struct sht *sht = cfg->shared_table;
+    struct snapshot_header hdr = { .magic = SNAPSHOT_MAGIC, .node_size = sizeof(struct ntt_node), .flags = 0, .count = 0 };
+    apr_time_t now = apr_time_now();
+    struct ntt_node *nodes;
+    char *tmp;
+    FILE *file = NULL;
+    int fd;
+
+    if (sht == NULL || shm_mutex == NULL)
+        return APR_SUCCESS;
+
+    nodes = (struct ntt_node *) malloc(sht->size * sizeof(struct ntt_node));
+    tmp = (char *) malloc(strlen(cfg->snapshot_file) + sizeof(".tmp"));
+    if (nodes == NULL || tmp == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to allocate snapshot of %zu entries", sht->size);
+        free(nodes);
+        free(tmp);
+        return APR_SUCCESS;
+    }
+
+    /* Children of the previous generation may still be running */
+    apr_global_mutex_lock(shm_mutex);
+    for (size_t i = 0; i < sht->size; i++) {
+        if (snapshot_keep(&sht->slots[i], now, sht->ttl))
+            nodes[hdr.count++] = sht->slots[i];
+    }
+    apr_global_mutex_unlock(shm_mutex);
+
+    memcpy(hdr.secret, ntt_secret, sizeof(hdr.secret));
+
+    /* Write a new file and rename it, a reader never sees a partial snapshot */
+    strcpy(tmp, cfg->snapshot_file);
+    strcat(tmp, ".tmp");
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0)
+        file = fdopen(fd, "wb");
+
+    if (file == NULL
+            || fwrite(&hdr, sizeof(hdr), 1, file) != 1
+            || fwrite(nodes, sizeof(struct ntt_node), hdr.count, file) != hdr.count
+            || fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, ap_server_conf, "Failed to write snapshot %s", tmp);
+        if (file != NULL)
+            fclose(file);
+        else if (fd >= 0)
+            close(fd);
+        unlink(tmp);
+    } else if (fclose(file) != 0 || rename(tmp, cfg->snapshot_file) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, ap_server_conf, "Failed to replace snapshot %s", cfg->snapshot_file);
+        unlink(tmp);
+    } else {
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, ap_server_conf, "Saved %zu entries to snapshot %s",
+                     (size_t) hdr.count, cfg->snapshot_file);
+    }
+
+    free(nodes);
+    free(tmp);
+    return APR_SUCCESS;
+}
+
+/* Put a node of a snapshot back into the hit list of a configuration */
+
+static int snapshot_restore(evasive_config *cfg, const struct ntt_node *node, apr_time_t now) {
+    apr_uint64_t hash_code = ntt_hashcode(&node->key);
+    struct ntt_node *n;
+
+    /* Nothing else uses the tables during post_config */
+    if (cfg->shared_table != NULL) {
+        n = sht_insert(cfg->shared_table, &node->key, hash_code, node->timestamp);
+    } else {
+        struct ntt_stripe *stripe = ntt_lock(cfg->hit_list, hash_code);
+
+        n = ntt_insert(stripe, &node->key, hash_code, now);
+        ntt_unlock(stripe);
+    }
+
+    if (n == NULL)
+        return 0;
+
+    n->timestamp = node->timestamp;
+    n->count = node->count;
+
+    /* The filter is set up already, restored holds must pass it like new ones */
+    if (hit_list_filtered(cfg, &node->key))
+        block_filter_add(cfg->block_filter, &node->key, node->timestamp);
+    return 1;
+}
+
+/* Map the snapshot file of a configuration and restore its live entries; children inherit them on fork */
+
+static void snapshot_load(evasive_config *cfg, server_rec *s, apr_pool_t *ptemp) {
+    const struct snapshot_header *hdr;
+    const struct ntt_node *nodes;
+    apr_time_t now = apr_time_now();
+    apr_time_t ttl = hit_list_ttl(cfg);
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    size_t restored = 0;
+    int uri_valid;
+    apr_status_t rv;
+
+    if (cfg->hit_list == NULL && cfg->shared_table == NULL)
+        return;
+
+    rv = apr_file_open(&file, cfg->snapshot_file, APR_FOPEN_READ | APR_FOPEN_BINARY, 0, ptemp);
+    if (APR_STATUS_IS_ENOENT(rv))
+        return;
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Failed to open snapshot %s, starting empty", cfg->snapshot_file);
+        return;
+    }
+
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+    if (rv == APR_SUCCESS && finfo.size < (apr_off_t) sizeof(struct snapshot_header))
+        rv = APR_EINVAL;
+    if (rv == APR_SUCCESS)
+        rv = apr_mmap_create(&mm, file, 0, (apr_size_t) finfo.size, APR_MMAP_READ, ptemp);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Failed to read snapshot %s, starting empty", cfg->snapshot_file);
+        apr_file_close(file);
+        return;
+    }
+
+    hdr = (const struct snapshot_header *) mm->mm;
+    nodes = (const struct ntt_node *) (hdr + 1);
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0 || hdr->node_size != sizeof(struct ntt_node)
+            || hdr->count != ((apr_size_t) finfo.size - sizeof(*hdr)) / sizeof(struct ntt_node)
+            || ((apr_size_t) finfo.size - sizeof(*hdr)) % sizeof(struct ntt_node) != 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Ignoring snapshot %s of another format", cfg->snapshot_file);
+        apr_mmap_delete(mm);
+        apr_file_close(file);
+        return;
+    }
+
+    /* URI hashes depend on the secret; take over the one of the snapshot while the tables are still empty */
+    if (!snapshot_restored && memcmp(ntt_secret, hdr->secret, sizeof(ntt_secret)) != 0)
+        memcpy(ntt_secret, hdr->secret, sizeof(ntt_secret));
+    uri_valid = cfg->cluster_keyed || memcmp(ntt_secret, hdr->secret, sizeof(ntt_secret)) == 0;
+
+    for (apr_uint64_t i = 0; i < hdr->count; i++) {
+        if (!snapshot_keep(&nodes[i], now, ttl) || (nodes[i].key.type == NTT_KEY_URI && !uri_valid))
+            continue;
+
+        restored += snapshot_restore(cfg, &nodes[i], now);
+    }
+    snapshot_restored += restored;
+
+    apr_mmap_delete(mm);
+    apr_file_close(file);
+
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Restored %zu entries from snapshot %s", restored, cfg->snapshot_file);
+}
+
+/* END Snapshot Functions */
+
+/* BEGIN List File Functions */
+
+static apr_status_t list_watch_cleanup(void *data) {
+    struct list_watch *w = (struct list_watch *) data;
+
+    for (int i = 0; i < 2; i++) {
+        if (w->generations[i] != NULL)
+            list_file_close(w->generations[i]);
+        w->generations[i] = NULL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Switch requests over to the list file if it changed since it was last tried; a file that fails to load leaves the
+   previous generation in use until the file changes again */
+
+static void list_watch_refresh(struct list_watch *w) {
+    apr_uint32_t spare = 1 - apr_atomic_read32(&w->current);
+    apr_finfo_t finfo;
+
+    /* The replaced generation is freed once no request uses it, and its slot loads the next one; requests that
+       count themselves after this check see that the slot is not current and back off */
+    if (w->generations[spare] != NULL) {
+        if (apr_atomic_read32(&w->readers[spare]) != 0)
+            return;
+        list_file_close(w->generations[spare]);
+        w->generations[spare] = NULL;
+    }
+
+    if (apr_stat(&finfo, w->path, APR_FINFO_MTIME, w->pool) != APR_SUCCESS || finfo.mtime == w->mtime)
+        return;
+    w->mtime = finfo.mtime;
+
+    w->generations[spare] = list_file_open(w->path);
+    if (w->generations[spare] == NULL)
+        return;
+
+    apr_atomic_set32(&w->current, spare);
+    STATS_INC(list_reloads);
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, w->server, "Loaded list file %s", w->path);
+}
+
+#if APR_HAS_THREADS
+
+static void *APR_THREAD_FUNC list_watch_thread(apr_thread_t *thread, void *data) {
+    struct list_watch *w = (struct list_watch *) data;
+
+    while (!apr_atomic_read32(&w->stop)) {
+        apr_sleep(LIST_FILE_INTERVAL);
+        list_watch_refresh(w);
+    }
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t list_watch_stop(void *data) {
+    struct list_watch *w = (struct list_watch *) data;
+    apr_status_t rv;
+
+    /* The thread notices within one interval */
+    apr_atomic_set32(&w->stop, 1);
+    apr_thread_join(&rv, w->thread);
+
+    return APR_SUCCESS;
+}
+
+#endif
+
+/* Load the list file of a configuration, or share the watch of a configuration naming the same file */
+
+static void list_watch_create(evasive_config *cfg, server_rec *s, server_rec *vs, apr_pool_t *pconf) {
+    struct list_watch *w;
+    apr_finfo_t finfo;
+
+    for (server_rec *o = s; o != vs; o = o->next) {
+        evasive_config *ocfg = (evasive_config *) ap_get_module_config(o->lookup_defaults, &evasive_module);
+
+        if (ocfg != NULL && ocfg->list != NULL && strcmp(ocfg->list->path, cfg->list_path) == 0) {
+            cfg->list = ocfg->list;
+            return;
+        }
+    }
+
+    w = (struct list_watch *) apr_pcalloc(pconf, sizeof(struct list_watch));
+    w->path = cfg->list_path;
+    w->server = vs;
+    w->pool = pconf;
+    cfg->list = w;
+    apr_pool_cleanup_register(pconf, w, list_watch_cleanup, apr_pool_cleanup_null);
+
+    /* Children inherit the first generation, and map newer ones themselves */
+    if (apr_stat(&finfo, w->path, APR_FINFO_MTIME, pconf) == APR_SUCCESS) {
+        w->mtime = finfo.mtime;
+        w->generations[0] = list_file_open(w->path);
+    }
+    if (w->generations[0] == NULL)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, vs, "Failed to load list file %s, using it once it is valid",
+                     w->path);
+}
+
+/* Start the watch thread of a list file in a child */
+
+static void list_watch_start(apr_pool_t *p, struct list_watch *w) {
+#if APR_HAS_THREADS
+    apr_status_t rv;
+
+    rv = apr_pool_create(&w->pool, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_create(&w->thread, NULL, list_watch_thread, w, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, w->server, "Failed to start watching list file %s, it is not reloaded",
+                     w->path);
+        return;
+    }
+
+    apr_pool_cleanup_register(p, w, list_watch_stop, apr_pool_cleanup_null);
+#else
+    (void) p;
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, w->server, "DOSListFile requires thread support, %s is not reloaded",
+                 w->path);
+#endif
+}
+
+/* END List File Functions */
+
+/* BEGIN Statistics Functions */
+
+/* Create the slots of the children; the parent keeps none */
+
+static void stats_create(apr_pool_t *pconf, server_rec *s) {
+    int daemons = 0;
+    size_t size;
+    apr_status_t rv;
+
+    stats_segment = NULL;
+    stats_slots = NULL;
+    stats_num_slots = 0;
+
+    if (ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &daemons) != APR_SUCCESS || daemons < 1)
+        daemons = 1;
+
+    size = (size_t) (daemons + 1) * sizeof(struct stats_slot);
+    rv = apr_shm_create(&stats_segment, size, NULL, pconf);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        const char *fname = ap_runtime_dir_relative(pconf, "evasive-stats");
+
+        apr_shm_remove(fname, pconf);
+        rv = apr_shm_create(&stats_segment, size, fname, pconf);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to allocate %zu bytes of shared memory for statistics", size);
+        stats_segment = NULL;
+        return;
+    }
+
+    stats_slots = (struct stats_slot *) apr_shm_baseaddr_get(stats_segment);
+    stats_num_slots = daemons + 1;
+    memset(stats_slots, 0, size);
+}
+
+#ifdef EVASIVE_HISTOGRAMS
+
+static apr_uint64_t hist_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (apr_uint64_t) ts.tv_sec * 1000000000 + (apr_uint64_t) ts.tv_nsec;
+}
+
+static size_t hist_bucket(apr_uint64_t ns) {
+    unsigned int bits;
+
+    if (ns < (1 << hist_sub_bits))
+        return (size_t) ns;
+    if (ns >> hist_max_bits)
+        ns = (UINT64_C(1) << hist_max_bits) - 1;
+
+    bits = 64 - (unsigned int) __builtin_clzll(ns);
+    return ((size_t) (bits - hist_sub_bits) << hist_sub_bits) + (size_t) ((ns >> (bits - 1 - hist_sub_bits)) & ((1 << hist_sub_bits) - 1));
+}
+
+/* Largest value that falls into a bucket */
+
+static apr_uint64_t hist_bucket_max(size_t bucket) {
+    unsigned int shift;
+
+    if (bucket < (1 << hist_sub_bits))
+        return bucket;
+
+    shift = (unsigned int) (bucket >> hist_sub_bits) - 1;
+    return (((apr_uint64_t) (bucket & ((1 << hist_sub_bits) - 1)) + (1 << hist_sub_bits) + 1) << shift) - 1;
+}
+
+static void hist_record(int stage, apr_uint64_t ns) {
+    if (stats == NULL)
+        return;
+
+    apr_atomic_add64(&stats->hist[stage][hist_bucket(ns)], 1);
+    apr_atomic_add64(&stats->hist_sum[stage], ns);
+}
+
+/* Value below which the given fraction of the samples of a summed histogram lie */
+
+static apr_uint64_t hist_quantile(const struct stats_slot *sum, int stage, apr_uint64_t count, double q) {
+    apr_uint64_t rank = (apr_uint64_t) (q * (double) count);
+    apr_uint64_t seen = 0;
+
+    for (size_t i = 0; i < hist_num_buckets; i++) {
+        seen += sum->hist[stage][i];
+        if (seen > rank)
+            return hist_bucket_max(i);
+    }
+
+    return 0;
+}
+
+static apr_uint64_t hist_count(const struct stats_slot *sum, int stage) {
+    apr_uint64_t count = 0;
+
+    for (size_t i = 0; i < hist_num_buckets; i++)
+        count += sum->hist[stage][i];
+
+    return count;
+}
+
+#endif
+
+/* Add the counters of a slot to the exited children and clear them */
+
+static void stats_retire(struct stats_slot *slot) {
+#define STATS_FIELD(name, type, help) \
+    apr_atomic_add64(&stats_slots[0].name, apr_atomic_xchg64(&slot->name, 0));
+    STATS_COUNTERS(STATS_FIELD)
+#undef STATS_FIELD
+#ifdef EVASIVE_HISTOGRAMS
+    for (int stage = 0; stage < hist_num_stages; stage++) {
+        apr_atomic_add64(&stats_slots[0].hist_sum[stage], apr_atomic_xchg64(&slot->hist_sum[stage], 0));
+        for (size_t i = 0; i < hist_num_buckets; i++) {
+            if (slot->hist[stage][i])
+                apr_atomic_add64(&stats_slots[0].hist[stage][i], apr_atomic_xchg64(&slot->hist[stage][i], 0));
+        }
+    }
+#endif
+}
+
+static apr_status_t stats_release(void *data) {
+    struct stats_slot *slot = (struct stats_slot *) data;
+
+    stats = NULL;
+    stats_retire(slot);
+    apr_atomic_set32(&slot->pid, 0);
+
+    return APR_SUCCESS;
+}
+
+/* Claim a slot for this child; slots of children that died without releasing theirs are taken over */
+
+static void stats_attach(apr_pool_t *p, server_rec *s) {
+    apr_uint32_t pid = (apr_uint32_t) getpid();
+
+    if (stats_slots == NULL)
+        return;
+
+    for (int pass = 0; pass < 2 && stats == NULL; pass++) {
+        for (int i = 1; i < stats_num_slots; i++) {
+            struct stats_slot *slot = &stats_slots[i];
+            apr_uint32_t owner = apr_atomic_read32(&slot->pid);
+
+            if (owner != 0 && (pass == 0 || kill((pid_t) owner, 0) == 0 || errno != ESRCH))
+                continue;
+
+            if (apr_atomic_cas32(&slot->pid, pid, owner) == owner) {
+                if (owner != 0)
+                    stats_retire(slot);
+                stats = slot;
+                break;
+            }
+        }
+    }
+
+    if (stats == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "No statistics slot left for child %ld", (long) pid);
+        return;
+    }
+
+    apr_pool_cleanup_register(p, stats, stats_release, apr_pool_cleanup_null);
+}
+
+/* Sum the counters of all children */
+
+static void stats_sum(struct stats_slot *sum, int *children) {
+    memset(sum, 0, sizeof(*sum));
+    *children = 0;
+
+    for (int i = 0; i < stats_num_slots; i++) {
+        struct stats_slot *slot = &stats_slots[i];
+
+        if (i > 0 && apr_atomic_read32(&slot->pid) != 0)
+            (*children)++;
+#define STATS_FIELD(name, type, help) sum->name += apr_atomic_read64(&slot->name);
+        STATS_COUNTERS(STATS_FIELD)
+#undef STATS_FIELD
+#ifdef EVASIVE_HISTOGRAMS
+        for (int stage = 0; stage < hist_num_stages; stage++) {
+            sum->hist_sum[stage] += apr_atomic_read64(&slot->hist_sum[stage]);
+            for (size_t j = 0; j < hist_num_buckets; j++)
+                sum->hist[stage][j] += apr_atomic_read64(&slot->hist[stage][j]);
+        }
+#endif
+    }
+}
+
+/* Occupancy of a hash table, and how far entries are displaced from their home slot */
+struct stats_table {
+    size_t size;
+    size_t entries;
+    size_t displaced;       // Sum of the displacements
+    size_t max_displaced;
+};
+
+static void stats_table_add(struct stats_table *st, const struct ntt_node *tbl, size_t size, int striped) {
+    st->size += size;
+
+    for (size_t i = 0; i < size; i++) {
+        apr_uint64_t hash_code;
+        size_t home, d;
+
+        if (tbl[i].key.type == NTT_KEY_NONE || tbl[i].key.type == NTT_KEY_MOVED)
+            continue;
+
+        hash_code = ntt_hashcode(&tbl[i].key);
+        home = striped ? ntt_index(size, hash_code) : (size_t) (hash_code & (size - 1));
+        d = (i - home) & (size - 1);
+
+        st->entries++;
+        st->displaced += d;
+        if (d > st->max_displaced)
+            st->max_displaced = d;
+    }
+}
+
+/* Table statistics of a configuration; per-child tables are those of the child serving the request */
+
+static void stats_table(const evasive_config *cfg, struct stats_table *st) {
+    memset(st, 0, sizeof(*st));
+
+    if (cfg->shared_table != NULL) {
+        apr_global_mutex_lock(shm_mutex);
+        stats_table_add(st, cfg->shared_table->slots, cfg->shared_table->size, 0);
+        apr_global_mutex_unlock(shm_mutex);
+    } else if (cfg->sketch != NULL) {
+        /* Only the holds are kept per key */
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(cfg->sketch->mutex);
+#endif
+        stats_table_add(st, cfg->sketch->holds, cfg->sketch->holds_size, 0);
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(cfg->sketch->mutex);
+#endif
+    } else if (cfg->hit_list != NULL) {
+        for (size_t i = 0; i < ntt_num_stripes; i++) {
+            struct ntt_stripe *stripe = &cfg->hit_list->stripes[i];
+
+#if APR_HAS_THREADS
+            apr_thread_mutex_lock(stripe->mutex);
+#endif
+            stats_table_add(st, stripe->tbl, stripe->size, 1);
+            if (stripe->old_tbl != NULL)
+                stats_table_add(st, stripe->old_tbl, stripe->old_size, 1);
+#if APR_HAS_THREADS
+            apr_thread_mutex_unlock(stripe->mutex);
+#endif
+        }
+    }
+}
+
+static const char *stats_server_name(const server_rec *vs) {
+    return vs->server_hostname != NULL ? vs->server_hostname : "";
+}
+
+static void stats_json(request_rec *r) {
+    struct stats_slot sum;
+    int children;
+    int first = 1;
+
+    stats_sum(&sum, &children);
+
+    ap_set_content_type(r, "application/json");
+    ap_rprintf(r, "{\n  \"children\": %d,\n", children);
+#define STATS_FIELD(name, type, help) ap_rprintf(r, "  \"" #name "\": %" APR_UINT64_T_FMT ",\n", sum.name);
+    STATS_COUNTERS(STATS_FIELD)
+#undef STATS_FIELD
+    ap_rputs("  \"tables\": [", r);
+
+    for (server_rec *vs = ap_server_conf; vs != NULL; vs = vs->next) {
+        const evasive_config *cfg = (const evasive_config *) ap_get_module_config(vs->lookup_defaults, &evasive_module);
+        struct stats_table st;
+
+        if (cfg == NULL || cfg->server != vs || !cfg->enabled)
+            continue;
+
+        stats_table(cfg, &st);
+        ap_rprintf(r, "%s\n    { \"server\": \"%s:%u\", \"shared\": %s, \"size\": %zu, \"entries\": %zu, "
+                   "\"mean_displacement\": %.3f, \"max_displacement\": %zu }",
+                   first ? "" : ",", ap_escape_quotes(r->pool, stats_server_name(vs)), vs->port,
+                   cfg->shared_table != NULL ? "true" : "false", st.size, st.entries,
+                   st.entries ? (double) st.displaced / (double) st.entries : 0.0, st.max_displaced);
+        first = 0;
+    }
+
+    ap_rputs("\n  ]", r);
+
+#ifdef EVASIVE_HISTOGRAMS
+    ap_rputs(",\n  \"latency_ns\": {", r);
+    for (int stage = 0; stage < hist_num_stages; stage++) {
+        apr_uint64_t count = hist_count(&sum, stage);
+
+        ap_rprintf(r, "%s\n    \"%s\": { \"count\": %" APR_UINT64_T_FMT ", \"sum\": %" APR_UINT64_T_FMT
+                   ", \"p50\": %" APR_UINT64_T_FMT ", \"p99\": %" APR_UINT64_T_FMT ", \"p999\": %" APR_UINT64_T_FMT " }",
+                   stage ? "," : "", hist_stage_names[stage], count, sum.hist_sum[stage],
+                   hist_quantile(&sum, stage, count, 0.5), hist_quantile(&sum, stage, count, 0.99),
+                   hist_quantile(&sum, stage, count, 0.999));
+    }
+    ap_rputs("\n  }", r);
+#endif
+
+    ap_rputs("\n}\n", r);
+}
+
+static void stats_prometheus(request_rec *r) {
+    struct stats_slot sum;
+    int children;
+
+    stats_sum(&sum, &children);
+
+    ap_set_content_type(r, "text/plain; version=0.0.4");
+    ap_rprintf(r, "# HELP evasive_children Child processes reporting\n# TYPE evasive_children gauge\nevasive_children %d\n",
+               children);
+#define STATS_FIELD(name, type, help)                                                           \
+    ap_rprintf(r, "# HELP evasive_" #name "_total " help "\n# TYPE evasive_" #name "_total " type "\n"  \
+               "evasive_" #name "_total %" APR_UINT64_T_FMT "\n", sum.name);
+    STATS_COUNTERS(STATS_FIELD)
+#undef STATS_FIELD
+
+    ap_rputs("# HELP evasive_table_size Hash table slots\n# TYPE evasive_table_size gauge\n"
+             "# HELP evasive_table_entries Hash table entries\n# TYPE evasive_table_entries gauge\n"
+             "# HELP evasive_table_max_displacement Longest probe sequence in the hash table\n"
+             "# TYPE evasive_table_max_displacement gauge\n", r);
+
+    for (server_rec *vs = ap_server_conf; vs != NULL; vs = vs->next) {
+        const evasive_config *cfg = (const evasive_config *) ap_get_module_config(vs->lookup_defaults, &evasive_module);
+        struct stats_table st;
+        const char *name;
+
+        if (cfg == NULL || cfg->server != vs || !cfg->enabled)
+            continue;
+
+        stats_table(cfg, &st);
+        name = ap_escape_quotes(r->pool, stats_server_name(vs));
+        ap_rprintf(r, "evasive_table_size{server=\"%s:%u\"} %zu\n", name, vs->port, st.size);
+        ap_rprintf(r, "evasive_table_entries{server=\"%s:%u\"} %zu\n", name, vs->port, st.entries);
+        ap_rprintf(r, "evasive_table_max_displacement{server=\"%s:%u\"} %zu\n", name, vs->port, st.max_displaced);
+    }
+
+#ifdef EVASIVE_HISTOGRAMS
+    ap_rputs("# HELP evasive_latency_seconds Time spent per stage of the check\n# TYPE evasive_latency_seconds summary\n", r);
+    for (int stage = 0; stage < hist_num_stages; stage++) {
+        static const double quantiles[] = { 0.5, 0.99, 0.999 };
+        apr_uint64_t count = hist_count(&sum, stage);
+
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+            ap_rprintf(r, "evasive_latency_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", hist_stage_names[stage], quantiles[i],
+                       (double) hist_quantile(&sum, stage, count, quantiles[i]) / 1e9);
+        ap_rprintf(r, "evasive_latency_seconds_sum{stage=\"%s\"} %.9f\n", hist_stage_names[stage],
+                   (double) sum.hist_sum[stage] / 1e9);
+        ap_rprintf(r, "evasive_latency_seconds_count{stage=\"%s\"} %" APR_UINT64_T_FMT "\n", hist_stage_names[stage], count);
+    }
+#endif
+}
+
+/* SetHandler evasive-status: JSON by default, Prometheus text format with ?prometheus */
+
+static int stats_handler(request_rec *r) {
+    if (r->handler == NULL || strcmp(r->handler, STATS_HANDLER) != 0)
+        return DECLINED;
+
+    if (stats_slots == NULL)
+        return HTTP_SERVICE_UNAVAILABLE;
+
+    if (r->header_only) {
+        ap_set_content_type(r, "application/json");
+        return OK;
+    }
+
+    if (r->args != NULL && strcmp(r->args, "prometheus") == 0)
+        stats_prometheus(r);
+    else
+        stats_json(r);
+
+    return OK;
+}
+
+/* mod_status page */
+
+static int stats_status_hook(request_rec *r, int flags) {
+    struct stats_slot sum;
+    int children;
+
+    if (stats_slots == NULL)
+        return OK;
+
+    stats_sum(&sum, &children);
+
+    if (flags & AP_STATUS_SHORT) {
+#define STATS_FIELD(name, type, help) ap_rprintf(r, "Evasive_" #name ": %" APR_UINT64_T_FMT "\n", sum.name);
+        STATS_COUNTERS(STATS_FIELD)
+#undef STATS_FIELD
+        return OK;
+    }
+
+    ap_rputs("<hr />\n<h2>mod_evasive</h2>\n<table>\n", r);
+#define STATS_FIELD(name, type, help) \
+    ap_rprintf(r, "<tr><td>" help "</td><td>%" APR_UINT64_T_FMT "</td></tr>\n", sum.name);
+    STATS_COUNTERS(STATS_FIELD)
+#undef STATS_FIELD
+    ap_rputs("</table>\n", r);
+
+    return OK;
+}
+
+/* END Statistics Functions */
+
+/* BEGIN Event Log Functions */
+
+static int event_log_v4(const struct ntt_key *key) {
+    static const unsigned char v4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    return memcmp(key->addr, v4_mapped, sizeof(v4_mapped)) == 0;
+}
+
+/* Queue a detection event for the flush thread; never blocks, the event is dropped if the queue is full */
+
+static void event_log_publish(const evasive_config *cfg, apr_uint32_t event, const struct ntt_key *key,
+        const char *reason, unsigned int count, server_rec *s, apr_time_t t) {
+    struct event_queue *q = cfg->events != NULL ? cfg->events->queue : NULL;
+    apr_uint32_t pos;
+
+    if (q == NULL)
+        return;
+
+    pos = apr_atomic_read32(&q->head);
+    for (;;) {
+        struct event_record *ev = &q->slots[pos & (event_queue_size - 1)];
+        apr_int32_t diff = (apr_int32_t) (apr_atomic_read32(&ev->seq) - pos);
+
+        if (diff == 0) {
+            apr_uint32_t prev = apr_atomic_cas32(&q->head, pos + 1, pos);
+
+            if (prev == pos) {
+                ev->event = event;
+                ev->key = *key;
+                ev->reason = reason;
+                ev->server = s;
+                ev->time = t;
+                ev->until = t + cfg->blocking_period;
+                ev->count = count;
+                ev->prefix = 0;
+                if (key->type == NTT_KEY_SUBNET || key->type == NTT_KEY_SUBNET_SITE)
+                    ev->prefix = event_log_v4(key) ? cfg->subnet_prefix4 : cfg->subnet_prefix6;
+                /* Publish the slot to the flush thread */
+                apr_atomic_set32(&ev->seq, pos + 1);
+                return;
+            }
+            pos = prev;
+        } else if (diff < 0) {
+            /* The slot of the previous round was not drained yet */
+            STATS_INC(events_dropped);
+            return;
+        } else {
+            pos = apr_atomic_read32(&q->head);
+        }
+    }
+}
+
+/* Take the next event off the queue; flush thread only */
+
+static int event_log_pop(struct event_queue *q, struct event_record *ev) {
+    struct event_record *slot = &q->slots[q->tail & (event_queue_size - 1)];
+
+    if (apr_atomic_read32(&slot->seq) != q->tail + 1)
+        return 0;
+
+    ev->event = slot->event;
+    ev->key = slot->key;
+    ev->reason = slot->reason;
+    ev->server = slot->server;
+    ev->time = slot->time;
+    ev->until = slot->until;
+    ev->count = slot->count;
+    ev->prefix = slot->prefix;
+
+    /* Hand the slot back to the producers of the next round */
+    apr_atomic_set32(&slot->seq, q->tail + event_queue_size);
+    q->tail++;
+    return 1;
+}
+
+static const char *event_log_key_name(apr_uint32_t type) {
+    switch (type) {
+    case NTT_KEY_URI:
+        return "uri";
+    case NTT_KEY_SITE:
+        return "site";
+    case NTT_KEY_SUBNET:
+    case NTT_KEY_SUBNET_SITE:
+        return "subnet";
+    default:
+        return "ip";
+    }
+}
+
+/* Write an event as a JSON line; returns its length, or 0 if it does not fit */
+
+static apr_size_t event_log_format(struct event_queue *q, const struct event_record *ev, char *buf, apr_size_t size) {
+    char addr[INET6_ADDRSTRLEN];
+    apr_size_t len = 0;
+
+#define EVENT_LOG_APPEND(...)                                                   \
+    do {                                                                        \
+        if (len < size)                                                         \
+            len += (apr_size_t) snprintf(buf + len, size - len, __VA_ARGS__);   \
+    } while (0)
+
+    if (event_log_v4(&ev->key))
+        inet_ntop(AF_INET, ev->key.addr + 12, addr, sizeof(addr));
+    else
+        inet_ntop(AF_INET6, ev->key.addr, addr, sizeof(addr));
+
+    EVENT_LOG_APPEND("{\"time\":%" APR_TIME_T_FMT ".%06d,\"event\":\"%s\",\"client\":\"%s\"",
+                     apr_time_sec(ev->time), (int) apr_time_usec(ev->time), event_names[ev->event], addr);
+    if (ev->prefix > 0)
+        EVENT_LOG_APPEND(",\"prefix\":%u", ev->prefix);
+    EVENT_LOG_APPEND(",\"key\":\"%s\"", event_log_key_name(ev->key.type));
+    if (ev->key.type == NTT_KEY_URI)
+        EVENT_LOG_APPEND(",\"uri_hash\":\"%016" APR_UINT64_T_HEX_FMT "\"", ev->key.uri_hash);
+    if (ev->reason != NULL)
+        EVENT_LOG_APPEND(",\"reason\":\"%s\"", ev->reason);
+    if (ev->count > 0)
+        EVENT_LOG_APPEND(",\"count\":%u", ev->count);
+    EVENT_LOG_APPEND(",\"until\":%" APR_TIME_T_FMT ".%06d,\"server\":\"%s\",\"port\":%u,\"pid\":%" APR_PID_T_FMT "}\n",
+                     apr_time_sec(ev->until), (int) apr_time_usec(ev->until),
+                     ap_escape_quotes(q->pool, stats_server_name(ev->server)), (unsigned int) ev->server->port, q->pid);
+
+#undef EVENT_LOG_APPEND
+
+    return len < size ? len : 0;
+}
+
+/* Write a batch of JSON lines with a single write, or send it as a single datagram */
+
+static void event_log_write(struct event_queue *q, const char *buf, apr_size_t len, apr_uint32_t count) {
+    struct event_log *log = q->log;
+    apr_status_t rv;
+
+    if (log->file != NULL)
+        rv = apr_file_write_full(log->file, buf, len, NULL);
+    else if (sendto(log->socket, buf, len, MSG_DONTWAIT, (const struct sockaddr *) &log->addr, sizeof(log->addr)) < 0)
+        rv = errno;
+    else
+        rv = APR_SUCCESS;
+
+    if (rv != APR_SUCCESS) {
+        /* A collector that is down is logged once, until writes succeed again */
+        if (!q->failing)
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, log->server, "Failed to write event log %s, dropping events",
+                         log->target);
+        q->failing = 1;
+        STATS_ADD(events_dropped, count);
+        return;
+    }
+
+    q->failing = 0;
+    STATS_ADD(events, count);
+}
+
+/* Write everything queued since the last flush, in batches of up to event_batch_size bytes */
+
+static void event_log_flush(struct event_queue *q, char *buf) {
+    struct event_record ev;
+    apr_size_t len = 0;
+    apr_uint32_t count = 0;
+
+    while (event_log_pop(q, &ev)) {
+        apr_size_t n = event_log_format(q, &ev, buf + len, event_batch_size - len);
+
+        if (n == 0 && count > 0) {
+            event_log_write(q, buf, len, count);
+            len = 0;
+            count = 0;
+            n = event_log_format(q, &ev, buf, event_batch_size);
+        }
+        if (n == 0) {
+            STATS_INC(events_dropped);
+            continue;
+        }
+        len += n;
+        count++;
+    }
+
+    if (count > 0)
+        event_log_write(q, buf, len, count);
+    apr_pool_clear(q->pool);
+}
+
+#if APR_HAS_THREADS
+
+static void * APR_THREAD_FUNC event_log_thread(apr_thread_t *thread, void *data) {
+    struct event_queue *q = (struct event_queue *) data;
+    char buf[event_batch_size];
+
+    while (!apr_atomic_read32(&q->stop)) {
+        apr_sleep(EVENT_LOG_INTERVAL);
+        event_log_flush(q, buf);
+    }
+
+    event_log_flush(q, buf);
+
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t event_log_stop(void *data) {
+    struct event_queue *q = (struct event_queue *) data;
+    apr_status_t rv;
+
+    q->log->queue = NULL;
+
+    /* The thread notices within one interval, and writes what was queued until then */
+    apr_atomic_set32(&q->stop, 1);
+    apr_thread_join(&rv, q->thread);
+
+    free(q);
+    return APR_SUCCESS;
+}
+
+#endif
+
+static apr_status_t event_log_close(void *data) {
+    struct event_log *log = (struct event_log *) data;
+
+    if (log->socket >= 0)
+        close(log->socket);
+    log->socket = -1;
+
+    return APR_SUCCESS;
+}
+
+/* Open the event log of a configuration, or share the log of a configuration naming the same target */
+
+static void event_log_create(evasive_config *cfg, server_rec *s, server_rec *vs, apr_pool_t *pconf) {
+    struct event_log *log;
+    apr_status_t rv;
+
+    for (server_rec *o = s; o != vs; o = o->next) {
+        evasive_config *ocfg = (evasive_config *) ap_get_module_config(o->lookup_defaults, &evasive_module);
+
+        if (ocfg != NULL && ocfg->events != NULL && strcmp(ocfg->events->target, cfg->event_target) == 0) {
+            cfg->events = ocfg->events;
+            return;
+        }
+    }
+
+    log = (struct event_log *) apr_pcalloc(pconf, sizeof(struct event_log));
+    log->target = cfg->event_target;
+    log->server = vs;
+    log->socket = -1;
+
+    /* Opened by the parent, which may write where the children cannot */
+    if (strncmp(log->target, EVENT_LOG_SOCKET, strlen(EVENT_LOG_SOCKET)) == 0) {
+        log->addr.sun_family = AF_UNIX;
+        strcpy(log->addr.sun_path, log->target + strlen(EVENT_LOG_SOCKET));
+        log->socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+        rv = log->socket < 0 ? errno : APR_SUCCESS;
+        if (rv == APR_SUCCESS) {
+            /* Not inherited by the commands of the notifier */
+            fcntl(log->socket, F_SETFD, FD_CLOEXEC);
+            apr_pool_cleanup_register(pconf, log, event_log_close, apr_pool_cleanup_null);
+        }
+    } else {
+        rv = apr_file_open(&log->file, log->target, APR_FOPEN_WRITE | APR_FOPEN_CREATE | APR_FOPEN_APPEND,
+                           APR_OS_DEFAULT, pconf);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, vs, "Failed to open event log %s, events are not logged", log->target);
+        return;
+    }
+
+    cfg->events = log;
+}
+
+/* Start the flush thread of an event log in a child */
+
+static void event_log_start(apr_pool_t *p, struct event_log *log) {
+#if APR_HAS_THREADS
+    struct event_queue *q = (struct event_queue *) calloc(1, sizeof(struct event_queue));
+    apr_status_t rv;
+
+    if (q == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, log->server, "Failed to allocate event queue");
+        return;
+    }
+
+    for (apr_uint32_t i = 0; i < event_queue_size; i++)
+        q->slots[i].seq = i;
+    q->log = log;
+    q->pid = getpid();
+
+    rv = apr_pool_create(&q->pool, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_create(&q->thread, NULL, event_log_thread, q, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, log->server, "Failed to start writing event log %s, events are not logged",
+                     log->target);
+        free(q);
+        return;
+    }
+
+    log->queue = q;
+    apr_pool_cleanup_register(p, q, event_log_stop, apr_pool_cleanup_null);
+#else
+    (void) p;
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, log->server, "DOSEventLog requires thread support, %s is not written",
+                 log->target);
+#endif
+}
+
+/* END Event Log Functions */
+
+
+/* BEGIN Configuration Functions */
+
+static const char *
+get_enabled(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+
+    cfg->set |= CONFIG_ENABLED;
+
+    if (strcmp("true", value) == 0) {
+        cfg->enabled = 1;
+    } else if (strcmp("false", value) == 0) {
+        cfg->enabled = 0;
+    } else {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSEnabled value '%s', mod_evasive disabled.", value);
+        cfg->enabled = 0;
+    }
+
+    return NULL;
+}
+
+static const char *
+get_shared_table(__attribute__((unused)) cmd_parms *cmd, void *dconfig, int value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+
+    cfg->set |= CONFIG_SHARED_TABLE;
+
+    cfg->shared = value;
+
+    return NULL;
+}
+
+static const char *
+get_table_scope(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+
+    cfg->set |= CONFIG_TABLE_SCOPE;
+
+    if (strcmp("vhost", value) == 0) {
+        cfg->table_scope = TABLE_VHOST;
+    } else if (strcmp("server", value) == 0) {
+        cfg->table_scope = TABLE_SERVER;
+    } else {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSTableScope value '%s', using vhost.", value);
+        cfg->table_scope = TABLE_VHOST;
+    }
+
+    return NULL;
+}
+
+static const char *
+get_hash_tbl_size(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    char *endptr;
+    long n;
+
+    cfg->set |= CONFIG_HASH_TABLE_SIZE;
+
+    errno = 0;
+    n = strtol(value, &endptr, 0);
+    if (errno || *endptr != '\0' || n <= 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSHashTableSize value '%s', using default %lu.",
+                     value, DEFAULT_HASH_TBL_SIZE);
+        cfg->hash_table_size = DEFAULT_HASH_TBL_SIZE;
+    } else {
+        cfg->hash_table_size = n;
+    }
+
+    return NULL;
+}
+
+static const char *
+get_sketch_size(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *width, const char *holds) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    char *endptr;
+    long n;
+
+    cfg->set |= CONFIG_SKETCH_SIZE;
+
+    errno = 0;
+    n = strtol(width, &endptr, 0);
+    if (errno || *endptr != '\0' || n < 0 || n > UINT32_MAX) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSSketchSize width '%s', hits are counted in the hash table.",
+                     width);
+        cfg->sketch_width = 0;
+    } else {
+        cfg->sketch_width = n;
+    }
+
+    if (holds == NULL)
+        return NULL;
+
+    errno = 0;
+    n = strtol(holds, &endptr, 0);
+    if (errno || *endptr != '\0' || n <= 0 || n > UINT32_MAX) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSSketchSize holds '%s', using default %d.",
+                     holds, DEFAULT_SKETCH_HOLDS);
+        cfg->sketch_holds = DEFAULT_SKETCH_HOLDS;
+    } else {
+        cfg->sketch_holds = n;
+    }
+
+    return NULL;
+}
+
+static const char *
+get_page_count(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    char *endptr;
+    long n;
+
+    cfg->set |= CONFIG_PAGE_COUNT;
+
+    errno = 0;
+    n = strtol(value, &endptr, 0);
+    if (errno || *endptr != '\0' || n <= 0 || n > UINT_MAX) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSPageCount value '%s', using default %d.",
+                     value, DEFAULT_PAGE_COUNT);
+        cfg->page_count = DEFAULT_PAGE_COUNT;
+    } else {
+        cfg->page_count = n;
+    }
+
+    return NULL;
+}
+
+static const char *
+get_site_count(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    char *endptr;
+    long n;
+
+    cfg->set |= CONFIG_SITE_COUNT;
+
+    errno = 0;
+    n = strtol(value, &endptr, 0);
+    if (errno || *endptr != '\0' || n <= 0 || n > UINT_MAX) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSSiteCount value '%s', using default %d.",
+                     value, DEFAULT_SITE_COUNT);
+        cfg->site_count = DEFAULT_SITE_COUNT;
+    } else {
+        cfg->site_count = n;
+    }
+
+    return NULL;
+}
+
+static const char *
+get_subnet_count(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    char *endptr;
+    long n;
+
+    cfg->set |= CONFIG_SUBNET_COUNT;
+
+    errno = 0;
+    n = strtol(value, &endptr, 0);
+    if (errno || *endptr != '\0' || n < 0 || n > UINT_MAX) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSSubnetCount value '%s', prefixes are not counted.",
+                     value);
+        cfg->subnet_count = 0;
+    } else {
+        cfg->subnet_count = n;
+    }
+
+    return NULL;
+}
+
+static const char *
+get_subnet_prefix(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *prefix4, const char *prefix6) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    char *endptr;
+    long n;
+
+    cfg->set |= CONFIG_SUBNET_PREFIX;
+
+    errno = 0;
+    n = strtol(prefix4, &endptr, 10);
+    if (errno || *endptr != '\0' || n < 1 || n > 32) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSSubnetPrefix IPv4 length '%s', using default %d.",
+                     prefix4, DEFAULT_SUBNET_PREFIX4);
+        cfg->subnet_prefix4 = DEFAULT_SUBNET_PREFIX4;
+    } else {
+        cfg->subnet_prefix4 = n;
+    }
+
+    if (prefix6 == NULL)
+        return NULL;
+
+    errno = 0;
+    n = strtol(prefix6, &endptr, 10);
+    if (errno || *endptr != '\0' || n < 1 || n > 128) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSSubnetPrefix IPv6 length '%s', using default %d.",
+                     prefix6, DEFAULT_SUBNET_PREFIX6);
+        cfg->subnet_prefix6 = DEFAULT_SUBNET_PREFIX6;
+    } else {
+        cfg->subnet_prefix6 = n;
+    }
+
+    return NULL;
+}
+
+static const char *
+get_adaptive_load(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *start, const char *low) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    char *endptr;
+    long n;
+
+    cfg->set |= CONFIG_ADAPTIVE_LOAD;
+
+    errno = 0;
+    n = strtol(start, &endptr, 10);
+    if (errno || *endptr != '\0' || n < 0 || n > 99) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSAdaptiveLoad busy percentage '%s', counts are static.",
+                     start);
+        cfg->adaptive_start = 0;
+    } else {
+        cfg->adaptive_start = n;
+    }
+
+    cfg->adaptive_floor = DEFAULT_ADAPTIVE_FLOOR;
+    if (low == NULL)
+        return NULL;
+
+    errno = 0;
+    n = strtol(low, &endptr, 10);
+    if (errno || *endptr != '\0' || n < 1 || n > 100) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSAdaptiveLoad floor '%s', using default %d.",
+                     low, DEFAULT_ADAPTIVE_FLOOR);
+    } else {
+        cfg->adaptive_floor = n;
+    }
+
+    return NULL;
+}
+
+/* Parse an interval of whole seconds, or of milliseconds with an "ms" suffix */
+
+static const char *
+get_page_interval(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+
+    cfg->set |= CONFIG_PAGE_INTERVAL;
+
+    if (parse_interval(value, &cfg->page_interval) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSPageInterval value '%s', using default %d.",
+                     value, DEFAULT_PAGE_INTERVAL);
+        cfg->page_interval = apr_time_from_sec(DEFAULT_PAGE_INTERVAL);
+    }
+
+    return NULL;
+}
+
+static const char *
+get_site_interval(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+
+    cfg->set |= CONFIG_SITE_INTERVAL;
+
+    if (parse_interval(value, &cfg->site_interval) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSSiteInterval value '%s', using default %d.",
+                     value, DEFAULT_SITE_INTERVAL);
+        cfg->site_interval = apr_time_from_sec(DEFAULT_SITE_INTERVAL);
+    }
+
+    return NULL;
+}
+
+static const char *
+get_blocking_period(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    char *endptr;
+    long n;
+
+    cfg->set |= CONFIG_BLOCKING_PERIOD;
+
+    errno = 0;
+    n = strtol(value, &endptr, 0);
+    if (errno || *endptr != '\0' || n <= 0 || n > INT_MAX) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSBlockingPeriod value '%s', using default %d.",
+                     value, DEFAULT_BLOCKING_PERIOD);
+        cfg->blocking_period = apr_time_from_sec(DEFAULT_BLOCKING_PERIOD);
+    } else {
+        cfg->blocking_period = apr_time_from_sec(n);
+    }
+
+    return NULL;
+}
+
+static const char *
+get_rate_algorithm(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+
+    cfg->set |= CONFIG_RATE_ALGORITHM;
+
+    if (parse_rate_algorithm(value, &cfg->rate_algorithm) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSRateAlgorithm value '%s', using default fixed.",
+                     value);
+        cfg->rate_algorithm = DEFAULT_RATE_ALGORITHM;
+    }
+
+    return NULL;
+}
+
+static const char *
+get_cluster_address(cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    char *host, *scope_id;
+    apr_port_t port;
+
+    cfg->set |= CONFIG_CLUSTER_ADDRESS;
+
+    if (apr_parse_addr_port(&host, &scope_id, &port, value, cmd->pool) != APR_SUCCESS || host == NULL || port == 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSClusterAddress value '%s', hits are not shared.",
+                     value);
+        return NULL;
+    }
+
+    free(cfg->cluster_host);
+    cfg->cluster_host = strdup(host);
+    cfg->cluster_port = port;
+
+    return NULL;
+}
+
+static const char *
+get_cluster_key(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    static const apr_uint64_t derive[2] = { UINT64_C(0x65766173697665), UINT64_C(0x636c7573746572) };
+    size_t len = strlen(value);
+
+    cfg->set |= CONFIG_CLUSTER_KEY;
+
+    if (len < 16)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "DOSClusterKey is shorter than 16 characters.");
+
+    /* Derive the 128 bit secret from the passphrase */
+    cfg->cluster_secret[0] = ntt_siphash_keyed(derive, (const unsigned char *) value, len);
+    cfg->cluster_secret[1] = ntt_siphash_keyed(cfg->cluster_secret, (const unsigned char *) value, len);
+    cfg->cluster_keyed = 1;
+
+    return NULL;
+}
+
+static const char *
+get_cluster_interval(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+
+    cfg->set |= CONFIG_CLUSTER_INTERVAL;
+
+    if (parse_interval(value, &cfg->cluster_interval) < 0) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSClusterInterval value '%s', using default 100ms.",
+                     value);
+        cfg->cluster_interval = DEFAULT_CLUSTER_INTERVAL;
+    }
+
+    return NULL;
+}
+
+static const char *
+get_snapshot_file(cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    const char *path = ap_server_root_relative(cmd->pool, value);
+
+    cfg->set |= CONFIG_SNAPSHOT_FILE;
+
+    if (path == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSSnapshotFile value '%s', not keeping hit lists.",
+                     value);
+        return NULL;
+    }
+
+    free(cfg->snapshot_file);
+    cfg->snapshot_file = strdup(path);
+
+    return NULL;
+}
+
+static const char *
+get_log_dir(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    if (value != NULL && value[0] != 0) {
+        if (cfg->log_dir != NULL)
+            free(cfg->log_dir);
+        cfg->log_dir = strdup(value);
     }
 
-    while (c->iter_index < ntt->size) {
-        index = c->iter_index++;
-
-        if (ntt->tbl[index]) {
-            c->iter_next = ntt->tbl[index]->next;
-            return(ntt->tbl[index]);
-        }
-    }
+    cfg->set |= CONFIG_LOG_DIR;
 
-    return((struct ntt_node *)NULL);
+    return NULL;
 }
 
-/* END NTT (Named Pointer Tree) Functions */
+static const char *
+get_email_notify(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    if (value != NULL && value[0] != 0) {
+        if (cfg->email_notify != NULL)
+            free(cfg->email_notify);
+        cfg->email_notify = strdup(value);
+    }
 
+    cfg->set |= CONFIG_EMAIL_NOTIFY;
 
-/* BEGIN Configuration Functions */
+    return NULL;
+}
 
 static const char *
-get_enabled(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+get_system_command(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-
-    if (strcmp("true", value) == 0) {
-        cfg->enabled = 1;
-    } else if (strcmp("false", value) == 0) {
-        cfg->enabled = 0;
-    } else {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSEnabled value '%s', mod_evasive disabled.", value);
-        cfg->enabled = 0;
+    if (value != NULL && value[0] != 0) {
+        if (cfg->system_command != NULL)
+            free(cfg->system_command);
+        cfg->system_command = strdup(value);
     }
 
+    cfg->set |= CONFIG_SYSTEM_COMMAND;
+
     return NULL;
 }
 
 static const char *
-get_hash_tbl_size(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+get_firewall_set(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *backend,
+                 const char *set4, const char *set6) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    char *endptr;
-    long n;
 
-    errno = 0;
-    n = strtol(value, &endptr, 0);
-    if (errno || *endptr != '\0' || n <= 0) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSHashTableSize value '%s', using default %lu.",
-                     value, DEFAULT_HASH_TBL_SIZE);
-        cfg->hash_table_size = DEFAULT_HASH_TBL_SIZE;
-    } else {
-        cfg->hash_table_size = n;
+    cfg->set |= CONFIG_FIREWALL_SET;
 
-        ntt_destroy(cfg->hit_list);
-        cfg->hit_list = ntt_create(cfg->hash_table_size);
-        if (!cfg->hit_list)
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to allocate hashtable");
+    if (strcmp("ipset", backend) == 0) {
+        cfg->firewall = FIREWALL_IPSET;
+    } else if (strcmp("nft", backend) == 0) {
+        cfg->firewall = FIREWALL_NFT;
+    } else {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSFirewallSet backend '%s', firewall sets disabled.", backend);
+        cfg->firewall = FIREWALL_NONE;
+        return NULL;
     }
 
+    free(cfg->firewall_set4);
+    free(cfg->firewall_set6);
+    cfg->firewall_set4 = strdup(set4);
+    cfg->firewall_set6 = set6 != NULL ? strdup(set6) : NULL;
+
     return NULL;
 }
 
 static const char *
-get_page_count(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+get_connection_check(__attribute__((unused)) cmd_parms *cmd, void *dconfig, int value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    char *endptr;
-    long n;
 
-    errno = 0;
-    n = strtol(value, &endptr, 0);
-    if (errno || *endptr != '\0' || n <= 0 || n > UINT_MAX) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSPageCount value '%s', using default %d.",
-                     value, DEFAULT_PAGE_COUNT);
-        cfg->page_count = DEFAULT_PAGE_COUNT;
-    } else {
-        cfg->page_count = n;
-    }
+    cfg->set |= CONFIG_CONNECTION_CHECK;
+
+    cfg->connection_check = value;
 
     return NULL;
 }
 
 static const char *
-get_site_count(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+get_list_file(cmd_parms *cmd, void *dconfig, const char *value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    char *endptr;
-    long n;
+    const char *path = ap_server_root_relative(cmd->pool, value);
 
-    errno = 0;
-    n = strtol(value, &endptr, 0);
-    if (errno || *endptr != '\0' || n <= 0 || n > UINT_MAX) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSSiteCount value '%s', using default %d.",
-                     value, DEFAULT_SITE_COUNT);
-        cfg->site_count = DEFAULT_SITE_COUNT;
-    } else {
-        cfg->site_count = n;
+    cfg->set |= CONFIG_LIST_FILE;
+
+    if (path == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSListFile value '%s', ignored.", value);
+        return NULL;
     }
 
+    free(cfg->list_path);
+    cfg->list_path = strdup(path);
+
     return NULL;
 }
 
 static const char *
-get_page_interval(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+get_event_log(cmd_parms *cmd, void *dconfig, const char *value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    char *endptr;
-    long n;
+    size_t prefix = strlen(EVENT_LOG_SOCKET);
+    const char *target;
 
-    errno = 0;
-    n = strtol(value, &endptr, 0);
-    if (errno || *endptr != '\0' || n <= 0 || n > INT_MAX) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSPageInterval value '%s', using default %d.",
-                     value, DEFAULT_PAGE_INTERVAL);
-        cfg->page_interval = DEFAULT_PAGE_INTERVAL;
+    cfg->set |= CONFIG_EVENT_LOG;
+
+    if (strncmp(value, EVENT_LOG_SOCKET, prefix) == 0) {
+        const char *path = value[prefix] != '\0' ? ap_server_root_relative(cmd->pool, value + prefix) : NULL;
+
+        target = path != NULL && strlen(path) < sizeof(((struct sockaddr_un *) NULL)->sun_path)
+                ? apr_pstrcat(cmd->pool, EVENT_LOG_SOCKET, path, NULL) : NULL;
     } else {
-        cfg->page_interval = n;
+        target = ap_server_root_relative(cmd->pool, value);
+    }
+
+    if (target == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSEventLog value '%s', ignored.", value);
+        return NULL;
     }
 
+    free(cfg->event_target);
+    cfg->event_target = strdup(target);
+
     return NULL;
 }
 
 static const char *
-get_site_interval(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+get_uri_canonical(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    char *endptr;
-    long n;
 
-    errno = 0;
-    n = strtol(value, &endptr, 0);
-    if (errno || *endptr != '\0' || n <= 0 || n > INT_MAX) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSSiteInterval value '%s', using default %d.",
-                     value, DEFAULT_SITE_INTERVAL);
-        cfg->site_interval = DEFAULT_SITE_INTERVAL;
+    cfg->set |= CONFIG_URI_CANONICAL;
+
+    if (strcmp("slashes", value) == 0) {
+        cfg->uri_canonical |= URI_MERGE_SLASHES;
+    } else if (strcmp("params", value) == 0) {
+        cfg->uri_canonical |= URI_STRIP_PARAMS;
+    } else if (strcmp("case", value) == 0) {
+        cfg->uri_canonical |= URI_LOWERCASE;
+    } else if (strcmp("trailing", value) == 0) {
+        cfg->uri_canonical |= URI_TRAILING_SLASH;
+    } else if (strcmp("pathinfo", value) == 0) {
+        cfg->uri_canonical |= URI_PATH_INFO;
+    } else if (strcmp("none", value) == 0) {
+        cfg->uri_canonical = 0;
     } else {
-        cfg->site_interval = n;
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSUriCanonical value '%s', ignored.", value);
     }
 
     return NULL;
 }
 
 static const char *
-get_blocking_period(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+get_uri_strip_prefix(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    char *endptr;
-    long n;
+    size_t length = strlen(value);
+    char **prefixes;
 
-    errno = 0;
-    n = strtol(value, &endptr, 0);
-    if (errno || *endptr != '\0' || n <= 0 || n > INT_MAX) {
-        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSBlockingPeriod value '%s', using default %d.",
-                     value, DEFAULT_BLOCKING_PERIOD);
-        cfg->blocking_period = DEFAULT_BLOCKING_PERIOD;
-    } else {
-        cfg->blocking_period = n;
+    cfg->set |= CONFIG_URI_STRIP_PREFIX;
+
+    /* Prefixes are whole segments, e.g. /en strips /en/a but not /enterprise */
+    while (length > 1 && value[length - 1] == '/')
+        length--;
+    if (value[0] != '/' || length < 2) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSUriStripPrefix value '%s', ignored.", value);
+        return NULL;
+    }
+
+    prefixes = ev_reallocarray(cfg->uri_prefixes, cfg->uri_prefixes_size + 1, sizeof(char *));
+    if (prefixes == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to allocate URI prefix");
+        return NULL;
+    }
+    cfg->uri_prefixes = prefixes;
+
+    prefixes[cfg->uri_prefixes_size] = strndup(value, length);
+    if (prefixes[cfg->uri_prefixes_size] == NULL) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, ap_server_conf, "Failed to allocate URI prefix");
+        return NULL;
     }
+    cfg->uri_prefixes_size++;
 
     return NULL;
 }
 
 static const char *
-get_log_dir(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+get_uri_routes(__attribute__((unused)) cmd_parms *cmd, void *dconfig, int value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    if (value != NULL && value[0] != 0) {
-        if (cfg->log_dir != NULL)
-            free(cfg->log_dir);
-        cfg->log_dir = strdup(value);
-    }
+
+    cfg->set |= CONFIG_URI_ROUTES;
+
+    cfg->uri_routes = value;
 
     return NULL;
 }
 
 static const char *
-get_email_notify(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+get_fast_reply(__attribute__((unused)) cmd_parms *cmd, void *dconfig, int value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    if (value != NULL && value[0] != 0) {
-        if (cfg->email_notify != NULL)
-            free(cfg->email_notify);
-        cfg->email_notify = strdup(value);
-    }
+
+    cfg->set |= CONFIG_FAST_REPLY;
+
+    cfg->fast_reply = value;
 
     return NULL;
 }
 
 static const char *
-get_system_command(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
+get_log_sample(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char *value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    if (value != NULL && value[0] != 0) {
-        if (cfg->system_command != NULL)
-            free(cfg->system_command);
-        cfg->system_command = strdup(value);
+    char *endptr;
+    long n;
+
+    cfg->set |= CONFIG_LOG_SAMPLE;
+
+    errno = 0;
+    n = strtol(value, &endptr, 0);
+    if (errno || *endptr != '\0' || n < 0 || n > UINT_MAX) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf, "Invalid DOSLogSample value '%s', using default %d.",
+                     value, DEFAULT_LOG_SAMPLE);
+        cfg->log_sample = DEFAULT_LOG_SAMPLE;
+    } else {
+        cfg->log_sample = n;
     }
 
     return NULL;
@@ -1217,6 +3856,8 @@ get_http_reply(__attribute__((unused)) cmd_parms *cmd, void *dconfig, const char
     char *endptr;
     long n;
 
+    cfg->set |= CONFIG_HTTP_STATUS;
+
     errno = 0;
     n = strtol(value, &endptr, 0);
     if (errno || *endptr != '\0' || ((n < 99 || n > 599) && n != OK && n != DECLINED)) {
@@ -1237,9 +3878,18 @@ static const command_rec access_cmds[] =
     AP_INIT_TAKE1("DOSEnabled", get_enabled, NULL, RSRC_CONF,
             "Enable mod_evasive (either globally or in the virtualhost where it is specified)"),
 
+    AP_INIT_FLAG("DOSSharedTable", get_shared_table, NULL, RSRC_CONF,
+            "Share the hash table between all child processes"),
+
+    AP_INIT_TAKE1("DOSTableScope", get_table_scope, NULL, RSRC_CONF,
+            "Count hits of virtual hosts with their own settings in tables of their own (vhost) or of the main server (server)"),
+
     AP_INIT_TAKE1("DOSHashTableSize", get_hash_tbl_size, NULL, RSRC_CONF,
             "Set size of hash table"),
 
+    AP_INIT_TAKE12("DOSSketchSize", get_sketch_size, NULL, RSRC_CONF,
+            "Count hits in fixed memory: <counters per sketch row> [<blocked clients kept>], 0 to use the hash table"),
+
     AP_INIT_TAKE1("DOSPageCount", get_page_count, NULL, RSRC_CONF,
             "Set maximum page hit count per interval"),
 
@@ -1247,10 +3897,22 @@ static const command_rec access_cmds[] =
             "Set maximum site hit count per interval"),
 
     AP_INIT_TAKE1("DOSPageInterval", get_page_interval, NULL, RSRC_CONF,
-            "Set page interval"),
+            "Set page interval, in seconds or with an ms suffix in milliseconds"),
 
     AP_INIT_TAKE1("DOSSiteInterval", get_site_interval, NULL, RSRC_CONF,
-            "Set site interval"),
+            "Set site interval, in seconds or with an ms suffix in milliseconds"),
+
+    AP_INIT_TAKE1("DOSSubnetCount", get_subnet_count, NULL, RSRC_CONF,
+            "Set maximum site hit count per site interval of all clients of a prefix, 0 to not count prefixes"),
+
+    AP_INIT_TAKE12("DOSSubnetPrefix", get_subnet_prefix, NULL, RSRC_CONF,
+            "Set prefix lengths of clients counted together by DOSSubnetCount: <IPv4 bits> [<IPv6 bits>]"),
+
+    AP_INIT_TAKE12("DOSAdaptiveLoad", get_adaptive_load, NULL, RSRC_CONF,
+            "Shrink the counts from this percentage of busy workers on: <busy %> [<% of the counts left at 100% busy>]"),
+
+    AP_INIT_TAKE1("DOSRateAlgorithm", get_rate_algorithm, NULL, RSRC_CONF,
+            "Set how hits are counted per interval: fixed, sliding or bucket"),
 
     AP_INIT_TAKE1("DOSBlockingPeriod", get_blocking_period, NULL, RSRC_CONF,
             "Set blocking period for detected DoS IPs"),
@@ -1264,6 +3926,21 @@ static const command_rec access_cmds[] =
     AP_INIT_TAKE1("DOSSystemCommand", get_system_command, NULL, RSRC_CONF,
             "Set system command on DoS"),
 
+    AP_INIT_TAKE23("DOSFirewallSet", get_firewall_set, NULL, RSRC_CONF,
+            "Add blocked IPs to an ipset or nftables set: ipset|nft <IPv4 set> [<IPv6 set>]"),
+
+    AP_INIT_TAKE1("DOSClusterAddress", get_cluster_address, NULL, RSRC_CONF,
+            "Share hits and blocks with other frontends over a multicast group: <address>:<port>"),
+
+    AP_INIT_TAKE1("DOSClusterKey", get_cluster_key, NULL, RSRC_CONF,
+            "Secret shared by the frontends of a cluster"),
+
+    AP_INIT_TAKE1("DOSClusterInterval", get_cluster_interval, NULL, RSRC_CONF,
+            "Set the interval between cluster updates, in seconds or with an ms suffix in milliseconds"),
+
+    AP_INIT_TAKE1("DOSSnapshotFile", get_snapshot_file, NULL, RSRC_CONF,
+            "Keep blocks and hit counts across restarts in this file"),
+
     AP_INIT_ITERATE("DOSWhitelist", whitelist_ip, NULL, RSRC_CONF,
             "IP-addresses wildcards to whitelist"),
 
@@ -1276,22 +3953,370 @@ static const command_rec access_cmds[] =
     AP_INIT_ITERATE("DOSBlocklistUri", blocklist_uri, NULL, RSRC_CONF,
             "Files/paths regexes to blocklist"),
 
+    AP_INIT_TAKE1("DOSListFile", get_list_file, NULL, RSRC_CONF,
+            "Precompiled whitelist and blocklists, reloaded when the file changes"),
+
+    AP_INIT_TAKE1("DOSEventLog", get_event_log, NULL, RSRC_CONF,
+            "File or unix:socket receiving the blocks and denials of clients as JSON lines"),
+
+    AP_INIT_ITERATE("DOSUriCanonical", get_uri_canonical, NULL, RSRC_CONF,
+            "Variants of a URI counted as one: slashes, params, case, trailing, pathinfo or none"),
+
+    AP_INIT_ITERATE("DOSUriStripPrefix", get_uri_strip_prefix, NULL, RSRC_CONF,
+            "Path prefixes stripped from the URIs counted"),
+
+    AP_INIT_FLAG("DOSUriRoutes", get_uri_routes, NULL, RSRC_CONF,
+            "Count the URIs matching a DOSTargetlistUri pattern as the pattern"),
+
+    AP_INIT_FLAG("DOSConnectionCheck", get_connection_check, NULL, RSRC_CONF,
+            "Close connections of blocked clients before their first request, and do not keep theirs alive"),
+
     AP_INIT_ITERATE("DOSHTTPStatus", get_http_reply, NULL, RSRC_CONF,
             "HTTP reply code"),
 
+    AP_INIT_FLAG("DOSFastReply", get_fast_reply, NULL, RSRC_CONF,
+            "Answer blocked clients with a minimal reply and a Retry-After header, without ErrorDocument"),
+
+    AP_INIT_TAKE1("DOSLogSample", get_log_sample, NULL, RSRC_CONF,
+            "Log one in this many denied clients, 0 to log none"),
+
     { NULL }
 };
 
-static void register_hooks(apr_pool_t *p) {
+static int pre_config(apr_pool_t *pconf, __attribute__((unused)) apr_pool_t *plog,
+        __attribute__((unused)) apr_pool_t *ptemp) {
+    ap_mutex_register(pconf, SHT_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+
+    return OK;
+}
+
+/* Create the shared memory segment and mutex for the configurations with DOSSharedTable; the segment also holds
+   the cluster receiver of every enabled configuration */
+
+static void sht_create(apr_pool_t *pconf, server_rec *s, size_t total, int enabled) {
+    apr_size_t size = total * sizeof(struct ntt_node) + (apr_size_t) enabled * sizeof(apr_uint32_t);
+    struct ntt_node *slots;
+    apr_uint32_t *receivers;
+    apr_status_t rv;
+
+    rv = ap_global_mutex_create(&shm_mutex, NULL, SHT_MUTEX_TYPE, NULL, s, pconf, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to create mutex for shared hashtable, using per-child hashtables");
+        shm_mutex = NULL;
+        return;
+    }
+
+    rv = apr_shm_create(&shm_segment, size, NULL, pconf);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        /* No anonymous shared memory on this platform, fall back to a named segment */
+        const char *fname = ap_runtime_dir_relative(pconf, "evasive-shm");
+
+        apr_shm_remove(fname, pconf);
+        rv = apr_shm_create(&shm_segment, size, fname, pconf);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to allocate %zu bytes of shared memory, using per-child hashtables",
+                     size);
+        apr_global_mutex_destroy(shm_mutex);
+        shm_segment = NULL;
+        shm_mutex = NULL;
+        return;
+    }
+
+    slots = (struct ntt_node *) apr_shm_baseaddr_get(shm_segment);
+    memset(slots, 0, size);
+    receivers = (apr_uint32_t *) (slots + total);
+
+    for (server_rec *vs = s; vs != NULL; vs = vs->next) {
+        evasive_config *cfg = (evasive_config *) ap_get_module_config(vs->lookup_defaults, &evasive_module);
+        struct sht *sht;
+
+        if (cfg == NULL || cfg->server != vs || !cfg->enabled)
+            continue;
+        cfg->cluster_receiver = receivers++;
+        if (!cfg->shared || cfg->table_owner != cfg)
+            continue;
+
+        sht = apr_palloc(pconf, sizeof(struct sht));
+        *sht = (struct sht) {
+            .size = ntt_size_get_next(cfg->hash_table_size),
+            .ttl = hit_list_ttl(cfg),
+            .slots = slots,
+        };
+        slots += sht->size;
+        cfg->shared_table = sht;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Allocated shared hashtable of %zu entries", total);
+}
+
+static apr_status_t sketch_cleanup(void *data) {
+    sketch_destroy((struct sketch *) data);
+    return APR_SUCCESS;
+}
+
+static apr_status_t hit_list_cleanup(void *data) {
+    ntt_destroy((struct ntt *) data);
+    return APR_SUCCESS;
+}
+
+/* Set up the per-child tables of a configuration owning its tables, for entries needed up to ttl and holds up to
+   period; the shared table and the sketch are created already */
+
+static void hit_list_create(evasive_config *cfg, server_rec *s, apr_pool_t *pconf, apr_time_t ttl,
+        apr_interval_time_t period) {
+    if (cfg->shared_table != NULL) {
+        cfg->shared_table->ttl = ttl;
+    } else if (cfg->sketch != NULL) {
+        cfg->sketch->ttl = ttl;
+    } else {
+        cfg->hit_list = ntt_create(cfg->hash_table_size, pconf);
+        if (cfg->hit_list == NULL) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Failed to allocate hashtable");
+            return;
+        }
+        ntt_set_ttl(cfg->hit_list, ttl);
+        apr_pool_cleanup_register(pconf, cfg->hit_list, hit_list_cleanup, apr_pool_cleanup_null);
+    }
+
+    /* Only holds of this child go through its filter, those in a shared table may come from any child */
+    if (cfg->shared_table == NULL) {
+        cfg->block_filter = block_filter_create(period, pconf);
+        if (cfg->block_filter == NULL)
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "Failed to allocate the blocked-address filter");
+    }
+}
+
+static apr_status_t destroy_combined(void *data) {
+    struct pcre_vector combined = { NULL, 0, *(struct pcre_node *) data };
+    pcre_vector_destroy(&combined);
+    return APR_SUCCESS;
+}
+
+/* A list is combined once, here and not in merge_dir_conf, which also runs per request. A virtual host inheriting
+   the list of an enabled main server shares its alternation, or its failure to combine; one combined in a merged
+   copy is freed with pconf, as destroy_config only frees what the configuration owning the list combined */
+
+static void list_combine(struct pcre_vector *vec, const struct pcre_vector *main_vec, apr_pool_t *pconf) {
+    if (main_vec != NULL && vec != main_vec && vec->data == main_vec->data) {
+        vec->combined = main_vec->combined;
+        return;
+    }
+    pcre_vector_combine(vec);
+    if (vec != main_vec && vec->combined.re != NULL)
+        apr_pool_cleanup_register(pconf, &vec->combined, destroy_combined, apr_pool_cleanup_null);
+}
+
+static int post_config(apr_pool_t *pconf, __attribute__((unused)) apr_pool_t *plog,
+        apr_pool_t *ptemp, server_rec *s) {
+    evasive_config *main_cfg = (evasive_config *) ap_get_module_config(s->lookup_defaults, &evasive_module);
+    apr_time_t server_ttl = 0;
+    apr_interval_time_t server_period = 0;
+    size_t total = 0;
+    int enabled = 0;
+
+    shm_segment = NULL;
+    shm_mutex = NULL;
+
+    /* Children inherit the secret, so they agree on the hash of keys in the shared table */
+    ntt_secret_init();
+    snapshot_restored = 0;
+    if (apr_generate_random_bytes((unsigned char *) &cluster_server, sizeof(cluster_server)) != APR_SUCCESS)
+        cluster_server = ntt_secret[0] ^ ntt_secret[1];
+
+    /* Nothing is shared during the configuration check */
+    if (ap_state_query(AP_SQ_MAIN_STATE) == AP_SQ_MS_CREATE_PRE_CONFIG)
+        return OK;
+
+    for (server_rec *vs = s; vs != NULL; vs = vs->next) {
+        evasive_config *cfg = (evasive_config *) ap_get_module_config(vs->lookup_defaults, &evasive_module);
+
+        /* Virtual hosts without mod_evasive directives of their own have the configuration of the main server */
+        if (cfg == NULL || cfg->server != NULL)
+            continue;
+        cfg->server = vs;
+        if (!cfg->enabled)
+            continue;
+
+        /* The main server comes first, its lists are combined before those of the virtual hosts */
+        int main_lists = main_cfg != NULL && main_cfg->enabled;
+        list_combine(&cfg->uri_whitelist, main_lists ? &main_cfg->uri_whitelist : NULL, pconf);
+        list_combine(&cfg->uri_targetlist, main_lists ? &main_cfg->uri_targetlist : NULL, pconf);
+        list_combine(&cfg->uri_blocklist, main_lists ? &main_cfg->uri_blocklist : NULL, pconf);
+
+        if (cfg->cluster_host != NULL && !cfg->cluster_keyed)
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, vs, "DOSClusterAddress without DOSClusterKey, hits are not shared");
+
+        /* DOSHTTPStatus OK or DECLINED only log, there is no reply to make and no connection to close */
+        if (cfg->connection_check && cfg->http_reply < 100)
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, vs, "DOSConnectionCheck is ignored with DOSHTTPStatus %d",
+                         cfg->http_reply);
+        if (cfg->fast_reply && cfg->http_reply >= 100) {
+            cfg->fast_reply_body = apr_pstrcat(pconf, ap_get_status_line(cfg->http_reply), "\n", NULL);
+            cfg->retry_after = apr_psprintf(pconf, "%" APR_TIME_T_FMT,
+                                            (cfg->blocking_period + APR_USEC_PER_SEC - 1) / APR_USEC_PER_SEC);
+        }
+
+        if (cfg->list_path != NULL)
+            list_watch_create(cfg, s, vs, pconf);
+        if (cfg->event_target != NULL)
+            event_log_create(cfg, s, vs, pconf);
+
+        enabled++;
+
+        /* Tables of the main server used by virtual hosts must keep entries as long as any of them needs */
+        cfg->table_owner = cfg;
+        if (cfg != main_cfg && cfg->table_scope == TABLE_SERVER) {
+            if (main_cfg != NULL && main_cfg->enabled) {
+                cfg->table_owner = main_cfg;
+                if (hit_list_ttl(cfg) > server_ttl)
+                    server_ttl = hit_list_ttl(cfg);
+                if (cfg->blocking_period > server_period)
+                    server_period = cfg->blocking_period;
+                continue;
+            }
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, vs,
+                         "DOSTableScope server needs DOSEnabled in the main server, using tables of this virtual host");
+        }
+
+        if (cfg->sketch_width > 0 && cfg->shared) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, vs, "DOSSketchSize is ignored with DOSSharedTable On, which has a fixed size already");
+        } else if (cfg->sketch_width > 0) {
+            cfg->sketch = sketch_create(cfg->sketch_width, cfg->sketch_holds, cfg->page_interval, cfg->site_interval, pconf);
+            if (cfg->sketch == NULL)
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, vs, "Failed to allocate sketch, hits are counted in the hash table");
+            else
+                apr_pool_cleanup_register(pconf, cfg->sketch, sketch_cleanup, apr_pool_cleanup_null);
+        }
+        if (cfg->shared)
+            total += ntt_size_get_next(cfg->hash_table_size);
+    }
+
+    if (enabled > 0)
+        stats_create(pconf, s);
+    if (total > 0)
+        sht_create(pconf, s, total, enabled);
+
+    for (server_rec *vs = s; vs != NULL; vs = vs->next) {
+        evasive_config *cfg = (evasive_config *) ap_get_module_config(vs->lookup_defaults, &evasive_module);
+        apr_time_t ttl;
+        apr_interval_time_t period;
+
+        if (cfg == NULL || cfg->server != vs || !cfg->enabled)
+            continue;
+
+        /* The main server comes first, its tables are set up already */
+        if (cfg->table_owner != cfg) {
+            cfg->hit_list = cfg->table_owner->hit_list;
+            cfg->shared_table = cfg->table_owner->shared_table;
+            cfg->sketch = cfg->table_owner->sketch;
+            cfg->block_filter = cfg->table_owner->block_filter;
+            if (cfg->snapshot_file != NULL)
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, vs, "DOSSnapshotFile %s is ignored with DOSTableScope server",
+                             cfg->snapshot_file);
+            continue;
+        }
+
+        ttl = hit_list_ttl(cfg);
+        period = cfg->blocking_period;
+        if (cfg == main_cfg && server_ttl > ttl)
+            ttl = server_ttl;
+        if (cfg == main_cfg && server_period > period)
+            period = server_period;
+        hit_list_create(cfg, vs, pconf, ttl, period);
+
+        if (cfg->snapshot_file == NULL)
+            continue;
+
+        snapshot_load(cfg, vs, ptemp);
+
+        /* Only the shared table is visible to this process when the pool is cleared */
+        if (cfg->shared_table != NULL)
+            apr_pool_cleanup_register(pconf, cfg, snapshot_save, apr_pool_cleanup_null);
+        else
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, vs, "DOSSnapshotFile %s is only written with DOSSharedTable On",
+                         cfg->snapshot_file);
+    }
+
+    return OK;
+}
+
+/* Size the scoreboard walk of load_sample */
+
+static void load_init(void) {
+    int daemons = 0, threads = 0;
+
+    load_daemons = 0;
+    load_threads = 0;
+    load_workers = 0;
+
+    if (!ap_exists_scoreboard_image()
+            || ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &load_daemons) != APR_SUCCESS
+            || ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &load_threads) != APR_SUCCESS
+            || ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &daemons) != APR_SUCCESS
+            || ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads) != APR_SUCCESS) {
+        load_daemons = 0;
+        return;
+    }
+
+    /* Non-threaded MPMs report no threads */
+    if (load_threads < 1)
+        load_threads = 1;
+    if (threads < 1)
+        threads = 1;
+    load_workers = daemons * threads;
+    if (load_workers < 1)
+        load_daemons = 0;
+}
+
+static void child_init(apr_pool_t *p, server_rec *s) {
+    apr_status_t rv;
+
+    notify_start(p, s);
+    stats_attach(p, s);
+    load_init();
+
+    for (server_rec *vs = s; vs != NULL; vs = vs->next) {
+        evasive_config *cfg = (evasive_config *) ap_get_module_config(vs->lookup_defaults, &evasive_module);
+
+        if (cfg != NULL && cfg->server == vs && cfg->enabled && cfg->cluster_host != NULL && cfg->cluster_keyed)
+            cluster_start(p, vs, cfg);
+        if (cfg != NULL && cfg->server == vs && cfg->enabled && cfg->list != NULL && cfg->list->server == vs)
+            list_watch_start(p, cfg->list);
+        if (cfg != NULL && cfg->server == vs && cfg->enabled && cfg->events != NULL && cfg->events->server == vs)
+            event_log_start(p, cfg->events);
+    }
+
+    rv = pcre_context_init(p);
+    if (rv != APR_SUCCESS)
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to create thread key for regex matching");
+
+    if (shm_mutex == NULL)
+        return;
+
+    rv = apr_global_mutex_child_init(&shm_mutex, apr_global_mutex_lockfile(shm_mutex), p);
+    if (rv != APR_SUCCESS)
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to attach to shared hashtable mutex");
+}
+
+static void register_hooks(__attribute__((unused)) apr_pool_t *p) {
+    evasive_log_hook = core_log;
+    ntt_event_hook = core_event;
+
+    ap_hook_pre_config(pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_pre_connection(connection_check, NULL, NULL, APR_HOOK_FIRST);
     ap_hook_access_checker(access_checker, NULL, NULL, APR_HOOK_FIRST-5);
-    apr_pool_cleanup_register(p, NULL, apr_pool_cleanup_null, destroy_config);
+    ap_hook_handler(stats_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, stats_status_hook, NULL, NULL, APR_HOOK_MIDDLE);
 };
 
 module AP_MODULE_DECLARE_DATA evasive_module =
 {
     STANDARD20_MODULE_STUFF,
     create_dir_conf,
-    NULL,
+    merge_dir_conf,
     NULL,
     NULL,
     access_cmds,
@@ -41,15 +41,14 @@
 
 #include "apr_time.h"
 
-#define PCRE2_CODE_UNIT_WIDTH 8
-#include <pcre2.h>
-
 #include "httpd.h"
 #include "http_core.h"
 #include "http_config.h"
 #include "http_log.h"
 #include "http_request.h"
 
+#include "evasive_core.h"
+
 #ifdef APLOG_USE_MODULE
 APLOG_USE_MODULE(evasive);
 #endif
@@ -70,78 +69,34 @@ module AP_MODULE_DECLARE_DATA evasive_module;
 #define DEFAULT_BLOCKING_PERIOD 10      // Default for Detected IPs; blocked for 10 seconds
 #define DEFAULT_LOG_DIR         "/temp"  // Default temp directory
 #define DEFAULT_HTTP_REPLY      HTTP_FORBIDDEN // Default HTTP Reply code (403)
+#define DEFAULT_RATE_ALGORITHM  RATE_FIXED     // Default rate algorithm, a fixed interval
 
 /* END DoS Evasive Maneuvers Definitions */
 
-/* BEGIN NTT (Named Timestamp Tree) Headers */
-
-enum { ntt_num_primes = 28 };
-
-/* ntt root tree */
-struct ntt {
-    long size;
-    long items;
-    struct ntt_node **tbl;
-};
-
-/* ntt node (entry in the ntt root tree) */
-struct ntt_node {
-    char *key;
-    time_t timestamp;
-    long count;
-    struct ntt_node *next;
-};
-
-/* ntt cursor */
-struct ntt_c {
-    long iter_index;
-    struct ntt_node *iter_next;
-};
-
-struct ntt *ntt_create(unsigned long size);
-int ntt_destroy(struct ntt *ntt);
-struct ntt_node *ntt_find(struct ntt *ntt, const char *key);
-struct ntt_node *ntt_re_find(struct ntt *ntt, const char *key);
-struct ntt_node *ntt_insert(struct ntt *ntt, const char *key, time_t timestamp);
-int ntt_delete(struct ntt *ntt, const char *key);
-long ntt_hashcode(struct ntt *ntt, const char *key); 
-struct ntt_node *c_ntt_first(struct ntt *ntt, struct ntt_c *c);
-struct ntt_node *c_ntt_next(struct ntt *ntt, struct ntt_c *c);
-
-/* END NTT (Named Timestamp Tree) Headers */
-
-
 /* BEGIN DoS Evasive Maneuvers Globals */
 
-struct pcre_node {
-    pcre2_code *re;
-    struct pcre_node *next;
-};
-
 typedef struct {
     int enabled;
     char *context;
     struct ntt *hit_list;   // Our dynamic hash table
     unsigned long hash_table_size;
-    struct pcre_node *uri_whitelist;
+    struct ip_whitelist ip_whitelist;
+    struct pcre_vector uri_whitelist;
     int page_count;
-    int page_interval;
+    apr_interval_time_t page_interval;
     int site_count;
-    int site_interval;
-    int blocking_period;
+    apr_interval_time_t site_interval;
+    apr_interval_time_t blocking_period;
+    int rate_algorithm;
     char *log_dir;
     char *system_command;
     int http_reply;
 } evasive_config;
 
-static const char *whitelist(cmd_parms *cmd, void *dconfig, const char *ip);
-int is_whitelisted(const char *ip, evasive_config *cfg);
-
-static const char *whitelist_uri(cmd_parms *cmd, void *dconfig, const char *uri_re);
-int is_uri_whitelisted(const char *uri, evasive_config *cfg);
-
 /* END DoS Evasive Maneuvers Globals */
 
+static apr_status_t destroy_config(void *dconfig);
+
 static void * create_dir_conf(apr_pool_t *p, char *context)
 {
     context = context ? context : "(undefined context)";
@@ -151,15 +106,19 @@ static void * create_dir_conf(apr_pool_t *p, char *context)
         cfg->enabled = 0;
         cfg->context = strdup(context);
         cfg->hash_table_size = DEFAULT_HASH_TBL_SIZE;
-        cfg->hit_list = ntt_create(cfg->hash_table_size);
-        cfg->uri_whitelist = NULL;
+        cfg->hit_list = ntt_create(cfg->hash_table_size, p);
         cfg->page_count = DEFAULT_PAGE_COUNT;
-        cfg->page_interval = DEFAULT_PAGE_INTERVAL;
+        cfg->page_interval = apr_time_from_sec(DEFAULT_PAGE_INTERVAL);
         cfg->site_count = DEFAULT_SITE_COUNT;
-        cfg->site_interval = DEFAULT_SITE_INTERVAL;
+        cfg->site_interval = apr_time_from_sec(DEFAULT_SITE_INTERVAL);
+        cfg->blocking_period = apr_time_from_sec(DEFAULT_BLOCKING_PERIOD);
+        cfg->rate_algorithm = DEFAULT_RATE_ALGORITHM;
         cfg->log_dir = NULL;
         cfg->system_command = NULL;
         cfg->http_reply = DEFAULT_HTTP_REPLY;
+
+        /* The hit list and the strings are freed with the configuration pool */
+        apr_pool_cleanup_register(p, cfg, destroy_config, apr_pool_cleanup_null);
     }
 
     return cfg;
@@ -168,50 +127,16 @@ static void * create_dir_conf(apr_pool_t *p, char *context)
 static const char *whitelist(cmd_parms *cmd, void *dconfig, const char *ip)
 {
     evasive_config *cfg = (evasive_config *) dconfig;
-    char entry[128];
-    snprintf(entry, sizeof(entry), "WHITELIST_%s", ip);
-    ntt_insert(cfg->hit_list, entry, time(NULL));
 
+    ip_whitelist_add(&cfg->ip_whitelist, ip);
     return NULL;
 }
 
 static const char *whitelist_uri(cmd_parms *cmd, void *dconfig, const char *uri_re)
 {
     evasive_config *cfg = (evasive_config *) dconfig;
-    struct pcre_node *node;
 
-    node = (struct pcre_node *) malloc(sizeof(struct pcre_node));
-    if (node == NULL) {
-        return NULL;
-    }
-
-    int errornumber;
-    PCRE2_SIZE erroroffset;
-
-    PCRE2_SPTR pattern;
-    pattern = (PCRE2_SPTR) uri_re;
-
-    node->re = pcre2_compile(
-            pattern,               /* the pattern */
-            PCRE2_ZERO_TERMINATED, /* indicates pattern is zero-terminated */
-            0,                     /* default options */
-            &errornumber,          /* for error number */
-            &erroroffset,          /* for error offset */
-            NULL);                 /* use default compile context */
-
-    /* Compilation failed: print the error message and exit. */
-
-    if (node->re == NULL)
-    {
-        PCRE2_UCHAR buffer[256];
-        pcre2_get_error_message(errornumber, buffer, sizeof(buffer));
-        printf("PCRE2 compilation failed at offset %d: %s\n", (int)erroroffset,
-                buffer);
-        return NULL;
-    }
-
-    node->next = cfg->uri_whitelist;
-    cfg->uri_whitelist = node;
+    pcre_vector_push(&cfg->uri_whitelist, uri_re);
     return NULL;
 }
 
@@ -224,72 +149,42 @@ static int access_checker(request_rec *r)
     /* BEGIN DoS Evasive Maneuvers Code */
 
     if (cfg->enabled && r->prev == NULL && r->main == NULL && cfg->hit_list != NULL) {
-        char hash_key[2048];
-        struct ntt_node *n;
-        time_t t = time(NULL);
+        apr_sockaddr_t *addr = r->useragent_addr;
+        struct ntt_key key;
+        apr_time_t t = apr_time_now();
 
         /* Check whitelist */
-        if (is_whitelisted(r->useragent_ip, cfg))
+        if (is_whitelisted(addr, &cfg->ip_whitelist))
             return OK;
 
         /* First see if the IP itself is on "hold" */
-        n = ntt_find(cfg->hit_list, r->useragent_ip);
+        ntt_key_init(&key, addr, NTT_KEY_IP, 0);
 
-        if (n != NULL && t-n->timestamp<cfg->blocking_period) {
+        if (ntt_on_hold(cfg->hit_list, &key, t, cfg->blocking_period)) {
 
             /* If the IP is on "hold", make it wait longer in 403 land */
             ret = cfg->http_reply;
-            n->timestamp = time(NULL);
 
             /* Not on hold, check hit stats */
         } else {
+            struct ntt_key hit_key;
 
             /* Check whitelisted uris */
-            if (is_uri_whitelisted(r->uri, cfg))
+            if (pcre_vector_match(r->uri, &cfg->uri_whitelist))
                 return OK;
 
-            /* Has URI been hit too much? */
-            snprintf(hash_key, 2048, "%s_%s", r->useragent_ip, r->uri);
-            n = ntt_find(cfg->hit_list, hash_key);
-            if (n != NULL) {
-
-                /* If URI is being hit too much, add to "hold" list and 403 */
-                if (t-n->timestamp<cfg->page_interval && n->count>=cfg->page_count) {
-                    ret = cfg->http_reply;
-                    ntt_insert(cfg->hit_list, r->useragent_ip, time(NULL));
-                } else {
-
-                    /* Reset our hit count list as necessary */
-                    if (t-n->timestamp>=cfg->page_interval) {
-                        n->count=0;
-                    }
-                }
-                n->timestamp = t;
-                n->count++;
-            } else {
-                ntt_insert(cfg->hit_list, hash_key, t);
+            /* Has URI been hit too much? If so, add to "hold" list and 403 */
+            ntt_key_init(&hit_key, addr, NTT_KEY_URI, ntt_hash_uri(r->uri));
+            if (ntt_hit(cfg->hit_list, cfg->rate_algorithm, &hit_key, t, cfg->page_interval, cfg->page_count)) {
+                ret = cfg->http_reply;
+                ntt_hold(cfg->hit_list, &key, t);
             }
 
-            /* Has site been hit too much? */
-            snprintf(hash_key, 2048, "%s_SITE", r->useragent_ip);
-            n = ntt_find(cfg->hit_list, hash_key);
-            if (n != NULL) {
-
-                /* If site is being hit too much, add to "hold" list and 403 */
-                if (t-n->timestamp<cfg->site_interval && n->count>=cfg->site_count) {
-                    ret = cfg->http_reply;
-                    ntt_insert(cfg->hit_list, r->useragent_ip, time(NULL));
-                } else {
-
-                    /* Reset our hit count list as necessary */
-                    if (t-n->timestamp>=cfg->site_interval) {
-                        n->count=0;
-                    }
-                }
-                n->timestamp = t;
-                n->count++;
-            } else {
-                ntt_insert(cfg->hit_list, hash_key, t);
+            /* Has site been hit too much? If so, add to "hold" list and 403 */
+            ntt_key_init(&hit_key, addr, NTT_KEY_SITE, 0);
+            if (ntt_hit(cfg->hit_list, cfg->rate_algorithm, &hit_key, t, cfg->site_interval, cfg->site_count)) {
+                ret = cfg->http_reply;
+                ntt_hold(cfg->hit_list, &key, t);
             }
         }
 
@@ -333,335 +228,30 @@ static int access_checker(request_rec *r)
     return ret;
 }
 
-int is_whitelisted(const char *ip, evasive_config *cfg) {
-    char hashkey[128];
-    char octet[4][4];
-    char *dip;
-    char *oct;
-    int i = 0;
-
-    memset(octet, 0, 16);
-    dip = strdup(ip);
-    if (dip == NULL)
-        return 0;
-
-    oct = strtok(dip, ".");
-    while(oct != NULL && i<4) {
-        if (strlen(oct)<=3) 
-            strcpy(octet[i], oct);
-        i++;
-        oct = strtok(NULL, ".");
-    }
-    free(dip);
-
-    /* Exact Match */
-    snprintf(hashkey, sizeof(hashkey), "WHITELIST_%s", ip); 
-    if (ntt_find(cfg->hit_list, hashkey)!=NULL)
-        return 1;
-
-    /* IPv4 Wildcards */ 
-    snprintf(hashkey, sizeof(hashkey), "WHITELIST_%s.*.*.*", octet[0]);
-    if (ntt_find(cfg->hit_list, hashkey)!=NULL)
-        return 1;
-
-    snprintf(hashkey, sizeof(hashkey), "WHITELIST_%s.%s.*.*", octet[0], octet[1]);
-    if (ntt_find(cfg->hit_list, hashkey)!=NULL)
-        return 1;
-
-    snprintf(hashkey, sizeof(hashkey), "WHITELIST_%s.%s.%s.*", octet[0], octet[1], octet[2]);
-    if (ntt_find(cfg->hit_list, hashkey)!=NULL)
-        return 1;
-
-    /* No match */
-    return 0;
-}
-
-int is_uri_whitelisted(const char *path, evasive_config *cfg) {
-
-    int rc;
-    pcre2_match_data *match_data;
-
-    PCRE2_SPTR subject;
-    size_t subject_length;
-
-    subject = (PCRE2_SPTR) path;
-    subject_length = strlen((char *)subject);
-
-    struct pcre_node *node;
-    node = cfg->uri_whitelist;
-
-    while (node != NULL) {
-        match_data = pcre2_match_data_create_from_pattern(node->re, NULL);
-
-        rc = pcre2_match(
-                node->re,             /* the compiled pattern */
-                subject,              /* the subject string */
-                subject_length,       /* the length of the subject */
-                0,                    /* start at offset 0 in the subject */
-                0,                    /* default options */
-                match_data,           /* block for storing the result */
-                NULL);                /* use default match context */
-
-        pcre2_match_data_free(match_data);   /* Release memory used for the match */
-
-        if (rc >= 0) {
-            // match
-            return 1;
-        }
-
-        node = node->next;
-    }
-
-    // no match
-    return 0;
-}
-
 static apr_status_t destroy_config(void *dconfig) {
     evasive_config *cfg = (evasive_config *) dconfig;
     if (cfg != NULL) {
         ntt_destroy(cfg->hit_list);
+        ip_whitelist_destroy(&cfg->ip_whitelist);
+        pcre_vector_destroy(&cfg->uri_whitelist);
         free(cfg->log_dir);
         free(cfg->system_command);
-        free(cfg);
+        free(cfg->context);
+        /* cfg is pool allocated */
     }
     return APR_SUCCESS;
 }
 
 
-/* BEGIN NTT (Named Timestamp Tree) Functions */
-
-static unsigned long ntt_prime_list[ntt_num_primes] = 
-{
-    53ul,         97ul,         193ul,       389ul,       769ul,
-    1543ul,       3079ul,       6151ul,      12289ul,     24593ul,
-    49157ul,      98317ul,      196613ul,    393241ul,    786433ul,
-    1572869ul,    3145739ul,    6291469ul,   12582917ul,  25165843ul,
-    50331653ul,   100663319ul,  201326611ul, 402653189ul, 805306457ul,
-    1610612741ul, 3221225473ul, 4294967291ul
-};
-
-
-/* Find the numeric position in the hash table based on key and modulus */
-
-long ntt_hashcode(struct ntt *ntt, const char *key) {
-    unsigned long val = 0;
-    for (; *key; ++key) val = 5 * val + *key;
-    return(val % ntt->size);
-}
-
-/* Creates a single node in the tree */
-
-struct ntt_node *ntt_node_create(const char *key) {
-    char *node_key;
-    struct ntt_node* node;
-
-    node = (struct ntt_node *) malloc(sizeof(struct ntt_node));
-    if (node == NULL) {
-        return NULL;
-    }
-    if ((node_key = strdup(key)) == NULL) {
-        free(node);
-        return NULL;
-    }
-    node->key = node_key;
-    node->timestamp = time(NULL);
-    node->next = NULL;
-    return(node);
-}
-
-/* Tree initializer */
-
-struct ntt *ntt_create(unsigned long size) {
-    long i = 0;
-    struct ntt *ntt = (struct ntt *) malloc(sizeof(struct ntt));
-
-    if (ntt == NULL)
-        return NULL;
-    while (ntt_prime_list[i] < size) { i++; }
-    ntt->size  = ntt_prime_list[i];
-    ntt->items = 0;
-    ntt->tbl   = (struct ntt_node **) calloc(ntt->size, sizeof(struct ntt_node *));
-    if (ntt->tbl == NULL) {
-        free(ntt);
-        return NULL;
-    }
-    return(ntt);
-}
-
-/* Find an object in the tree */
-
-struct ntt_node *ntt_find(struct ntt *ntt, const char *key) {
-    long hash_code;
-    struct ntt_node *node;
-
-    if (ntt == NULL) return NULL;
+/* Messages of the core end up in the error log of the main server */
 
-    hash_code = ntt_hashcode(ntt, key);
-    node = ntt->tbl[hash_code];
+static void core_log(int level, const char *fmt, va_list ap) {
+    char msg[MAX_STRING_LEN];
 
-    while (node) {
-        if (!strcmp(key, node->key)) {
-            return(node);
-        }
-        node = node->next;
-    }
-    return((struct ntt_node *)NULL);
+    apr_vsnprintf(msg, sizeof(msg), fmt, ap);
+    ap_log_error(APLOG_MARK, level, 0, NULL, "%s", msg);
 }
 
-/* Insert a node into the tree */
-
-struct ntt_node *ntt_insert(struct ntt *ntt, const char *key, time_t timestamp) {
-    long hash_code;
-    struct ntt_node *parent;
-    struct ntt_node *node;
-    struct ntt_node *new_node = NULL;
-
-    if (ntt == NULL) return NULL;
-
-    hash_code = ntt_hashcode(ntt, key);
-    parent = NULL;
-    node = ntt->tbl[hash_code];
-
-    while (node != NULL) {
-        if (strcmp(key, node->key) == 0) { 
-            new_node = node;
-            node = NULL;
-        }
-
-        if (new_node == NULL) {
-            parent = node;
-            node = node->next;
-        }
-    }
-
-    if (new_node != NULL) {
-        new_node->timestamp = timestamp;
-        new_node->count = 0;
-        return new_node; 
-    }
-
-    /* Create a new node */
-    new_node = ntt_node_create(key);
-    new_node->timestamp = timestamp;
-    new_node->count = 0;
-
-    ntt->items++;
-
-    /* Insert */
-    if (parent) {  /* Existing parent */
-        parent->next = new_node;
-        return new_node;  /* Return the locked node */
-    }
-
-    /* No existing parent; add directly to hash table */
-    ntt->tbl[hash_code] = new_node;
-    return new_node;
-}
-
-/* Tree destructor */
-
-int ntt_destroy(struct ntt *ntt) {
-    struct ntt_node *node, *next;
-    struct ntt_c c;
-
-    if (ntt == NULL) return -1;
-
-    node = c_ntt_first(ntt, &c);
-    while(node != NULL) {
-        next = c_ntt_next(ntt, &c);
-        ntt_delete(ntt, node->key);
-        node = next;
-    }
-
-    free(ntt->tbl);
-    free(ntt);
-    ntt = (struct ntt *) NULL;
-
-    return 0;
-}
-
-/* Delete a single node in the tree */
-
-int ntt_delete(struct ntt *ntt, const char *key) {
-    long hash_code;
-    struct ntt_node *parent = NULL;
-    struct ntt_node *node;
-    struct ntt_node *del_node = NULL;
-
-    if (ntt == NULL) return -1;
-
-    hash_code = ntt_hashcode(ntt, key);
-    node        = ntt->tbl[hash_code];
-
-    while (node != NULL) {
-        if (strcmp(key, node->key) == 0) {
-            del_node = node;
-            node = NULL;
-        }
-
-        if (del_node == NULL) {
-            parent = node;
-            node = node->next;
-        }
-    }
-
-    if (del_node != NULL) {
-
-        if (parent) {
-            parent->next = del_node->next;
-        } else {
-            ntt->tbl[hash_code] = del_node->next;
-        }
-
-        free(del_node->key);
-        free(del_node);
-        ntt->items--;
-
-        return 0;
-    }
-
-    return -5;
-}
-
-/* Point cursor to first item in tree */
-
-struct ntt_node *c_ntt_first(struct ntt *ntt, struct ntt_c *c) {
-
-    c->iter_index = 0;
-    c->iter_next = (struct ntt_node *)NULL;
-    return(c_ntt_next(ntt, c));
-}
-
-/* Point cursor to next iteration in tree */
-
-struct ntt_node *c_ntt_next(struct ntt *ntt, struct ntt_c *c) {
-    long index;
-    struct ntt_node *node = c->iter_next;
-
-    if (ntt == NULL) return NULL;
-
-    if (node) {
-        if (node != NULL) {
-            c->iter_next = node->next;
-            return (node);
-        }
-    }
-
-    if (! node) {
-        while (c->iter_index < ntt->size) {
-            index = c->iter_index++;
-
-            if (ntt->tbl[index]) {
-                c->iter_next = ntt->tbl[index]->next;
-                return(ntt->tbl[index]);
-            }
-        }
-    }
-    return((struct ntt_node *)NULL);
-}
-
-/* END NTT (Named Pointer Tree) Functions */
-
 
 /* BEGIN Configuration Functions */
 
@@ -682,7 +272,8 @@ get_hash_tbl_size(cmd_parms *cmd, void *dconfig, const char *value) {
     } else  {
         cfg->hash_table_size = n;
     }
-    cfg->hit_list = ntt_create(cfg->hash_table_size);
+    ntt_destroy(cfg->hit_list);
+    cfg->hit_list = ntt_create(cfg->hash_table_size, cmd->pool);
 
     return NULL;
 }
@@ -716,11 +307,8 @@ get_site_count(cmd_parms *cmd, void *dconfig, const char *value) {
 static const char *
 get_page_interval(cmd_parms *cmd, void *dconfig, const char *value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    long n = strtol(value, NULL, 0);
-    if (n<=0) {
-        cfg->page_interval = DEFAULT_PAGE_INTERVAL;
-    } else {
-        cfg->page_interval = n;
+    if (parse_interval(value, &cfg->page_interval) < 0) {
+        cfg->page_interval = apr_time_from_sec(DEFAULT_PAGE_INTERVAL);
     }
 
     return NULL;
@@ -729,11 +317,8 @@ get_page_interval(cmd_parms *cmd, void *dconfig, const char *value) {
 static const char *
 get_site_interval(cmd_parms *cmd, void *dconfig, const char *value) {
     evasive_config *cfg = (evasive_config *) dconfig;
-    long n = strtol(value, NULL, 0);
-    if (n<=0) {
-        cfg->site_interval = DEFAULT_SITE_INTERVAL;
-    } else {
-        cfg->site_interval = n;
+    if (parse_interval(value, &cfg->site_interval) < 0) {
+        cfg->site_interval = apr_time_from_sec(DEFAULT_SITE_INTERVAL);
     }
 
     return NULL;
@@ -744,9 +329,19 @@ get_blocking_period(cmd_parms *cmd, void *dconfig, const char *value) {
     evasive_config *cfg = (evasive_config *) dconfig;
     long n = strtol(value, NULL, 0);
     if (n<=0) {
-        cfg->blocking_period = DEFAULT_BLOCKING_PERIOD;
+        cfg->blocking_period = apr_time_from_sec(DEFAULT_BLOCKING_PERIOD);
     } else {
-        cfg->blocking_period = n;
+        cfg->blocking_period = apr_time_from_sec(n);
+    }
+
+    return NULL;
+}
+
+static const char *
+get_rate_algorithm(cmd_parms *cmd, void *dconfig, const char *value) {
+    evasive_config *cfg = (evasive_config *) dconfig;
+    if (parse_rate_algorithm(value, &cfg->rate_algorithm) < 0) {
+        cfg->rate_algorithm = DEFAULT_RATE_ALGORITHM;
     }
 
     return NULL;
@@ -806,10 +401,13 @@ static const command_rec access_cmds[] =
             "Set maximum site hit count per interval"),
 
     AP_INIT_TAKE1("DOSPageInterval", get_page_interval, NULL, RSRC_CONF,
-            "Set page interval"),
+            "Set page interval, in seconds or with an ms suffix in milliseconds"),
 
     AP_INIT_TAKE1("DOSSiteInterval", get_site_interval, NULL, RSRC_CONF,
-            "Set site interval"),
+            "Set site interval, in seconds or with an ms suffix in milliseconds"),
+
+    AP_INIT_TAKE1("DOSRateAlgorithm", get_rate_algorithm, NULL, RSRC_CONF,
+            "Set how hits are counted per interval: fixed, sliding or bucket"),
 
     AP_INIT_TAKE1("DOSBlockingPeriod", get_blocking_period, NULL, RSRC_CONF,
             "Set blocking period for detected DoS IPs"),
@@ -833,9 +431,38 @@ static const command_rec access_cmds[] =
     { NULL }
 };
 
+static int post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s) {
+    ntt_secret_init();
+
+    /* Entries expire once they no longer matter to any interval */
+    for (server_rec *vs = s; vs != NULL; vs = vs->next) {
+        evasive_config *cfg = (evasive_config *) ap_get_module_config(vs->lookup_defaults, &evasive_module);
+
+        if (cfg == NULL)
+            continue;
+
+        pcre_vector_combine(&cfg->uri_whitelist);
+        if (cfg->hit_list != NULL)
+            ntt_set_ttl(cfg->hit_list, hit_ttl(cfg->rate_algorithm, cfg->blocking_period, cfg->page_interval,
+                        cfg->site_interval));
+    }
+
+    return OK;
+}
+
+static void child_init(apr_pool_t *p, server_rec *s) {
+    apr_status_t rv = pcre_context_init(p);
+
+    if (rv != APR_SUCCESS)
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to create thread key for regex matching");
+}
+
 static void register_hooks(apr_pool_t *p) {
+    evasive_log_hook = core_log;
+
+    ap_hook_post_config(post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(child_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_access_checker(access_checker, NULL, NULL, APR_HOOK_MIDDLE);
-    apr_pool_cleanup_register(p, NULL, apr_pool_cleanup_null, destroy_config);
 };
 
 module AP_MODULE_DECLARE_DATA evasive_module =
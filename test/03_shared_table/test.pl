@@ -0,0 +1,40 @@
+#!/usr/bin/perl
+
+# test.pl: test that mod_evasive's shared hash table counts hits across children
+# - requires virtualhosts a.site and b.site to be setup, each with their own mod_evasive config
+# - every request uses a new connection, so requests are spread over all children
+
+use IO::Socket;
+use strict;
+
+sub request {
+  my($address,$uri,$i) = @_;
+  my($response);
+  my($SOCKET) = new IO::Socket::INET( Proto   => "tcp",
+                                      PeerAddr=> "127.0.0.1:1980");
+  if (! defined $SOCKET) { die $!; }
+  print $SOCKET "GET $uri HTTP/1.1\r\n";
+  print $SOCKET "Host: $address\r\n";
+  print $SOCKET "Connection: close\r\n\r\n";
+  $response = <$SOCKET>;
+	chomp $response;
+  print "$i - $address: $response\n";
+  close($SOCKET);
+  return $response;
+}
+
+# With a shared table the third hit on the same page within a second must be
+# blocked, no matter which child handles it
+my $blocked = 0;
+for(0..5) {
+	$blocked++ if (request("a.site", "/j_spring_security_check", $_) =~ / 403 /);
+}
+print "a.site: $blocked of 6 requests blocked (expected 3 or more)\n";
+
+# b.site has its own table, so a.site's blocking list must not affect it
+$blocked = 0;
+for(0..5) {
+	$blocked++ if (request("b.site", "/", $_) =~ / 403 /);
+}
+print "b.site: $blocked of 6 requests blocked (expected 0)\n";
+print "done.\n"
@@ -0,0 +1,66 @@
+// vim:ts=4:shiftwidth=4:et
+/*
+   mod_evasive list compiler
+   Copyright (c) by Jonathan A. Zdziarski
+
+   LICENSE
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either version 2
+   of the License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+/* Compiles a list source into the file read by DOSListFile. Children of the
+   server map the new file within a second, without a restart.
+
+   usage: evasive_list source list_file
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "apr_general.h"
+#include "apr_pools.h"
+
+#include "evasive_core.h"
+
+static void list_log(int level, const char *fmt, va_list ap) {
+    (void) level;
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+}
+
+int main(int argc, char *argv[]) {
+    apr_pool_t *pool;
+    int rc;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s source list_file\n", argv[0]);
+        return 2;
+    }
+
+    if (apr_initialize() != APR_SUCCESS || apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        fprintf(stderr, "Failed to initialize APR\n");
+        return 1;
+    }
+    evasive_log_hook = list_log;
+
+    rc = list_file_compile(argv[1], argv[2], pool);
+
+    apr_pool_destroy(pool);
+    apr_terminate();
+
+    return rc == 0 ? 0 : 1;
+}